@@ -0,0 +1,146 @@
+/*
+ * Host Arduino - Native stand-in for the parts of the Arduino ESP32 core the protocol code uses
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Arduino.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <random>
+#include <thread>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+HardwareSerial Serial(0, STDOUT_FILENO);
+
+static std::chrono::steady_clock::time_point clockStart() {
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return start;
+}
+
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - clockStart()).count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - clockStart()).count();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+static uint8_t pinLevels[64];
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin < sizeof(pinLevels) && mode == INPUT_PULLUP) {
+    pinLevels[pin] = HIGH;
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < sizeof(pinLevels)) {
+    pinLevels[pin] = value ? HIGH : LOW;
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return (pin < sizeof(pinLevels)) ? pinLevels[pin] : LOW;
+}
+
+long map(long x, long inMin, long inMax, long outMin, long outMax) {
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+static std::mt19937& generator() {
+  static std::mt19937 rng(1);
+  return rng;
+}
+
+long random(long howBig) {
+  return (howBig <= 0) ? 0 : (long)(generator()() % (unsigned long)howBig);
+}
+
+long random(long howSmall, long howBig) {
+  return (howSmall >= howBig) ? howSmall : howSmall + random(howBig - howSmall);
+}
+
+void randomSeed(unsigned long seed) {
+  generator().seed(seed);
+}
+
+size_t Print::print(const char* text) {
+  return write(reinterpret_cast<const uint8_t*>(text), strlen(text));
+}
+
+size_t Print::println(const char* text) {
+  return print(text) + print("\n");
+}
+
+size_t Print::printf(const char* format, ...) {
+  char buffer[512];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (len <= 0) {
+    return 0;
+  }
+  return write(reinterpret_cast<const uint8_t*>(buffer), min((size_t)len, sizeof(buffer) - 1));
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  if (fd < 0) {
+    return size;  // Unconnected, like a UART with nothing on its pins
+  }
+  size_t written = 0;
+  while (written < size) {
+    ssize_t n = ::write(fd, buffer + written, size - written);
+    if (n <= 0) {
+      break;
+    }
+    written += n;
+  }
+  return written;
+}
+
+int HardwareSerial::available() {
+  int waiting = 0;
+  if (fd < 0 || ioctl(fd, FIONREAD, &waiting) < 0) {
+    return 0;
+  }
+  return waiting;
+}
+
+int HardwareSerial::read() {
+  uint8_t value;
+  return (read(&value, 1) == 1) ? value : -1;
+}
+
+size_t HardwareSerial::read(uint8_t* buffer, size_t size) {
+  size_t waiting = available();
+  if (waiting == 0) {
+    return 0;
+  }
+  ssize_t n = ::read(fd, buffer, min(size, waiting));
+  return (n > 0) ? n : 0;
+}
+
+void HardwareSerial::poll() {
+  if (receiveCallback && available() > 0) {
+    receiveCallback();
+  }
+}
@@ -0,0 +1,64 @@
+/*
+ * Host Arduino - Native stand-in for the parts of the Arduino ESP32 core the protocol code uses
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using std::min;
+using std::max;
+
+#define IRAM_ATTR
+
+#define LOW 0x0
+#define HIGH 0x1
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+// GPIO with nothing attached: a pin reads back what was last written to it, and
+// an input with a pull-up reads HIGH
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+long map(long x, long inMin, long inMax, long outMin, long outMax);
+
+// Milliseconds and microseconds since the first call, from the monotonic clock
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+long random(long howBig);
+long random(long howSmall, long howBig);
+void randomSeed(unsigned long seed);
+
+// The host tools run the protocol from a single thread, so critical sections have
+// nothing to exclude
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+
+#include "HardwareSerial.h"
+
+#endif // HOST_ARDUINO_H
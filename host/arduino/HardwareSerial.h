@@ -0,0 +1,77 @@
+/*
+ * Host HardwareSerial - UART stand-in on a file descriptor
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOST_HARDWARE_SERIAL_H
+#define HOST_HARDWARE_SERIAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#define SERIAL_8N1 0x800001c
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+  size_t write(uint8_t value) { return write(&value, 1); }
+  size_t print(const char* text);
+  size_t println(const char* text = "");
+  size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+};
+
+// A UART whose bytes go to and come from a file descriptor: a pty for the MCU
+// simulator, stdout for Serial, or nothing at all (-1) when a transmit hook and
+// injected data stand in for the wire. Nothing runs in the background, so the
+// owner calls poll() to deliver the onReceive() callback.
+class HardwareSerial : public Stream {
+private:
+  int fd;
+  std::function<void(void)> receiveCallback;
+
+public:
+  explicit HardwareSerial(int uart, int fd = -1) : fd(fd) { (void)uart; }
+
+  void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rxPin = -1, int8_t txPin = -1) {
+    (void)baud; (void)config; (void)rxPin; (void)txPin;
+  }
+  void onReceive(std::function<void(void)> callback, bool onlyOnTimeout = false) {
+    (void)onlyOnTimeout;
+    receiveCallback = callback;
+  }
+
+  using Print::write;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  size_t read(uint8_t* buffer, size_t size);
+
+  // Host only
+  void attach(int descriptor) { fd = descriptor; }
+  int handle() const { return fd; }
+  void poll();  // Run the onReceive() callback if bytes are waiting
+};
+
+extern HardwareSerial Serial;
+
+#endif // HOST_HARDWARE_SERIAL_H
@@ -0,0 +1,34 @@
+/*
+ * Host Preferences - NVS stand-in that never holds anything
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOST_PREFERENCES_H
+#define HOST_PREFERENCES_H
+
+#include <cstddef>
+
+// The host tools start from an empty store every run, so nothing is ever found and
+// writes are accepted and forgotten
+class Preferences {
+public:
+  bool begin(const char* name, bool readOnly = false) { (void)name; (void)readOnly; return true; }
+  void end() {}
+  size_t getBytes(const char* key, void* buffer, size_t len) { (void)key; (void)buffer; (void)len; return 0; }
+  size_t putBytes(const char* key, const void* value, size_t len) { (void)key; (void)value; return len; }
+  bool remove(const char* key) { (void)key; return true; }
+};
+
+#endif // HOST_PREFERENCES_H
@@ -0,0 +1,24 @@
+/*
+ * Tuya Protocol Benchmark - Host runner for TuyaBenchmark
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Arduino.h>
+#include "TuyaBenchmark.h"
+
+int main() {
+  HardwareSerial link(1);  // Unconnected; the benchmark never begins it
+  return TuyaBenchmark::run(&link) ? 0 : 1;
+}
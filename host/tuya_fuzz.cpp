@@ -0,0 +1,48 @@
+/*
+ * Tuya Fuzz - libFuzzer entry point for the frame decoder and DP parser
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Arduino.h>
+#include "TuyaFuzz.h"
+
+// The first byte of an input picks where it is split between the two reads; the
+// rest is what the MCU sent. The checks are the on-device fuzzer's invariants, and
+// any failure aborts so the fuzzer keeps the input, as it does for sanitizer errors.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  static HardwareSerial link(1);  // Unconnected; the decoder is never begun
+  static TuyaFuzz::Input in;
+  if (size == 0) {
+    return 0;
+  }
+
+  in.len = min(size - 1, (size_t)FUZZ_MAX_INPUT);
+  memcpy(in.data, &data[1], in.len);
+  const TuyaFuzz::Results before = TuyaFuzz::results;
+  TuyaFuzz::execute(&link, in, data[0] % (in.len + 1));
+
+  // Slow inputs are left to the fuzzer's own -timeout, as the sanitizers and a busy
+  // machine both stretch the on-device limit
+  const TuyaFuzz::Results& after = TuyaFuzz::results;
+  if (after.outOfRangeValues != before.outOfRangeValues || after.overConsumed != before.overConsumed ||
+      after.badFrames != before.badFrames) {
+    ::printf("out-of-range DPs %lu, over-consumed %lu, bad frames sent %lu\n",
+             (unsigned long)(after.outOfRangeValues - before.outOfRangeValues),
+             (unsigned long)(after.overConsumed - before.overConsumed),
+             (unsigned long)(after.badFrames - before.badFrames));
+    abort();
+  }
+  return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Tuya Fuzz Driver - Stands in for libFuzzer where the compiler does not ship it
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Arduino.h>
+#include "TuyaFuzz.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+// Accepts the libFuzzer arguments the tests use: corpus files or directories,
+// -runs=N and -max_total_time=S. Every corpus input is run once, then mutations of
+// them (TuyaFuzz's mutator, without coverage feedback) until either limit is hit.
+int main(int argc, char** argv) {
+  unsigned long maxRuns = 0;
+  unsigned long maxSeconds = 0;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.rfind("-runs=", 0) == 0) {
+      maxRuns = std::stoul(arg.substr(6));
+    } else if (arg.rfind("-max_total_time=", 0) == 0) {
+      maxSeconds = std::stoul(arg.substr(16));
+    } else if (arg[0] == '-') {
+      ::printf("ignoring %s\n", arg.c_str());
+    } else if (std::filesystem::is_directory(arg)) {
+      for (const auto& entry : std::filesystem::directory_iterator(arg)) {
+        paths.push_back(entry.path().string());
+      }
+    } else {
+      paths.push_back(arg);
+    }
+  }
+
+  for (const std::string& path : paths) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    LLVMFuzzerTestOneInput(bytes.data(), bytes.size());
+    if (TuyaFuzz::corpusCount < FUZZ_CORPUS_SIZE) {
+      TuyaFuzz::Input& in = TuyaFuzz::corpus[TuyaFuzz::corpusCount++];
+      in.len = min(bytes.size(), (size_t)FUZZ_MAX_INPUT);
+      memcpy(in.data, bytes.data(), in.len);
+    }
+  }
+  ::printf("%zu inputs run\n", paths.size());
+  if (TuyaFuzz::corpusCount == 0 || (maxRuns == 0 && maxSeconds == 0)) {
+    return 0;
+  }
+
+  static TuyaFuzz::Input candidate;
+  unsigned long execs = 0;
+  auto start = std::chrono::steady_clock::now();
+  double elapsed = 0;
+  while ((maxRuns == 0 || execs < maxRuns) && (maxSeconds == 0 || elapsed < maxSeconds)) {
+    candidate = TuyaFuzz::corpus[TuyaFuzz::randomBelow(TuyaFuzz::corpusCount)];
+    uint8_t edits = 1 + TuyaFuzz::randomBelow(4);
+    for (uint8_t i = 0; i < edits; i++) {
+      TuyaFuzz::mutate(&candidate);
+    }
+    LLVMFuzzerTestOneInput(candidate.data, candidate.len);
+    execs++;
+    if ((execs & 0x3FF) == 0) {
+      elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+  }
+  elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  ::printf("Done %lu runs in %.1f s (%.0f execs/s)\n", execs, elapsed, execs / (elapsed > 0 ? elapsed : 1));
+  return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Tuya Fuzz Seeds - Writes the real MCU frames TuyaFuzz starts from as a corpus directory
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Arduino.h>
+#include "TuyaFuzz.h"
+#include <filesystem>
+
+// One file per seed, in a directory created if need be. Each is in the tuya_fuzz
+// input format: a split byte (here the middle of the input) followed by the frames.
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    ::printf("usage: %s <corpus directory>\n", argv[0]);
+    return 2;
+  }
+
+  std::error_code error;
+  std::filesystem::create_directories(argv[1], error);
+  TuyaFuzz::buildSeeds();
+  for (uint8_t i = 0; i < TuyaFuzz::corpusCount; i++) {
+    const TuyaFuzz::Input& seed = TuyaFuzz::corpus[i];
+    char path[512];
+    snprintf(path, sizeof(path), "%s/seed-%02u", argv[1], i);
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+      ::printf("cannot write %s\n", path);
+      return 1;
+    }
+    uint8_t split = min(seed.len / 2, 0xFF);
+    fwrite(&split, 1, 1, file);
+    fwrite(seed.data, 1, seed.len, file);
+    fclose(file);
+  }
+  ::printf("%u seeds written to %s\n", TuyaFuzz::corpusCount, argv[1]);
+  return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Tuya MCU Simulator - Simulated fan MCU on a pseudo-terminal
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Arduino.h>
+#include "TuyaMcuSimulator.h"
+#include "TuyaTrace.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+static TuyaMcuSimulator simulator;
+
+static void onCommandComplete(uint8_t handle, uint8_t dpid, TuyaCommandStatus status) {
+  (void)dpid;
+  simulator.onCommandComplete(handle, status);
+}
+
+// Bridge side of the link, as the sketch records it with SKYFAN_TRACE
+static void onLinkTrace(bool sent, const uint8_t* data, uint16_t len) {
+  linkTrace.record(sent ? TraceEvent::MCU_TX : TraceEvent::MCU_RX, data, len);
+}
+
+static void usage(const char* name) {
+  ::printf("usage: %s [--serve] [--duration=S] [--latency=MS] [--jitter=MS] [--drop=PER_MILLE]\n"
+           "       [--burst-interval=MS] [--burst-size=N] [--load=DPS_PER_S] [--report=MS] [--trace=FILE]\n"
+           "\n"
+           "Runs the simulated MCU on a new pty and prints its path. By default a TuyaProtocol\n"
+           "bridge is run on the other end under scripted load. With --serve the pty is left\n"
+           "for another program, such as a bridge build using a serial port, until stopped.\n"
+           "--trace saves the bridge's side of the link for tuya_trace_replay. The scripted\n"
+           "load has no Zigbee callback behind it, so use --load=0 for a trace that replays\n"
+           "without differences.\n", name);
+}
+
+int main(int argc, char** argv) {
+  static const struct option options[] = {
+    { "serve", no_argument, nullptr, 's' },
+    { "duration", required_argument, nullptr, 'd' },
+    { "latency", required_argument, nullptr, 'l' },
+    { "jitter", required_argument, nullptr, 'j' },
+    { "drop", required_argument, nullptr, 'x' },
+    { "burst-interval", required_argument, nullptr, 'b' },
+    { "burst-size", required_argument, nullptr, 'n' },
+    { "load", required_argument, nullptr, 'r' },
+    { "report", required_argument, nullptr, 'p' },
+    { "trace", required_argument, nullptr, 't' },
+    { nullptr, 0, nullptr, 0 }
+  };
+
+  SimulatorProfile profile;
+  bool serve = false;
+  const char* tracePath = nullptr;
+  unsigned long durationMs = 10000;
+  int option;
+  while ((option = getopt_long(argc, argv, "", options, nullptr)) != -1) {
+    uint32_t value = optarg ? strtoul(optarg, nullptr, 10) : 0;
+    switch (option) {
+      case 's': serve = true; break;
+      case 'd': durationMs = value * 1000UL; break;
+      case 'l': profile.latencyMs = value; break;
+      case 'j': profile.jitterMs = value; break;
+      case 'x': profile.dropPerMille = value; break;
+      case 'b': profile.burstIntervalMs = value; break;
+      case 'n': profile.burstSize = value; break;
+      case 'r': profile.loadRate = value; break;
+      case 'p': profile.reportIntervalMs = value; break;
+      case 't': tracePath = optarg; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if (serve && durationMs == 10000) {
+    durationMs = 0;  // Until stopped, unless a duration was given
+  }
+
+  // The simulator holds the master side; the slave side is the MCU's UART as the
+  // bridge sees it. It is kept open here too so the pty survives clients reconnecting.
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    perror("pty");
+    return 1;
+  }
+  const char* path = ptsname(master);
+  int slave = open(path, O_RDWR | O_NOCTTY);
+  if (slave < 0) {
+    perror(path);
+    return 1;
+  }
+  struct termios raw;
+  tcgetattr(slave, &raw);
+  cfmakeraw(&raw);
+  tcsetattr(slave, TCSANOW, &raw);
+  ::printf("MCU simulator on %s\n", path);
+  fflush(stdout);
+
+  HardwareSerial simulatorLine(2, master);
+  HardwareSerial bridgeLine(1, slave);
+  TuyaProtocol bridge(&bridgeLine);
+  simulator.setProfile(profile);
+  if (serve) {
+    simulator.attach(nullptr, &simulatorLine);
+  } else {
+    if (tracePath) {
+      bridge.setTraceHook(onLinkTrace);
+      linkTrace.start();
+      TRACE_ZIGBEE(ZIGBEE_NETWORK, 1);  // The bridge runs joined throughout
+    }
+    bridge.begin();
+    bridge.setCommandCallback(onCommandComplete);
+    simulator.attach(&bridge, &simulatorLine);
+  }
+
+  unsigned long start = millis();
+  while (durationMs == 0 || millis() - start < durationMs) {
+    uint8_t bytes[TUYA_BUFFER_SIZE];
+    size_t len;
+    while ((len = simulatorLine.read(bytes, sizeof(bytes))) > 0) {
+      simulator.receiveBytes(bytes, len);
+    }
+    unsigned long next = simulator.update();
+
+    if (!serve) {
+      bridgeLine.poll();
+      bridge.update(true);
+      next = min(next, bridge.msUntilNextEvent());
+    }
+
+    struct pollfd waiting[2] = { { master, POLLIN, 0 }, { slave, POLLIN, 0 } };
+    ::poll(waiting, serve ? 1 : 2, (int)min(next, 1000UL));
+  }
+
+  if (serve) {
+    return 0;
+  }
+  simulator.printLoadStats();
+  if (tracePath) {
+    FILE* file = fopen(tracePath, "w");
+    if (!file) {
+      perror(tracePath);
+      return 1;
+    }
+    HardwareSerial traceFile(3, fileno(file));
+    linkTrace.dump(traceFile);
+    fclose(file);
+    ::printf("Trace of %lu bytes saved to %s\n", (unsigned long)linkTrace.size(), tracePath);
+  }
+  const SimulatorLoadStats& load = simulator.getLoadStats();
+  return ((load.issued == 0 || load.acked > 0) && load.timedOut == 0) ? 0 : 1;
+}
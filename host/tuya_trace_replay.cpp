@@ -0,0 +1,132 @@
+/*
+ * Tuya Trace Replay - Replays a saved link trace through TuyaProtocol on the host
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Arduino.h>
+#include "SkyfanBridge.h"
+#include <poll.h>
+
+// The sketch's bridge with its Zigbee side reduced to counters. Coordinator writes
+// and MCU reports go through the same writers and status handlers as on the device.
+class ReplayBridge : public SkyfanBridge {
+public:
+  uint32_t statusReports;
+  uint32_t attributeUpdates;
+
+  ReplayBridge() : SkyfanBridge(1), statusReports(0), attributeUpdates(0) {}  // UART never begun
+
+protected:
+  bool publishFanMode(uint8_t) override { return publish(); }
+  bool publishFanSpeed(uint8_t) override { return publish(); }
+  bool publishFanDirection(uint8_t) override { return publish(); }
+  bool publishLightState(bool) override { return publish(); }
+  bool publishLightLevel(uint8_t) override { return publish(); }
+  bool publishLightColourTemp(uint16_t) override { return publish(); }
+
+  // The replay loop services the link and the transition on every pass, and the
+  // host has nowhere to save state to
+  void linkPending() override {}
+  void transitionPending() override {}
+  void stateChanged() override {}
+
+private:
+  bool publish() {
+    attributeUpdates++;
+    return true;
+  }
+};
+
+static ReplayBridge bridge;
+static TraceReplayer replayer;
+static bool zigbeeConnected = false;
+
+static void onDeviceStatus(uint8_t dpid, uint32_t value) {
+  bridge.statusReports++;
+  bridge.onDeviceStatus(dpid, value);
+}
+
+static void onStateSynced(bool mcuRestarted) {
+  bridge.onStateSynced(mcuRestarted);
+}
+
+// Network state belongs to the sketch rather than the bridge
+static void onReplayZigbee(TraceEvent event, const uint8_t* data, uint8_t len) {
+  if (!bridge.replayZigbee(event, data, len) && event == TraceEvent::ZIGBEE_NETWORK && len >= 1) {
+    zigbeeConnected = data[0] != 0;
+  }
+}
+
+// Exits 0 only if every frame matched, so a trace replayed at its own speed can
+// serve as a regression test. Heartbeats follow the clock, so at other speeds
+// some are expected to differ.
+int main(int argc, char** argv) {
+  uint32_t speed = TRACE_REPLAY_SPEED;
+  const char* path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--speed=", 8) == 0) {
+      speed = strtoul(argv[i] + 8, nullptr, 10);
+    } else if (argv[i][0] != '-' && !path) {
+      path = argv[i];
+    } else {
+      path = nullptr;
+      break;
+    }
+  }
+  if (!path) {
+    ::printf("usage: %s [--speed=N] <trace file>\n"
+             "Speed 1 keeps the recorded timing, N runs N times faster and 0 as fast as possible.\n", argv[0]);
+    return 2;
+  }
+
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    return 2;
+  }
+  char line[256];
+  bool loaded = false;
+  while (!loaded && fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    loaded = linkTrace.load(line);
+  }
+  fclose(file);
+  if (!loaded) {
+    ::printf("%s: no complete TRACE BEGIN ... TRACE END block\n", path);
+    return 2;
+  }
+
+  bridge.tuya.setDeviceStatusCallback(onDeviceStatus);
+  bridge.tuya.setSyncCallback(onStateSynced);
+  replayer.attach(&bridge.tuya, &linkTrace);
+  replayer.setZigbeeHandler(onReplayZigbee);
+  replayer.setSpeed(speed);
+  replayer.start();
+
+  while (replayer.isRunning()) {
+    unsigned long next = replayer.update();
+    next = min(next, bridge.stepTransition());
+    bridge.tuya.update(zigbeeConnected);
+    next = min(next, bridge.tuya.msUntilNextEvent());
+    if (replayer.isRunning() && next > 0) {
+      ::poll(nullptr, 0, (int)min(next, 1000UL));
+    }
+  }
+
+  const TraceReplayStats& stats = replayer.getStats();
+  ::printf("Replay: %lu DP reports delivered to the status handlers, %lu attribute updates published\n",
+           (unsigned long)bridge.statusReports, (unsigned long)bridge.attributeUpdates);
+  return (stats.framesDiffered + stats.framesExtra + stats.framesMissing == 0) ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+/*
+ * Latency Histogram - Fixed-bucket latency distribution with percentile estimates
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <Arduino.h>
+
+#define LATENCY_BUCKET_COUNT 16
+
+// Recording is O(buckets) with no allocation. Percentiles resolve to the upper
+// bound of the bucket they fall in, so they never under-report.
+class LatencyHistogram {
+private:
+  // Upper bound (inclusive, ms) of each bucket; anything slower lands in the overflow bucket
+  static constexpr uint16_t BUCKET_LIMITS_MS[LATENCY_BUCKET_COUNT] = {
+    1, 2, 3, 5, 7, 10, 15, 20, 30, 50, 75, 100, 150, 200, 300, 500
+  };
+
+  uint32_t buckets[LATENCY_BUCKET_COUNT + 1];
+  uint32_t count;
+  uint16_t maxMs;
+
+public:
+  LatencyHistogram() {
+    reset();
+  }
+
+  void reset() {
+    memset(buckets, 0, sizeof(buckets));
+    count = 0;
+    maxMs = 0;
+  }
+
+  void record(unsigned long ms) {
+    uint8_t bucket = 0;
+    while (bucket < LATENCY_BUCKET_COUNT && ms > BUCKET_LIMITS_MS[bucket]) {
+      bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    if (ms > maxMs) {
+      maxMs = (ms > 0xFFFF) ? 0xFFFF : ms;
+    }
+  }
+
+  // Estimated latency (ms) below which pct percent of samples fall; 0 when empty
+  uint16_t percentile(uint8_t pct) const {
+    if (count == 0) {
+      return 0;
+    }
+    uint32_t target = ((uint64_t)count * pct + 99) / 100;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+      seen += buckets[i];
+      if (seen >= target) {
+        return (BUCKET_LIMITS_MS[i] < maxMs) ? BUCKET_LIMITS_MS[i] : maxMs;
+      }
+    }
+    return maxMs;
+  }
+
+  uint32_t getCount() const {
+    return count;
+  }
+
+  uint16_t getMax() const {
+    return maxMs;
+  }
+};
+
+#endif // LATENCY_HISTOGRAM_H
@@ -0,0 +1,142 @@
+/*
+ * Light Transition - Steps the MCU's quantised light levels through a timed transition
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIGHT_TRANSITION_H
+#define LIGHT_TRANSITION_H
+
+#include <Arduino.h>
+#include "SkyfanConfig.h"
+
+// Where a transition should end up, in Tuya units
+struct TransitionTarget {
+  bool hasLevel;
+  uint8_t level;
+  bool hasColourTemp;
+  uint8_t colourTemp;
+  unsigned long durationMs;
+};
+
+// The MCU only has 6 dimmer and 3 colour temperature levels, so a transition is
+// at most a handful of steps spread evenly over its duration. request() and
+// cancel() may be called from the Zigbee task; begin(), step() and
+// msUntilNextStep() belong to the main loop.
+class LightTransition {
+private:
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+  
+  bool requested = false;
+  TransitionTarget pending = {};
+  
+  bool active = false;
+  uint8_t fromLevel = 0;
+  uint8_t toLevel = 0;
+  uint8_t fromColourTemp = 0;
+  uint8_t toColourTemp = 0;
+  uint8_t steps = 0;
+  uint8_t stepIndex = 0;
+  unsigned long startTime = 0;
+  unsigned long durationMs = 0;
+  
+  static uint8_t distance(uint8_t a, uint8_t b) {
+    return (a > b) ? a - b : b - a;
+  }
+  
+  // Level after step k of steps, rounded to the nearest Tuya unit
+  static uint8_t interpolate(uint8_t from, uint8_t to, uint8_t k, uint8_t steps) {
+    int16_t delta = (int16_t)to - from;
+    int16_t offset = (delta * k + (delta >= 0 ? steps / 2 : -(steps / 2))) / steps;
+    return from + offset;
+  }
+  
+  unsigned long stepDue(uint8_t k) const {
+    return startTime + (durationMs * k) / steps;
+  }
+
+public:
+  // Replace any pending or running transition
+  void request(const TransitionTarget& target) {
+    portENTER_CRITICAL(&lock);
+    pending = target;
+    requested = true;
+    active = false;
+    portEXIT_CRITICAL(&lock);
+  }
+  
+  void cancel() {
+    portENTER_CRITICAL(&lock);
+    requested = false;
+    active = false;
+    portEXIT_CRITICAL(&lock);
+  }
+  
+  bool isBusy() {
+    portENTER_CRITICAL(&lock);
+    bool busy = requested || active;
+    portEXIT_CRITICAL(&lock);
+    return busy;
+  }
+  
+  // Start a requested transition from the MCU's current levels; false if none is pending
+  bool begin(uint8_t currentLevel, uint8_t currentColourTemp) {
+    portENTER_CRITICAL(&lock);
+    bool started = requested;
+    if (requested) {
+      requested = false;
+      fromLevel = currentLevel;
+      toLevel = pending.hasLevel ? pending.level : currentLevel;
+      fromColourTemp = currentColourTemp;
+      toColourTemp = pending.hasColourTemp ? pending.colourTemp : currentColourTemp;
+      steps = max(distance(fromLevel, toLevel), distance(fromColourTemp, toColourTemp));
+      stepIndex = 0;
+      startTime = millis();
+      durationMs = pending.durationMs;
+      active = steps > 0;
+    }
+    portEXIT_CRITICAL(&lock);
+    return started;
+  }
+  
+  // Levels for the next step once it is due. The first step goes out after
+  // 1/steps of the duration and the last lands exactly at the end.
+  bool step(uint8_t* level, uint8_t* colourTemp) {
+    portENTER_CRITICAL(&lock);
+    bool due = active && (long)(millis() - stepDue(stepIndex + 1)) >= 0;
+    if (due) {
+      stepIndex++;
+      *level = interpolate(fromLevel, toLevel, stepIndex, steps);
+      *colourTemp = interpolate(fromColourTemp, toColourTemp, stepIndex, steps);
+      active = stepIndex < steps;
+    }
+    portEXIT_CRITICAL(&lock);
+    return due;
+  }
+  
+  unsigned long msUntilNextStep() {
+    portENTER_CRITICAL(&lock);
+    unsigned long wait = TIMER_NO_DEADLINE;
+    if (requested) {
+      wait = 0;
+    } else if (active) {
+      long remaining = (long)(stepDue(stepIndex + 1) - millis());
+      wait = (remaining > 0) ? remaining : 0;
+    }
+    portEXIT_CRITICAL(&lock);
+    return wait;
+  }
+};
+
+#endif // LIGHT_TRANSITION_H
@@ -0,0 +1,519 @@
+/*
+ * Skyfan Bridge - Mapping between Zigbee fan/light state and the Tuya MCU's data points
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SKYFAN_BRIDGE_H
+#define SKYFAN_BRIDGE_H
+
+#include <Arduino.h>
+#include "SkyfanConfig.h"
+#include "SkyfanLog.h"
+#include "SkyfanScenes.h"
+#include "SkyfanSettings.h"
+#include "LightTransition.h"
+#include "TuyaProtocol.h"
+#include "TuyaTrace.h"
+
+// ZCL Fan Control cluster FanMode values
+#define ZCL_FAN_MODE_OFF     0
+#define ZCL_FAN_MODE_LOW     1
+#define ZCL_FAN_MODE_MEDIUM  2
+#define ZCL_FAN_MODE_HIGH    3
+#define ZCL_FAN_MODE_ON      4
+
+// Switch and speed DPs for a ZCL fan mode (speed 0 = leave the speed alone);
+// false for modes the fan does not have
+inline bool zclFanModeToTuya(uint8_t mode, bool* on, uint8_t* speed) {
+  *on = (mode != ZCL_FAN_MODE_OFF);
+  switch (mode) {
+    case ZCL_FAN_MODE_OFF:    *speed = 0; return true;
+    case ZCL_FAN_MODE_LOW:    *speed = FAN_SPEED_LOW_TUYA; return true;
+    case ZCL_FAN_MODE_MEDIUM: *speed = FAN_SPEED_MEDIUM_TUYA; return true;
+    case ZCL_FAN_MODE_HIGH:   *speed = FAN_SPEED_HIGH_TUYA; return true;
+    case ZCL_FAN_MODE_ON:     *speed = 0; return true;
+    default:                  return false;
+  }
+}
+
+inline const char* zclFanModeName(uint8_t mode) {
+  static const char* const NAMES[] = { "OFF", "LOW", "MEDIUM", "HIGH", "ON" };
+  return (mode <= ZCL_FAN_MODE_ON) ? NAMES[mode] : "?";
+}
+
+// One fan MCU as seen from Zigbee: coordinator writes become DP writes, and MCU
+// status reports become attribute updates. Everything here runs on the main loop,
+// apart from requestTransition(), which the Zigbee task may call.
+//
+// The Zigbee side is left to the owner, which publishes the values the status
+// handlers hand it and wakes whatever services the link. The sketch does this with
+// its endpoints and scheduler; the host trace replayer with counters, so a replay
+// goes through the same writers and handlers as the device.
+class SkyfanBridge {
+public:
+  uint8_t index;
+
+  // Hardware UART for Tuya MCU communication
+  HardwareSerial serial;
+  TuyaProtocol tuya;
+
+  // Level and colour temperature fades, stepped on the MCU by the main loop
+  LightTransition lightTransition;
+
+  // Echo-loop detection: when MCU state was last pushed to each endpoint, and how often
+  // the coordinator answered with a write that would not change anything
+  unsigned long fanPublishedAt;
+  unsigned long lightPublishedAt;
+  uint32_t loopsDetected;
+
+  // Fan and light state kept across power cuts, written to NVS after a quiet period
+  DeviceStateStore deviceState;
+
+  SkyfanBridge(uint8_t uart)
+    : index(0), serial(uart), tuya(&serial), fanPublishedAt(0), lightPublishedAt(0), loopsDetected(0) {}
+
+  virtual ~SkyfanBridge() {}
+
+  /********************* coordinator writes **************************/
+
+  void setFan(uint8_t mode) {
+    TRACE_ZIGBEE(ZIGBEE_FAN_MODE, mode);
+    bool on;
+    uint8_t speed;
+    if (!zclFanModeToTuya(mode, &on, &speed)) {
+      LOG_EVENT(FAN_MODE_UNHANDLED, index, mode);
+      return;
+    }
+    if (isNoOpWrite(fanHasMode(mode), fanPublishedAt)) {
+      return;
+    }
+
+    // Switch and speed go out together in one frame
+    tuya.beginBatch();
+    tuya.setFanSwitch(on);
+    if (speed != 0 && !tuya.setFanSpeed(speed)) {
+      LOG_EVENT(FAN_SPEED_SET_FAILED, index, zclFanModeName(mode));
+    }
+    LOG_EVENT(FAN_MODE_SET, index, zclFanModeName(mode));
+    commitBatch("fan");
+  }
+
+  void setFanDirection(uint8_t direction) {
+    TRACE_ZIGBEE(ZIGBEE_FAN_DIRECTION, direction);
+    if (isNoOpWrite(mcuHasValue(DP_FAN_DIRECTION, direction), fanPublishedAt)) {
+      return;
+    }
+
+    if (tuya.setFanDirection(direction)) {
+      LOG_EVENT(FAN_DIRECTION_SET, index, direction,
+        (direction == static_cast<uint8_t>(FanDirection::FORWARD)) ? "FORWARD" : "REVERSE");
+    } else {
+      LOG_EVENT(FAN_DIRECTION_SET_FAILED, index, direction);
+    }
+    linkPending();
+    captureDeviceState();
+  }
+
+  void setLight(bool on, uint8_t level, uint16_t colourTempMired) {
+    TRACE_ZIGBEE(ZIGBEE_LIGHT, on, level, static_cast<uint8_t>(colourTempMired & 0xFF), static_cast<uint8_t>(colourTempMired >> 8));
+    if (on && lightTransition.isBusy()) {
+      // The stack is stepping through a transition we are running on the MCU ourselves;
+      // only the switch (for move-to-level with on/off) needs to follow it
+      if (tuya.setLightSwitch(true)) {
+        linkPending();
+      }
+      return;
+    }
+    lightTransition.cancel();
+
+    if (isNoOpWrite(lightHasState(on, level, colourTempMired), lightPublishedAt)) {
+      return;
+    }
+
+    // Light callback - handle all light changes (on/off, brightness, colour temp) in one frame
+    tuya.beginBatch();
+    tuya.setLightSwitch(on);
+
+    if (on) {
+      // Convert Zigbee brightness (0-254) to Tuya brightness (0-5)
+      uint8_t tuyaBrightness = zigbeeBrightnessToTuya(level);
+      if (!tuya.setLightBrightness(tuyaBrightness)) {
+        LOG_EVENT(LIGHT_BRIGHTNESS_SET_FAILED, index, tuyaBrightness);
+      }
+
+      // Convert mired to Tuya colour temp values
+      ColourTempLevel tuyaColourTemp = miredToTuyaColourTemp(colourTempMired);
+      if (!tuya.setLightColourTemp(static_cast<uint8_t>(tuyaColourTemp))) {
+        LOG_EVENT(LIGHT_COLOUR_TEMP_SET_FAILED, index, static_cast<uint8_t>(tuyaColourTemp));
+      }
+    }
+
+    commitBatch("light");
+
+    LOG_EVENT(LIGHT_SET, index, on ? "ON" : "OFF", level, colourTempMired, miredToKelvin(colourTempMired));
+  }
+
+  // A move-to-level or move-to-colour-temperature long enough to fade on the MCU
+  // (Zigbee task). Its steps are sent by stepTransition().
+  void requestTransition(const TransitionTarget& target) {
+    TRACE_ZIGBEE(ZIGBEE_TRANSITION, target.hasLevel, target.level, target.hasColourTemp, target.colourTemp,
+                 static_cast<uint8_t>(target.durationMs & 0xFF), static_cast<uint8_t>((target.durationMs >> 8) & 0xFF),
+                 static_cast<uint8_t>((target.durationMs >> 16) & 0xFF), static_cast<uint8_t>(target.durationMs >> 24));
+    lightTransition.request(target);
+    transitionPending();
+  }
+
+  // One frame per step, carrying only the DPs that change; returns ms until the next step
+  unsigned long stepTransition() {
+    uint32_t level = TUYA_BRIGHTNESS_MIN;
+    uint32_t colourTemp = static_cast<uint8_t>(ColourTempLevel::WARM);
+    tuya.getDataPointState(DP_LIGHT_DIMMER, &level);
+    tuya.getDataPointState(DP_LIGHT_COLOUR_TEMP, &colourTemp);
+    lightTransition.begin(level, colourTemp);
+
+    uint8_t nextLevel;
+    uint8_t nextColourTemp;
+    if (lightTransition.step(&nextLevel, &nextColourTemp)) {
+      tuya.beginBatch();
+      tuya.setLightBrightness(nextLevel);
+      tuya.setLightColourTemp(nextColourTemp);
+      commitBatch("light transition");
+    }
+    return lightTransition.msUntilNextStep();
+  }
+
+  // Write every DP of the scene in one frame, past any writes still coalescing, then
+  // publish the values ourselves (the MCU's echoes of our own writes are absorbed).
+  // Only DPs the frame took are published, and none if it could not be sent, so the
+  // endpoints never show a scene the MCU did not get.
+  void applyScene(const SceneValues& scene) {
+#if SKYFAN_TRACE
+    linkTrace.record(TraceEvent::ZIGBEE_SCENE, reinterpret_cast<const uint8_t*>(&scene), sizeof(SceneValues));
+#endif
+    if (scene.known & SCENE_LIGHT_DATA_POINTS) {
+      lightTransition.cancel();
+    }
+
+    uint8_t applied = 0;
+    uint16_t accepted = 0;
+    uint32_t value;
+    tuya.beginBatch(true);
+    for (const TuyaDataPoint& dp : TUYA_DATA_POINT_TABLE) {
+      if (scene.get(dp.dpid, &value) && tuya.addDataPoint(dp.dpid, dp.type, value)) {
+        accepted |= sceneDataPointBit(dp.dpid);
+        applied++;
+      }
+    }
+    if (!commitBatch("scene")) {
+      return;
+    }
+
+    for (const TuyaDataPoint& dp : TUYA_DATA_POINT_TABLE) {
+      if ((accepted & sceneDataPointBit(dp.dpid)) && scene.get(dp.dpid, &value)) {
+        onDeviceStatus(dp.dpid, value);
+      }
+    }
+    LOG_EVENT(SCENE_RECALLED, index, applied);
+  }
+
+#if SKYFAN_TRACE_REPLAY
+  // A recorded Zigbee callback, back through the writer that recorded it. False for
+  // events that are not about this fan (network state belongs to the owner).
+  bool replayZigbee(TraceEvent event, const uint8_t* data, uint8_t len) {
+    switch (event) {
+      case TraceEvent::ZIGBEE_FAN_MODE:
+        if (len >= 1) {
+          setFan(data[0]);
+        }
+        return true;
+      case TraceEvent::ZIGBEE_FAN_DIRECTION:
+        if (len >= 1) {
+          setFanDirection(data[0]);
+        }
+        return true;
+      case TraceEvent::ZIGBEE_LIGHT:
+        if (len >= 4) {
+          setLight(data[0] != 0, data[1], data[2] | (data[3] << 8));
+        }
+        return true;
+      case TraceEvent::ZIGBEE_TRANSITION:
+        if (len >= 8) {
+          TransitionTarget target = {};
+          target.hasLevel = data[0] != 0;
+          target.level = data[1];
+          target.hasColourTemp = data[2] != 0;
+          target.colourTemp = data[3];
+          target.durationMs = data[4] | (data[5] << 8) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+          requestTransition(target);
+        }
+        return true;
+      case TraceEvent::ZIGBEE_SCENE:
+        if (len == sizeof(SceneValues)) {
+          SceneValues scene;
+          memcpy(&scene, data, sizeof(SceneValues));
+          applyScene(scene);
+        }
+        return true;
+      default:
+        return false;
+    }
+  }
+#endif
+
+  /********************* MCU status **************************/
+
+  // One case per TUYA_DATA_POINTS entry, range-checked against its descriptor.
+  // Reports that only confirm our own writes are absorbed by TuyaProtocol and never get here.
+#define DISPATCH_DATA_POINT(name, dpid, type, min, max, handler) \
+    case DP_##name: \
+      if (!isValidTuyaDataPoint(DP_##name, value)) { \
+        LOG_EVENT(INVALID_STATUS, index, dpid, value); \
+      } else { \
+        handler(value); \
+      } \
+      break;
+
+  void onDeviceStatus(uint8_t dpid, uint32_t value) {
+    switch (dpid) {
+      TUYA_DATA_POINTS(DISPATCH_DATA_POINT)
+
+      default:
+        handleUnknownStatus(dpid, value);
+        break;
+    }
+    captureDeviceState();
+  }
+
+#undef DISPATCH_DATA_POINT
+
+  // Runs after a full-state sync has pushed every reported DP through onDeviceStatus
+  void onStateSynced(bool mcuRestarted) {
+    LOG_EVENT(STATE_SYNCED, index, tuya.getProductInfo());
+    if (mcuRestarted) {
+      restoreMcuState();
+    }
+  }
+
+  // The MCU link runs from boot, so by the time a join completes the shadow usually
+  // holds the fan's state (DPs it has not reported yet fall back to the saved state).
+  // Push it through the status handlers so the endpoints hold current values and every
+  // cluster reports them to the network.
+  void restoreEndpointState() {
+    uint8_t restored = 0;
+    uint32_t value;
+    for (const TuyaDataPoint& dp : TUYA_DATA_POINT_TABLE) {
+      if (lastKnownState(dp.dpid, &value)) {
+        onDeviceStatus(dp.dpid, value);
+        restored++;
+      }
+    }
+    LOG_EVENT(ENDPOINTS_RESTORED, index, restored);
+  }
+
+  // MCU state if we have it, otherwise what was saved before the last power cut
+  bool lastKnownState(uint8_t dpid, uint32_t* value) {
+    return tuya.getDataPointState(dpid, value) || deviceState.get(dpid, value);
+  }
+
+protected:
+  // Zigbee side, provided by the owner. The publish functions return false if the
+  // endpoint could not be updated.
+  virtual bool publishFanMode(uint8_t mode) = 0;        // ZCL_FAN_MODE_OFF or ZCL_FAN_MODE_ON
+  virtual bool publishFanSpeed(uint8_t speed) = 0;      // Tuya speed, mapped to LOW/MEDIUM/HIGH
+  virtual bool publishFanDirection(uint8_t direction) = 0;
+  virtual bool publishLightState(bool on) = 0;
+  virtual bool publishLightLevel(uint8_t level) = 0;    // Zigbee level
+  virtual bool publishLightColourTemp(uint16_t mired) = 0;
+  virtual void linkPending() = 0;        // Frames are waiting to go to the MCU
+  virtual void transitionPending() = 0;  // stepTransition() should run soon
+  virtual void stateChanged() = 0;       // deviceState has changes to save
+
+private:
+  bool mcuHasValue(uint8_t dpid, uint32_t value) {
+    uint32_t current;
+    return tuya.getDataPointState(dpid, &current) && current == value;
+  }
+
+  // A Zigbee write that asks for the state the MCU already has. Shortly after we
+  // published MCU state it is the coordinator echoing our own report back.
+  bool isNoOpWrite(bool noOp, unsigned long publishedAt) {
+    if (noOp && publishedAt != 0 && millis() - publishedAt < ECHO_LOOP_WINDOW_MS) {
+      loopsDetected++;
+    }
+    return noOp;
+  }
+
+  bool fanHasMode(uint8_t mode) {
+    bool on;
+    uint8_t speed;
+    return zclFanModeToTuya(mode, &on, &speed) && mcuHasValue(DP_FAN_SWITCH, on ? 1 : 0) &&
+           (speed == 0 || mcuHasValue(DP_FAN_SPEED, speed));
+  }
+
+  bool lightHasState(bool on, uint8_t level, uint16_t colourTempMired) {
+    if (!on) {
+      return mcuHasValue(DP_LIGHT_SWITCH, 0);
+    }
+    return mcuHasValue(DP_LIGHT_SWITCH, 1) &&
+           mcuHasValue(DP_LIGHT_DIMMER, zigbeeBrightnessToTuya(level)) &&
+           mcuHasValue(DP_LIGHT_COLOUR_TEMP, static_cast<uint8_t>(miredToTuyaColourTemp(colourTempMired)));
+  }
+
+  // Send the open batch; an empty batch just means every write was redundant or coalesced.
+  // False if the batch could not be tracked or queued.
+  bool commitBatch(const char* what) {
+    bool empty = tuya.isBatchEmpty();
+    bool sent = (tuya.commitBatch() != TUYA_INVALID_HANDLE) || empty;
+    if (!sent) {
+      LOG_EVENT(COMMAND_QUEUE_FAILED, index, what);
+    }
+    linkPending();
+    captureDeviceState();
+    return sent;
+  }
+
+  // Feed the state store from the shadow, which holds MCU reports and our own writes
+  // alike (echoes of our writes are absorbed before they reach the status handlers)
+  void captureDeviceState() {
+    uint32_t value;
+    for (const TuyaDataPoint& dp : TUYA_DATA_POINT_TABLE) {
+      if (tuya.getDataPointState(dp.dpid, &value)) {
+        deviceState.update(dp.dpid, value);
+      }
+    }
+    if (deviceState.isDirty()) {
+      stateChanged();
+    }
+  }
+
+  // The MCU powers up with its own defaults; put back what it had before the power cut.
+  // The echoes are absorbed, so push the restored values to the endpoints ourselves.
+  void restoreMcuState() {
+    uint8_t restored = 0;
+    uint32_t saved;
+
+    tuya.beginBatch();
+    for (const TuyaDataPoint& dp : TUYA_DATA_POINT_TABLE) {
+      if (deviceState.getCommitted(dp.dpid, &saved) && !mcuHasValue(dp.dpid, saved) &&
+          tuya.addDataPoint(dp.dpid, dp.type, saved)) {
+        restored++;
+      }
+    }
+    commitBatch("state restore");
+
+    if (restored > 0) {
+      LOG_EVENT(MCU_STATE_RESTORED, index, restored);
+      restoreEndpointState();
+    }
+  }
+
+  // The Zigbee fan mode reflects switch and speed together, so derive it from both
+  // rather than letting a switch report overwrite LOW/MEDIUM/HIGH with a bare ON
+  bool publishFan() {
+    uint32_t on = 0;
+    uint32_t speed = 0;
+    fanPublishedAt = millis();
+
+    if (lastKnownState(DP_FAN_SWITCH, &on) && on == 0) {
+      return publishFanMode(ZCL_FAN_MODE_OFF);
+    }
+    if (lastKnownState(DP_FAN_SPEED, &speed) && speed != TUYA_FAN_SPEED_MIN) {
+      return publishFanSpeed(speed);
+    }
+    return publishFanMode(ZCL_FAN_MODE_ON);
+  }
+
+  /********************* individual device status handlers **************************/
+  // Values are range-checked against TUYA_DATA_POINTS before a handler is called.
+
+  // Handle fan switch status updates from MCU
+  void handleFanSwitchStatus(uint32_t value) {
+    bool fanOn = (value != 0);
+    if (!publishFan()) {
+      LOG_EVENT(FAN_SWITCH_UPDATE_FAILED, index, fanOn ? "ON" : "OFF");
+    }
+    LOG_EVENT(FAN_SWITCH_STATUS, index, fanOn ? "ON" : "OFF");
+  }
+
+  // Handle fan speed status updates from MCU
+  void handleFanSpeedStatus(uint32_t value) {
+    uint8_t speed = static_cast<uint8_t>(value);
+    if (!publishFan()) {
+      LOG_EVENT(FAN_SPEED_UPDATE_FAILED, index, speed);
+    }
+    LOG_EVENT(FAN_SPEED_STATUS, index, speed);
+  }
+
+  // Handle fan mode status updates from MCU (MCU-only, not exposed to Zigbee)
+  void handleFanModeStatus(uint32_t value) {
+    uint8_t mode = static_cast<uint8_t>(value);
+    LOG_EVENT(FAN_MODE_STATUS, index, mode,
+      (mode == static_cast<uint8_t>(TuyaFanMode::NORMAL)) ? "NORMAL" :
+      (mode == static_cast<uint8_t>(TuyaFanMode::ECO)) ? "ECO" : "SLEEP");
+  }
+
+  // Handle fan direction status updates from MCU
+  void handleFanDirectionStatus(uint32_t value) {
+    uint8_t direction = static_cast<uint8_t>(value);
+    fanPublishedAt = millis();
+    if (!publishFanDirection(direction)) {
+      LOG_EVENT(FAN_DIRECTION_UPDATE_FAILED, index, direction);
+    }
+    LOG_EVENT(FAN_DIRECTION_STATUS, index, direction,
+      (direction == static_cast<uint8_t>(FanDirection::FORWARD)) ? "FORWARD" : "REVERSE");
+  }
+
+  // Handle light switch status updates from MCU
+  void handleLightSwitchStatus(uint32_t value) {
+    bool lightOn = (value != 0);
+    lightPublishedAt = millis();
+    if (!publishLightState(lightOn)) {
+      LOG_EVENT(LIGHT_SWITCH_UPDATE_FAILED, index, lightOn ? "ON" : "OFF");
+    }
+    LOG_EVENT(LIGHT_SWITCH_STATUS, index, lightOn ? "ON" : "OFF");
+  }
+
+  // Handle light brightness status updates from MCU
+  void handleLightBrightnessStatus(uint32_t value) {
+    uint8_t tuyaBrightness = static_cast<uint8_t>(value);
+    uint8_t zigbeeBrightness = tuyaBrightnessToZigbee(tuyaBrightness);
+    lightPublishedAt = millis();
+    if (!publishLightLevel(zigbeeBrightness)) {
+      LOG_EVENT(LIGHT_LEVEL_UPDATE_FAILED, index, zigbeeBrightness);
+    }
+    LOG_EVENT(LIGHT_BRIGHTNESS_STATUS, index, tuyaBrightness, zigbeeBrightness);
+  }
+
+  // Handle light colour temperature status updates from MCU
+  void handleLightColourTempStatus(uint32_t value) {
+    uint8_t colourTempValue = static_cast<uint8_t>(value);
+    ColourTempLevel colourLevel = static_cast<ColourTempLevel>(colourTempValue);
+    uint16_t colourTempMired = tuyaColourTempToMired(colourLevel);
+    lightPublishedAt = millis();
+
+    if (!publishLightColourTemp(colourTempMired)) {
+      LOG_EVENT(LIGHT_TEMP_UPDATE_FAILED, index, colourTempMired);
+    }
+    LOG_EVENT(LIGHT_COLOUR_TEMP_STATUS, index,
+      colourTempValue, colourTempMired, miredToKelvin(colourTempMired));
+  }
+
+  // Handle unknown/unsupported status updates from MCU
+  void handleUnknownStatus(uint8_t dpid, uint32_t value) {
+    LOG_EVENT(UNKNOWN_STATUS, index, dpid, value);
+  }
+};
+
+#endif // SKYFAN_BRIDGE_H
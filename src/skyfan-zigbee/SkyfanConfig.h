@@ -34,20 +34,54 @@
 #define ZIGBEE_FAN_MODEL_NAME          "Skyfan"
 #define ZIGBEE_LIGHT_MODEL_NAME        "Skyfan Light"
 
+// === Fan Configuration ===
+// One row per fan MCU, each on its own UART:
+//   X(uart, rxPin, txPin, fanEndpoint, lightEndpoint)
+// Pins of -1 keep the UART's default pins. For a second fan on UART1, add e.g.
+//   X(1, 4, 5, 3, 4)
+#define SKYFAN_FANS(X) \
+  X(0, -1, -1, ZIGBEE_FAN_CONTROL_ENDPOINT, ZIGBEE_LIGHT_CONTROL_ENDPOINT)
+
+#define SKYFAN_FAN_ROW(...) + 1
+constexpr uint8_t SKYFAN_FAN_COUNT = 0 SKYFAN_FANS(SKYFAN_FAN_ROW);
+#undef SKYFAN_FAN_ROW
+
 // === Timing Configuration ===
 #define TUYA_HEARTBEAT_INTERVAL_MS     10000  // 10 seconds
+#define TUYA_HEARTBEAT_RETRY_MS        1000   // Heartbeat interval while the MCU is not answering
 #define TUYA_CONNECTION_TIMEOUT_MS     30000  // 30 seconds
-#define TUYA_RESPONSE_TIMEOUT_MS       1000   // 1 second
 #define TUYA_COMMAND_TIMEOUT_MS        500    // 0.5 seconds
+#define TUYA_RETRY_BACKOFF_MS          100    // Pause before resending an unacknowledged write, doubled each retry
+#define TUYA_COMMAND_ATTEMPTS          3      // Sends of a DP write before giving up
+#define TUYA_COMMAND_DEADLINE_MS       3000   // Give up on a DP write this long after it was first sent
+#define TUYA_COALESCE_WINDOW_MS        50     // Minimum spacing between writes to the same DP
+#define TUYA_FRAME_TIMEOUT_MS          50     // Give up on a partially received frame after this
+#define TUYA_SYNC_SETTLE_MS            20     // Sync ends once the MCU's DP dump has been quiet this long
+#define TUYA_SYNC_TIMEOUT_MS           100    // Longest a sync waits before applying what it has
 #define FACTORY_RESET_HOLD_TIME_MS     3000   // 3 seconds
 #define BUTTON_DEBOUNCE_DELAY_MS       100    // 100ms
 #define BUTTON_POLL_DELAY_MS           50     // 50ms
-#define MAIN_LOOP_DELAY_MS             100    // 100ms
-#define ZIGBEE_CONNECTION_POLL_MS      100    // 100ms
+#define ZIGBEE_STATUS_POLL_INTERVAL_MS 250    // Zigbee network state check for LED and MCU updates
+#define DIAGNOSTICS_REFRESH_INTERVAL_MS 30000 // Diagnostics cluster snapshot period
+#define ECHO_LOOP_WINDOW_MS            1000   // Redundant Zigbee writes this soon after a report count as a loop
+#define TRANSITION_MIN_DURATION_MS     200    // Shorter Zigbee transitions jump straight to the target
+#define REPORT_GATHER_WINDOW_MS        20     // Changes within this window share one attribute report
+#define REPORT_MIN_INTERVAL_MS         500    // Minimum spacing of reports per cluster
+#define REPORT_MAX_INTERVAL_MS         300000 // Re-report unchanged attributes after this (0 = never)
+#define STATE_COMMIT_QUIET_MS          5000   // Save fan/light state once changes have stopped this long
+#define STATE_COMMIT_MAX_DELAY_MS      60000  // Save anyway after this long with unsaved changes
+#define SCENE_RECALL_MERGE_MS          20     // A recall reaching both endpoints within this goes out as one frame
 #define FACTORY_RESET_DELAY_MS         1000   // 1 second
 
+// === Scheduler Configuration ===
+#define SCHEDULER_MAX_TIMERS           (9 + 4 * SKYFAN_FAN_COUNT)  // Shared timers plus link, transition, state and scenes per fan
+#define TIMER_NO_DEADLINE              0xFFFFFFFFUL  // "Nothing to do until an event arrives"
+
+// === Scene Configuration ===
+#define SCENE_TABLE_SIZE               16     // Scenes stored per fan (each holds both endpoints' halves)
+#define SCENE_COMMAND_QUEUE_SIZE       8      // Scenes/Groups commands per fan waiting for the main loop
+
 // === LED Status Indication Timing ===
-#define LED_STATUS_UPDATE_INTERVAL_MS  100    // Check LED status every 100ms
 #define LED_FLASH_ON_TIME_MS           200    // Flash duration when connected
 #define LED_FLASH_INTERVAL_MS          5000   // Flash every 5 seconds when connected
 #define LED_RAPID_FLASH_ON_TIME_MS     100    // Rapid flash on time (initialising)
@@ -83,7 +117,72 @@
 
 // === Buffer Configuration ===
 #define TUYA_BUFFER_SIZE               256
-#define TUYA_RX_BUFFER_SIZE            256
+#define TUYA_RX_BUFFER_SIZE            256    // Receive ring buffer, must be a power of two
+#define TUYA_MAX_PENDING_COMMANDS      8      // Outstanding commands awaiting an ACK
+#define TUYA_MAX_COALESCED_DPS         8      // DPs tracked by the write coalescer
+#define TUYA_TX_QUEUE_DEPTH            4      // Frames waiting per transmit priority class
+#define TUYA_TX_FRAME_SIZE             64     // Longest queued frame (a batch of every registered DP)
+#define TUYA_TX_MAX_WAIT_MS            50     // A frame queued this long goes ahead of higher priority classes
+
+// === Diagnostics Configuration ===
+// Settings in #ifndef may also be given on the compiler command line (the host build does)
+#ifndef SKYFAN_BENCHMARK
+#define SKYFAN_BENCHMARK               0      // 1 = run the protocol throughput benchmark at boot
+#endif
+#ifndef BENCHMARK_ITERATIONS
+#define BENCHMARK_ITERATIONS           2000
+#endif
+
+// Mutation fuzzing of the frame decoder and DP parser on a private protocol instance
+#ifndef SKYFAN_FUZZ
+#define SKYFAN_FUZZ                    0      // 1 = fuzz the decoder at boot
+#endif
+#define FUZZ_DURATION_MS               60000
+#define FUZZ_SEED                      1      // Same seed, same sequence of inputs
+#define FUZZ_CORPUS_SIZE               32     // Seed frames plus inputs that showed new behaviour
+
+// Simulated Tuya MCU in place of the fan (link is looped back inside the ESP32, or a pty on the host)
+#ifndef SKYFAN_MCU_SIMULATOR
+#define SKYFAN_MCU_SIMULATOR           0      // 1 = replace the fan MCU with the simulator
+#endif
+#define SIMULATOR_LATENCY_MS           5      // Base response latency
+#define SIMULATOR_JITTER_MS            5      // Random extra latency (0..jitter)
+#define SIMULATOR_DROP_PER_MILLE       0      // Probability of dropping each response byte
+#define SIMULATOR_BURST_INTERVAL_MS    0      // Unsolicited report burst period (0 = off)
+#define SIMULATOR_BURST_SIZE           5      // Reports per burst
+#define SIMULATOR_LOAD_RATE            200    // Scripted DP changes per second (0 = off)
+#define SIMULATOR_REPORT_INTERVAL_MS   5000   // Load statistics print period
+#define SIMULATOR_OUTBOX_SIZE          16     // Responses in flight
+
+// Link trace: MCU bytes in both directions and Zigbee callbacks, with microsecond timestamps
+#ifndef SKYFAN_TRACE
+#define SKYFAN_TRACE                   0      // 1 = record a trace in RAM ("dump" over USB to print it)
+#endif
+#ifndef SKYFAN_TRACE_REPLAY
+#define SKYFAN_TRACE_REPLAY            0      // 1 = replay a trace sent over USB instead of talking to the MCU
+#endif
+#define TRACE_BUFFER_SIZE              8192   // Trace ring, must be a power of two; oldest records are overwritten
+#define TRACE_REPLAY_SPEED             1      // 1 = original timing, N = N times faster, 0 = as fast as possible
+#define TRACE_COMMAND_POLL_MS          100    // USB command/trace input check while tracing
+
+// === Logging Configuration ===
+#define LOG_LEVEL_NONE                 0
+#define LOG_LEVEL_ERROR                1
+#define LOG_LEVEL_WARN                 2
+#define LOG_LEVEL_INFO                 3
+#define LOG_LEVEL_DEBUG                4
+#ifndef SKYFAN_LOG_LEVEL                             // Events above this level are compiled out
+#ifdef NDEBUG
+#define SKYFAN_LOG_LEVEL               LOG_LEVEL_ERROR  // Release builds keep errors only
+#else
+#define SKYFAN_LOG_LEVEL               LOG_LEVEL_INFO
+#endif
+#endif
+#define LOG_RING_SIZE                  64     // Binary events awaiting the drain task, must be a power of two
+#define LOG_DRAIN_TASK_PRIORITY        1      // Just above idle, so formatting never delays the link
+#define LOG_DRAIN_TASK_STACK_SIZE      3072
+#define LOG_DRAIN_RETRY_MS             10     // Back-off while the debug serial has no room
+#define LOG_LINE_RESERVE               96     // Serial space required before a line is formatted
 
 // === Enhanced Enums ===
 
@@ -107,7 +206,6 @@ enum class FanDirection : uint8_t {
   REVERSE = 1
 };
 
-// Protocol states for better state machine readability
 // LED status states for visual indication
 enum class LedStatus : uint8_t {
   FACTORY_NEW = 0,    // Rapid flash - device never joined network
@@ -115,14 +213,22 @@ enum class LedStatus : uint8_t {
   CONNECTED = 2       // Off - device connected to network
 };
 
-enum class TuyaProtocolState : uint8_t {
-  WAIT_HEADER_1 = 0,
-  WAIT_HEADER_2 = 1,
-  WAIT_VERSION = 2,
-  WAIT_COMMAND = 3,
-  WAIT_LENGTH_HIGH = 4,
-  WAIT_LENGTH_LOW = 5,
-  WAIT_DATA_AND_CHECKSUM = 6
+// Transmit priority classes, highest first
+enum class TuyaTxClass : uint8_t {
+  USER = 0,       // DP writes from Zigbee
+  REPLY = 1,      // Network status, whether the MCU asked or it changed
+  SYNC = 2,       // Product info and status queries of a full-state sync
+  HEARTBEAT = 3
+};
+#define TUYA_TX_CLASS_COUNT 4
+
+// Lifecycle of a command in the outstanding-request table
+enum class TuyaCommandStatus : uint8_t {
+  UNKNOWN = 0,    // Handle not (or no longer) tracked
+  PENDING = 1,    // Sent, waiting for ACK
+  ACKED = 2,      // ACK received from MCU
+  TIMED_OUT = 3,  // No ACK after every retry, or past the overall deadline
+  SUPERSEDED = 4  // Every DP it carried was rewritten before a retry was due
 };
 
 // === Utility Functions ===
@@ -219,6 +325,45 @@ inline uint8_t tuyaBrightnessToZigbee(uint8_t tuyaBrightness) {
   return map(clamped, TUYA_BRIGHTNESS_MIN, TUYA_BRIGHTNESS_MAX, ZIGBEE_BRIGHTNESS_MIN, ZIGBEE_BRIGHTNESS_MAX);
 }
 
+// === Timing Profile ===
+
+// Runtime copy of the protocol timing above. The compiled values are the defaults;
+// a saved profile replaces them at boot and Zigbee writes change them live.
+struct TuyaTimingProfile {
+  uint32_t heartbeatIntervalMs = TUYA_HEARTBEAT_INTERVAL_MS;
+  uint32_t heartbeatRetryMs = TUYA_HEARTBEAT_RETRY_MS;
+  uint32_t connectionTimeoutMs = TUYA_CONNECTION_TIMEOUT_MS;
+  uint32_t commandTimeoutMs = TUYA_COMMAND_TIMEOUT_MS;
+  uint32_t retryBackoffMs = TUYA_RETRY_BACKOFF_MS;
+  uint32_t commandAttempts = TUYA_COMMAND_ATTEMPTS;
+  uint32_t commandDeadlineMs = TUYA_COMMAND_DEADLINE_MS;
+  uint32_t coalesceWindowMs = TUYA_COALESCE_WINDOW_MS;
+  uint32_t frameTimeoutMs = TUYA_FRAME_TIMEOUT_MS;
+  uint32_t syncSettleMs = TUYA_SYNC_SETTLE_MS;
+  uint32_t syncTimeoutMs = TUYA_SYNC_TIMEOUT_MS;
+};
+
+// Each field must be in range and agree with the fields it works against: the link
+// must survive at least one missed heartbeat, a write's deadline must leave time for
+// its first ACK, and a sync must be able to settle before it times out. A profile
+// that breaks any of these is rejected as a whole, so it can never reach NVS.
+inline bool isValidTimingProfile(const TuyaTimingProfile& profile) {
+  return isInRange<uint32_t>(profile.heartbeatIntervalMs, 1000, 60000) &&
+         isInRange<uint32_t>(profile.heartbeatRetryMs, 100, 60000) &&
+         isInRange<uint32_t>(profile.connectionTimeoutMs, 3000, 600000) &&
+         isInRange<uint32_t>(profile.commandTimeoutMs, 20, 10000) &&
+         isInRange<uint32_t>(profile.retryBackoffMs, 10, 5000) &&
+         isInRange<uint32_t>(profile.commandAttempts, 1, 10) &&
+         isInRange<uint32_t>(profile.commandDeadlineMs, 100, 60000) &&
+         isInRange<uint32_t>(profile.coalesceWindowMs, 0, 1000) &&
+         isInRange<uint32_t>(profile.frameTimeoutMs, 5, 1000) &&
+         isInRange<uint32_t>(profile.syncSettleMs, 1, 1000) &&
+         isInRange<uint32_t>(profile.syncTimeoutMs, 10, 5000) &&
+         profile.connectionTimeoutMs >= 2 * profile.heartbeatIntervalMs &&
+         profile.commandDeadlineMs >= profile.commandTimeoutMs &&
+         profile.syncTimeoutMs >= profile.syncSettleMs;
+}
+
 // === LED Status Indicator Class ===
 
 class LedStatusIndicator {
@@ -226,36 +371,35 @@ private:
   uint8_t pin;
   LedStatus currentStatus;
   bool ledState;
-  unsigned long lastUpdate;
   unsigned long lastFlashStart;
   
 public:
   LedStatusIndicator(uint8_t ledPin) 
-    : pin(ledPin), currentStatus(LedStatus::INITIALISING), ledState(false), lastUpdate(0), lastFlashStart(0) {
+    : pin(ledPin), currentStatus(LedStatus::INITIALISING), ledState(false), lastFlashStart(0) {
     pinMode(pin, OUTPUT);
     digitalWrite(pin, LOW);
   }
   
-  void update() {
+  // Drive the LED and return ms until it next needs updating (TIMER_NO_DEADLINE when steady)
+  unsigned long update() {
     unsigned long now = millis();
     
-    if (now - lastUpdate < LED_STATUS_UPDATE_INTERVAL_MS) {
-      return; // Not time to update yet
-    }
-    lastUpdate = now;
-    
     switch (currentStatus) {
-      case LedStatus::FACTORY_NEW:
+      case LedStatus::FACTORY_NEW: {
         // Rapid flash - 5 times per second (100ms on, 100ms off)
-        if (now - lastFlashStart >= LED_RAPID_FLASH_ON_TIME_MS + LED_RAPID_FLASH_OFF_TIME_MS) {
+        unsigned long elapsed = now - lastFlashStart;
+        if (elapsed >= LED_RAPID_FLASH_ON_TIME_MS + LED_RAPID_FLASH_OFF_TIME_MS) {
           lastFlashStart = now;
           ledState = true;
           digitalWrite(pin, HIGH);
-        } else if (ledState && (now - lastFlashStart >= LED_RAPID_FLASH_ON_TIME_MS)) {
+          return LED_RAPID_FLASH_ON_TIME_MS;
+        } else if (ledState && elapsed >= LED_RAPID_FLASH_ON_TIME_MS) {
           ledState = false;
           digitalWrite(pin, LOW);
         }
-        break;
+        return ledState ? LED_RAPID_FLASH_ON_TIME_MS - elapsed
+                        : LED_RAPID_FLASH_ON_TIME_MS + LED_RAPID_FLASH_OFF_TIME_MS - elapsed;
+      }
         
       case LedStatus::INITIALISING:
         // Solid on
@@ -273,9 +417,11 @@ public:
         }
         break;
     }
+    return TIMER_NO_DEADLINE;
   }
   
-  void setStatus(LedStatus status) {
+  // Returns true if the status changed (update() should then run again)
+  bool setStatus(LedStatus status) {
     if (currentStatus != status) {
       currentStatus = status;
       lastFlashStart = millis(); // Reset timing when status changes
@@ -288,7 +434,9 @@ public:
         ledState = false;
         digitalWrite(pin, LOW);
       }
+      return true;
     }
+    return false;
   }
   
   LedStatus getStatus() const {
@@ -317,8 +465,9 @@ public:
     pinMode(pin, INPUT_PULLUP);
   }
 
-  // Call this in loop() to update button state
-  void update() {
+  // Call on every pin edge and whenever the returned delay (ms) expires.
+  // Returns TIMER_NO_DEADLINE when nothing can change until the next edge.
+  unsigned long update() {
     bool reading = digitalRead(pin);
     
     // Reset debouncing timer if state changed
@@ -353,6 +502,21 @@ public:
     }
     
     lastState = reading;
+    
+    // Still settling - look again once the debounce delay has passed
+    unsigned long now = millis();
+    if (reading != currentState) {
+      unsigned long settled = now - lastStateChange;
+      return (settled <= debounceDelay) ? debounceDelay + 1 - settled : 1;
+    }
+    
+    // Held down - look again when it becomes a long press
+    if (currentState == LOW && !longPressed) {
+      unsigned long held = now - lastPressTime;
+      return (held <= longPressDelay) ? longPressDelay + 1 - held : 1;
+    }
+    
+    return TIMER_NO_DEADLINE;
   }
   
   // Check if button was just pressed (single shot)
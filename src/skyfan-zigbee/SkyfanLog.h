@@ -0,0 +1,310 @@
+/*
+ * Skyfan Log - Deferred binary event logging
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SKYFAN_LOG_H
+#define SKYFAN_LOG_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "SkyfanConfig.h"
+
+// Event registry - one entry per log message:
+//   X(name, level, format)
+// Call sites record only the event id, a timestamp and up to LOG_MAX_ARGS integer
+// arguments; the format string is applied later by the drain task. %s arguments
+// must be string literals (or otherwise outlive the ring), as only the pointer is kept.
+#define SKYFAN_LOG_EVENTS(X) \
+  X(STARTING,                     LOG_LEVEL_INFO,  "Skyfan Zigbee Controller Starting...") \
+  X(ENDPOINT_ADDED,               LOG_LEVEL_INFO,  "Fan %d: adding %s endpoint to Zigbee Core") \
+  X(ZIGBEE_START_FAILED,          LOG_LEVEL_ERROR, "Zigbee failed to start! Rebooting...") \
+  X(ZIGBEE_CONNECTING,            LOG_LEVEL_INFO,  "Connecting to network") \
+  X(ZIGBEE_CONNECTED,             LOG_LEVEL_INFO,  "Zigbee connected successfully!") \
+  X(ZIGBEE_DISCONNECTED,          LOG_LEVEL_WARN,  "Zigbee network connection lost") \
+  X(ENDPOINTS_RESTORED,           LOG_LEVEL_INFO,  "Fan %d: restored %d data points to Zigbee endpoints") \
+  X(FACTORY_RESET,                LOG_LEVEL_WARN,  "Resetting Zigbee to factory and rebooting in 1s.") \
+  X(CUSTOM_ATTR_ADDED,            LOG_LEVEL_INFO,  "Endpoint %d: added custom fan direction attribute") \
+  X(CUSTOM_ATTR_ADD_FAILED,       LOG_LEVEL_ERROR, "Endpoint %d: failed to add custom fan direction attribute: %d") \
+  X(DIAGNOSTICS_ADDED,            LOG_LEVEL_INFO,  "Endpoint %d: added diagnostics cluster") \
+  X(DIAGNOSTICS_ADD_FAILED,       LOG_LEVEL_ERROR, "Endpoint %d: failed to add diagnostics cluster: %d") \
+  X(TIMING_PROFILE_LOADED,        LOG_LEVEL_INFO,  "Fan %d: loaded timing profile from NVS") \
+  X(DEVICE_STATE_LOADED,          LOG_LEVEL_INFO,  "Fan %d: loaded fan and light state from NVS") \
+  X(MCU_STATE_RESTORED,           LOG_LEVEL_INFO,  "Fan %d: MCU restarted, restored %d data points") \
+  X(TIMING_PROFILE_REJECTED,      LOG_LEVEL_WARN,  "Fan %d: rejected out-of-range or inconsistent timing profile write") \
+  X(TIMING_PROFILE_SAVE_FAILED,   LOG_LEVEL_ERROR, "Fan %d: failed to save timing profile") \
+  X(TIMING_PROFILE_UPDATED,       LOG_LEVEL_INFO,  "Fan %d: timing profile updated") \
+  X(COMMAND_QUEUE_FAILED,         LOG_LEVEL_WARN,  "Fan %d: failed to queue %s command") \
+  X(COMMAND_TIMEOUT,              LOG_LEVEL_WARN,  "Fan %d: gave up on DPID %d (command %d) without an ACK") \
+  X(FAN_MODE_SET,                 LOG_LEVEL_INFO,  "Fan %d: fan mode: %s") \
+  X(FAN_MODE_UNHANDLED,           LOG_LEVEL_WARN,  "Fan %d: unhandled fan mode: %d") \
+  X(FAN_SPEED_SET_FAILED,         LOG_LEVEL_WARN,  "Fan %d: failed to set fan speed: %s") \
+  X(FAN_DIRECTION_SET,            LOG_LEVEL_INFO,  "Fan %d: fan direction set to: %d (%s)") \
+  X(FAN_DIRECTION_SET_FAILED,     LOG_LEVEL_WARN,  "Fan %d: failed to set fan direction: %d") \
+  X(FAN_DIRECTION_CHANGED,        LOG_LEVEL_INFO,  "Endpoint %d: fan direction changed via Zigbee: %d (%s)") \
+  X(LIGHT_SET,                    LOG_LEVEL_INFO,  "Fan %d: light: %s, Level: %d, Temp: %d mired (%dK)") \
+  X(LIGHT_BRIGHTNESS_SET_FAILED,  LOG_LEVEL_WARN,  "Fan %d: failed to set light brightness: %d") \
+  X(LIGHT_COLOUR_TEMP_SET_FAILED, LOG_LEVEL_WARN,  "Fan %d: failed to set light colour temperature: %d") \
+  X(FAN_SWITCH_STATUS,            LOG_LEVEL_INFO,  "Fan %d: fan switch status: %s") \
+  X(FAN_SWITCH_UPDATE_FAILED,     LOG_LEVEL_WARN,  "Fan %d: failed to update Zigbee fan switch status: %s") \
+  X(FAN_SPEED_STATUS,             LOG_LEVEL_INFO,  "Fan %d: fan speed status: %d") \
+  X(FAN_SPEED_UPDATE_FAILED,      LOG_LEVEL_WARN,  "Fan %d: failed to update Zigbee fan speed status: %d") \
+  X(FAN_MODE_STATUS,              LOG_LEVEL_INFO,  "Fan %d: fan mode status: %d (%s)") \
+  X(FAN_DIRECTION_STATUS,         LOG_LEVEL_INFO,  "Fan %d: fan direction status: %d (%s)") \
+  X(FAN_DIRECTION_UPDATE_FAILED,  LOG_LEVEL_WARN,  "Fan %d: failed to update Zigbee fan direction status: %d") \
+  X(LIGHT_SWITCH_STATUS,          LOG_LEVEL_INFO,  "Fan %d: light switch status: %s") \
+  X(LIGHT_SWITCH_UPDATE_FAILED,   LOG_LEVEL_WARN,  "Fan %d: failed to update Zigbee light switch status: %s") \
+  X(LIGHT_BRIGHTNESS_STATUS,      LOG_LEVEL_INFO,  "Fan %d: light brightness status: %d (Zigbee: %d)") \
+  X(LIGHT_LEVEL_UPDATE_FAILED,    LOG_LEVEL_WARN,  "Fan %d: failed to update Zigbee light brightness: %d") \
+  X(LIGHT_COLOUR_TEMP_STATUS,     LOG_LEVEL_INFO,  "Fan %d: light colour temp status: %d (%d mired, %dK)") \
+  X(LIGHT_TEMP_UPDATE_FAILED,     LOG_LEVEL_WARN,  "Fan %d: failed to update Zigbee light colour temperature: %d mired") \
+  X(INVALID_STATUS,               LOG_LEVEL_WARN,  "Fan %d: invalid status received - DPID: %d, Value: %d") \
+  X(UNKNOWN_STATUS,               LOG_LEVEL_WARN,  "Fan %d: unknown status update - DPID: %d, Value: %d") \
+  X(STATE_SYNCED,                 LOG_LEVEL_INFO,  "Fan %d: state synced from MCU (%s)") \
+  X(SCENE_CLUSTERS_ADDED,         LOG_LEVEL_INFO,  "Endpoint %d: added groups and scenes clusters to %s endpoint") \
+  X(SCENE_CLUSTERS_ADD_FAILED,    LOG_LEVEL_ERROR, "Endpoint %d: failed to add groups and scenes clusters: %d") \
+  X(SCENES_LOADED,                LOG_LEVEL_INFO,  "Fan %d: loaded %d scenes from NVS") \
+  X(SCENE_STORED,                 LOG_LEVEL_INFO,  "Fan %d: stored %s scene %d of group 0x%04X") \
+  X(SCENE_TABLE_FULL,             LOG_LEVEL_WARN,  "Fan %d: scene table full, scene %d of group 0x%04X not stored") \
+  X(SCENE_RECALLED,               LOG_LEVEL_INFO,  "Fan %d: recalled %d data points from a scene") \
+  X(SCENE_NOT_STORED,             LOG_LEVEL_WARN,  "Fan %d: no stored %s scene %d in group 0x%04X") \
+  X(SCENE_COMMAND_DROPPED,        LOG_LEVEL_WARN,  "Fan %d: scene command 0x%02X dropped, queue full") \
+  X(SCENES_SAVE_FAILED,           LOG_LEVEL_ERROR, "Fan %d: failed to save scenes")
+
+// Event ids (LOG_STARTING, LOG_FAN_MODE_SET, ...)
+#define SKYFAN_LOG_ID(name, level, format) LOG_##name,
+enum SkyfanLogEvent : uint16_t {
+  SKYFAN_LOG_EVENTS(SKYFAN_LOG_ID)
+  LOG_EVENT_COUNT
+};
+#undef SKYFAN_LOG_ID
+
+#define SKYFAN_LOG_EVENT_LEVEL(name, level, format) level,
+constexpr uint8_t LOG_EVENT_LEVELS[] = {
+  SKYFAN_LOG_EVENTS(SKYFAN_LOG_EVENT_LEVEL)
+};
+#undef SKYFAN_LOG_EVENT_LEVEL
+
+// Formats of compiled-out events are never referenced, so they stay out of flash
+#define SKYFAN_LOG_EVENT_FORMAT(name, level, format) ((level) <= SKYFAN_LOG_LEVEL) ? format : nullptr,
+constexpr const char* LOG_EVENT_FORMATS[] = {
+  SKYFAN_LOG_EVENTS(SKYFAN_LOG_EVENT_FORMAT)
+};
+#undef SKYFAN_LOG_EVENT_FORMAT
+
+// Record an event: LOG_EVENT(FAN_MODE_SET, fan.index, "LOW"). Events above SKYFAN_LOG_LEVEL
+// compile to nothing, arguments included.
+#define LOG_EVENT(name, ...) \
+  do { \
+    if constexpr (LOG_EVENT_LEVELS[LOG_##name] <= SKYFAN_LOG_LEVEL) { \
+      skyfanLog.record(LOG_##name, ##__VA_ARGS__); \
+    } \
+  } while (0)
+
+#define LOG_MAX_ARGS 5
+
+#if SKYFAN_LOG_LEVEL > LOG_LEVEL_NONE
+
+struct SkyfanLogRecord {
+  std::atomic<uint32_t> sequence;  // Slot ownership, see SkyfanLogger
+  uint32_t timestampUs;
+  uint16_t event;
+  uint8_t argc;
+  uint32_t args[LOG_MAX_ARGS];
+};
+
+// Bounded multi-producer/single-consumer ring. Producers (the loop and Zigbee tasks)
+// claim a slot by advancing head and publish it through the slot's sequence number;
+// the drain task is the only consumer. A full ring drops the new event and counts it.
+class SkyfanLogger {
+private:
+  static constexpr uint32_t CAPACITY = LOG_RING_SIZE;
+  static constexpr uint32_t MASK = CAPACITY - 1;
+  static_assert((CAPACITY & MASK) == 0, "LOG_RING_SIZE must be a power of two");
+  static_assert(sizeof(void*) <= sizeof(uint32_t), "%s arguments are stored as 32-bit values");
+
+  SkyfanLogRecord ring[CAPACITY];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;  // Moved by the drain task only
+  std::atomic<uint32_t> dropped;
+  uint32_t droppedReported;
+  TaskHandle_t drainTask;
+
+  static uint32_t toLogArg(const char* text) {
+    return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(text));
+  }
+
+  template<typename T>
+  static uint32_t toLogArg(T value) {
+    return static_cast<uint32_t>(value);
+  }
+
+  void push(uint16_t event, const uint32_t* args, uint8_t argc) {
+    uint32_t pos = head.load(std::memory_order_relaxed);
+    SkyfanLogRecord* slot;
+    for (;;) {
+      slot = &ring[pos & MASK];
+      int32_t diff = (int32_t)(slot->sequence.load(std::memory_order_acquire) - pos);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+
+    slot->timestampUs = micros();
+    slot->event = event;
+    slot->argc = argc;
+    memcpy(slot->args, args, argc * sizeof(uint32_t));
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    if (drainTask) {
+      xTaskNotifyGive(drainTask);
+    }
+  }
+
+  // Take the oldest published event, if any
+  bool pop(SkyfanLogRecord* out) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    SkyfanLogRecord* slot = &ring[t & MASK];
+    if (slot->sequence.load(std::memory_order_acquire) != t + 1) {
+      return false;
+    }
+    out->timestampUs = slot->timestampUs;
+    out->event = slot->event;
+    out->argc = slot->argc;
+    memcpy(out->args, slot->args, sizeof(out->args));
+    slot->sequence.store(t + CAPACITY, std::memory_order_release);
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool hasPending() const {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    return ring[t & MASK].sequence.load(std::memory_order_acquire) == t + 1;
+  }
+
+  void print(const SkyfanLogRecord& rec) {
+    static const char* const LEVEL_TAGS[] = { "", "E", "W", "I", "D" };
+    const char* format = (rec.event < LOG_EVENT_COUNT) ? LOG_EVENT_FORMATS[rec.event] : nullptr;
+    if (!format) {
+      return;
+    }
+    Serial.printf("[%lu.%03lu] %s ", (unsigned long)(rec.timestampUs / 1000),
+                  (unsigned long)(rec.timestampUs % 1000), LEVEL_TAGS[LOG_EVENT_LEVELS[rec.event]]);
+    // Unused trailing arguments are ignored by printf
+    Serial.printf(format, rec.args[0], rec.args[1], rec.args[2], rec.args[3], rec.args[4]);
+    Serial.println();
+  }
+
+  // Format up to maxEvents queued events (drain task only)
+  uint16_t drain(uint16_t maxEvents = CAPACITY) {
+    uint16_t printed = 0;
+    uint32_t lost = dropped.load(std::memory_order_relaxed);
+    if (lost != droppedReported) {
+      Serial.printf("(%lu log events dropped)\n", (unsigned long)(lost - droppedReported));
+      droppedReported = lost;
+    }
+
+    SkyfanLogRecord rec;
+    while (printed < maxEvents && pop(&rec)) {
+      print(rec);
+      printed++;
+    }
+    return printed;
+  }
+
+  static void drainLoop(void* arg) {
+    SkyfanLogger* self = static_cast<SkyfanLogger*>(arg);
+    for (;;) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      while (self->hasPending()) {
+        if (Serial.availableForWrite() < LOG_LINE_RESERVE) {
+          vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_RETRY_MS));
+          continue;
+        }
+        self->drain(1);
+      }
+    }
+  }
+
+public:
+  SkyfanLogger() : head(0), tail(0), dropped(0), droppedReported(0), drainTask(nullptr) {
+    for (uint32_t i = 0; i < CAPACITY; i++) {
+      ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Start the drain task; events recorded before this are kept and printed then
+  void begin() {
+    xTaskCreate(drainLoop, "skyfan_log", LOG_DRAIN_TASK_STACK_SIZE, this,
+                LOG_DRAIN_TASK_PRIORITY, &drainTask);
+    if (drainTask) {
+      xTaskNotifyGive(drainTask);
+    }
+  }
+
+  template<typename... Args>
+  void record(SkyfanLogEvent event, Args... args) {
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "Too many log arguments");
+    const uint32_t values[LOG_MAX_ARGS] = { toLogArg(args)... };
+    push(event, values, sizeof...(Args));
+  }
+
+  // Give the drain task up to timeoutMs to empty the ring, e.g. before a restart
+  void flush(uint32_t timeoutMs) {
+    unsigned long start = millis();
+    while (drainTask && head.load(std::memory_order_relaxed) != tail.load(std::memory_order_acquire) &&
+           millis() - start < timeoutMs) {
+      xTaskNotifyGive(drainTask);
+      vTaskDelay(pdMS_TO_TICKS(1));
+    }
+  }
+
+  uint32_t getDropped() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+};
+
+#else
+
+// Logging compiled out: no ring and no drain task. Nothing here needs FreeRTOS,
+// which lets the host tools build the sketch code that logs.
+class SkyfanLogger {
+public:
+  void begin() {}
+
+  template<typename... Args>
+  void record(SkyfanLogEvent, Args...) {
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "Too many log arguments");
+  }
+
+  void flush(uint32_t) {}
+
+  uint32_t getDropped() const {
+    return 0;
+  }
+};
+
+#endif // SKYFAN_LOG_LEVEL > LOG_LEVEL_NONE
+
+inline SkyfanLogger skyfanLog;
+
+#endif // SKYFAN_LOG_H
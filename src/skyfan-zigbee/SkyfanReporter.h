@@ -0,0 +1,297 @@
+/*
+ * Skyfan Reporter - Coalesced, rate-limited attribute reporting for the Zigbee endpoints
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SKYFAN_REPORTER_H
+#define SKYFAN_REPORTER_H
+
+#include <Arduino.h>
+#include "Zigbee.h"
+#include "SkyfanConfig.h"
+
+#define REPORTER_MAX_ATTRIBUTES   (12 * SKYFAN_FAN_COUNT)
+#define REPORTER_MAX_CLUSTERS     (6 * SKYFAN_FAN_COUNT)
+#define REPORT_FRAME_SIZE         64
+
+#define ZCL_FRAME_CONTROL_REPORT  0x18   // Profile-wide, server to client, no default response
+#define ZCL_FRAME_CONTROL_MANUFACTURER_SPECIFIC 0x04
+#define ZCL_CMD_REPORT_ATTRIBUTES 0x0A
+#define ZCL_NO_MANUFACTURER_CODE  0xFFFF
+
+struct ReportedAttribute {
+  uint8_t cluster;       // Index into the cluster table
+  uint16_t attrId;
+  uint32_t lastValue;
+  bool reported;
+};
+
+struct ReportedCluster {
+  uint8_t endpoint;
+  uint16_t clusterId;
+  uint16_t manufacturerCode;  // ZCL_NO_MANUFACTURER_CODE for standard attributes
+  bool dirty;
+  unsigned long dirtySince;
+  unsigned long lastReport;
+};
+
+struct ReporterStats {
+  uint32_t reportsSent;         // Report Attributes frames sent
+  uint32_t attributesReported;  // Attribute records carried by those frames
+  uint32_t changesCoalesced;    // Changes folded into a report that was already waiting
+};
+
+// Status handlers mark a cluster changed; service() later sends one Report Attributes
+// frame per cluster carrying every tracked attribute whose value differs from the last
+// report. Reports go out no more often than the minimum interval, and every tracked
+// attribute is re-reported after the maximum interval even if nothing changed.
+// Frames are sent through the binding table, the same destinations the stack's own
+// reports use. Manufacturer-specific attributes go in a frame of their own carrying
+// the manufacturer code, as ZCL cannot mix them with standard ones.
+//
+// This is the only reporting path for tracked attributes: begin() stops the stack
+// reporting them, so updating an attribute never sends a report of its own.
+class SkyfanReporter {
+private:
+  ReportedAttribute attributes[REPORTER_MAX_ATTRIBUTES];
+  ReportedCluster clusters[REPORTER_MAX_CLUSTERS];
+  uint8_t attributeCount = 0;
+  uint8_t clusterCount = 0;
+  uint8_t sequence = 0;
+  unsigned long gatherWindowMs = REPORT_GATHER_WINDOW_MS;
+  unsigned long minIntervalMs = REPORT_MIN_INTERVAL_MS;
+  unsigned long maxIntervalMs = REPORT_MAX_INTERVAL_MS;
+  ReporterStats stats = {};
+  
+  int8_t findCluster(uint8_t endpoint, uint16_t clusterId, uint16_t manufacturerCode) const {
+    for (uint8_t i = 0; i < clusterCount; i++) {
+      if (clusters[i].endpoint == endpoint && clusters[i].clusterId == clusterId &&
+          clusters[i].manufacturerCode == manufacturerCode) {
+        return i;
+      }
+    }
+    return -1;
+  }
+  
+  static uint8_t attributeSize(uint8_t type) {
+    switch (type) {
+      case ESP_ZB_ZCL_ATTR_TYPE_BOOL:
+      case ESP_ZB_ZCL_ATTR_TYPE_8BIT:
+      case ESP_ZB_ZCL_ATTR_TYPE_8BITMAP:
+      case ESP_ZB_ZCL_ATTR_TYPE_U8:
+      case ESP_ZB_ZCL_ATTR_TYPE_S8:
+      case ESP_ZB_ZCL_ATTR_TYPE_8BIT_ENUM:
+        return 1;
+      case ESP_ZB_ZCL_ATTR_TYPE_16BIT:
+      case ESP_ZB_ZCL_ATTR_TYPE_16BITMAP:
+      case ESP_ZB_ZCL_ATTR_TYPE_U16:
+      case ESP_ZB_ZCL_ATTR_TYPE_S16:
+      case ESP_ZB_ZCL_ATTR_TYPE_16BIT_ENUM:
+        return 2;
+      case ESP_ZB_ZCL_ATTR_TYPE_32BIT:
+      case ESP_ZB_ZCL_ATTR_TYPE_32BITMAP:
+      case ESP_ZB_ZCL_ATTR_TYPE_U32:
+      case ESP_ZB_ZCL_ATTR_TYPE_S32:
+        return 4;
+      default:
+        return 0;
+    }
+  }
+  
+  // Build and send one Report Attributes frame for a cluster; periodic sends every attribute
+  void sendReport(uint8_t clusterIndex, bool periodic) {
+    ReportedCluster& cluster = clusters[clusterIndex];
+    uint8_t frame[REPORT_FRAME_SIZE];
+    uint16_t len = 0;
+    uint8_t records = 0;
+    
+    if (cluster.manufacturerCode == ZCL_NO_MANUFACTURER_CODE) {
+      frame[len++] = ZCL_FRAME_CONTROL_REPORT;
+    } else {
+      frame[len++] = ZCL_FRAME_CONTROL_REPORT | ZCL_FRAME_CONTROL_MANUFACTURER_SPECIFIC;
+      frame[len++] = cluster.manufacturerCode & 0xFF;
+      frame[len++] = (cluster.manufacturerCode >> 8) & 0xFF;
+    }
+    frame[len++] = sequence;
+    frame[len++] = ZCL_CMD_REPORT_ATTRIBUTES;
+    
+    esp_zb_lock_acquire(portMAX_DELAY);
+    for (uint8_t i = 0; i < attributeCount; i++) {
+      ReportedAttribute& attribute = attributes[i];
+      if (attribute.cluster != clusterIndex) {
+        continue;
+      }
+      
+      esp_zb_zcl_attr_t *attr = esp_zb_zcl_get_attribute(cluster.endpoint, cluster.clusterId,
+                                                          ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, attribute.attrId);
+      uint8_t size = attr ? attributeSize(attr->type) : 0;
+      if (size == 0 || !attr->data_p || len + 3 + size > REPORT_FRAME_SIZE) {
+        continue;
+      }
+      
+      uint32_t value = 0;
+      memcpy(&value, attr->data_p, size);
+      if (!periodic && attribute.reported && attribute.lastValue == value) {
+        continue;
+      }
+      
+      frame[len++] = attribute.attrId & 0xFF;
+      frame[len++] = (attribute.attrId >> 8) & 0xFF;
+      frame[len++] = attr->type;
+      memcpy(&frame[len], attr->data_p, size);  // ZCL is little-endian, as is the ESP32
+      len += size;
+      
+      attribute.lastValue = value;
+      attribute.reported = true;
+      records++;
+    }
+    
+    if (records > 0) {
+      esp_zb_apsde_data_req_t req = {};
+      req.dst_addr_mode = ESP_ZB_APS_ADDR_MODE_DST_ADDR_ENDP_NOT_PRESENT;  // Use the binding table
+      req.profile_id = ESP_ZB_AF_HA_PROFILE_ID;
+      req.cluster_id = cluster.clusterId;
+      req.src_endpoint = cluster.endpoint;
+      req.asdu_length = len;
+      req.asdu = frame;
+      req.tx_options = ESP_ZB_APSDE_TX_OPT_ACK_TX;
+      req.radius = 0;
+      esp_zb_aps_data_request(&req);
+    }
+    esp_zb_lock_release();
+    
+    if (records > 0) {
+      sequence++;
+      stats.reportsSent++;
+      stats.attributesReported += records;
+    }
+    cluster.dirty = false;
+    cluster.lastReport = millis();
+  }
+
+public:
+  // Include an attribute in its cluster's reports (call during setup). A manufacturer
+  // code puts the attribute in a manufacturer-specific report frame.
+  bool track(uint8_t endpoint, uint16_t clusterId, uint16_t attrId, uint16_t manufacturerCode = ZCL_NO_MANUFACTURER_CODE) {
+    int8_t clusterIndex = findCluster(endpoint, clusterId, manufacturerCode);
+    if (clusterIndex < 0) {
+      if (clusterCount >= REPORTER_MAX_CLUSTERS) {
+        return false;
+      }
+      clusterIndex = clusterCount++;
+      clusters[clusterIndex] = { endpoint, clusterId, manufacturerCode, false, 0, millis() };
+    }
+    if (attributeCount >= REPORTER_MAX_ATTRIBUTES) {
+      return false;
+    }
+    attributes[attributeCount++] = { static_cast<uint8_t>(clusterIndex), attrId, 0, false };
+    return true;
+  }
+  
+  // Take reporting of the tracked attributes away from the stack (call after
+  // Zigbee.begin(), once the endpoints are registered). Clearing the reportable flag
+  // makes the stack refuse Configure Reporting for them, and any reporting already
+  // configured (the stack keeps it across reboots) is stopped.
+  void begin() {
+    esp_zb_lock_acquire(portMAX_DELAY);
+    for (uint8_t i = 0; i < attributeCount; i++) {
+      const ReportedCluster& cluster = clusters[attributes[i].cluster];
+      esp_zb_zcl_attr_t *attr = esp_zb_zcl_get_attribute(cluster.endpoint, cluster.clusterId,
+                                                          ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, attributes[i].attrId);
+      if (attr) {
+        attr->access &= ~ESP_ZB_ZCL_ATTR_ACCESS_REPORTING;
+      }
+      
+      // The stack holds every tracked attribute without a manufacturer code
+      esp_zb_zcl_attr_location_info_t location = {};
+      location.endpoint_id = cluster.endpoint;
+      location.cluster_id = cluster.clusterId;
+      location.cluster_role = ESP_ZB_ZCL_CLUSTER_SERVER_ROLE;
+      location.manuf_code = ESP_ZB_ZCL_ATTR_NON_MANUFACTURER_SPECIFIC;
+      location.attr_id = attributes[i].attrId;
+      if (esp_zb_zcl_find_reporting_info(location)) {
+        esp_zb_zcl_stop_attr_reporting(location);
+      }
+    }
+    esp_zb_lock_release();
+  }
+  
+  // An attribute in this cluster may have changed; cheap enough to call for every update
+  void markChanged(uint8_t endpoint, uint16_t clusterId) {
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < clusterCount; i++) {
+      ReportedCluster& cluster = clusters[i];
+      if (cluster.endpoint != endpoint || cluster.clusterId != clusterId) {
+        continue;
+      }
+      if (cluster.dirty) {
+        stats.changesCoalesced++;
+        continue;
+      }
+      cluster.dirty = true;
+      cluster.dirtySince = now;
+    }
+  }
+  
+  // Send every report that is due; returns ms until the next one
+  unsigned long service() {
+    unsigned long now = millis();
+    unsigned long next = TIMER_NO_DEADLINE;
+    
+    for (uint8_t i = 0; i < clusterCount; i++) {
+      ReportedCluster& cluster = clusters[i];
+      unsigned long due = TIMER_NO_DEADLINE;
+      
+      if (cluster.dirty) {
+        unsigned long gathered = cluster.dirtySince + gatherWindowMs;
+        unsigned long allowed = cluster.lastReport + minIntervalMs;
+        due = ((long)(gathered - allowed) > 0) ? gathered : allowed;
+      } else if (maxIntervalMs > 0) {
+        due = cluster.lastReport + maxIntervalMs;
+      }
+      if (due == TIMER_NO_DEADLINE) {
+        continue;
+      }
+      
+      if ((long)(now - due) >= 0) {
+        sendReport(i, !cluster.dirty);
+        due = (maxIntervalMs > 0) ? cluster.lastReport + maxIntervalMs : TIMER_NO_DEADLINE;
+        if (due == TIMER_NO_DEADLINE) {
+          continue;
+        }
+      }
+      
+      long remaining = (long)(due - now);
+      unsigned long wait = (remaining > 0) ? remaining : 0;
+      if (wait < next) {
+        next = wait;
+      }
+    }
+    return next;
+  }
+  
+  // maxIntervalMs of 0 disables periodic reports
+  void setIntervals(unsigned long gatherMs, unsigned long minMs, unsigned long maxMs) {
+    gatherWindowMs = gatherMs;
+    minIntervalMs = minMs;
+    maxIntervalMs = maxMs;
+  }
+  
+  const ReporterStats& getStats() const {
+    return stats;
+  }
+};
+
+#endif // SKYFAN_REPORTER_H
@@ -0,0 +1,313 @@
+/*
+ * Skyfan Scenes - Local scene table behind the Zigbee Scenes cluster
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SKYFAN_SCENES_H
+#define SKYFAN_SCENES_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "SkyfanConfig.h"
+#include "SkyfanSettings.h"
+#include "TuyaDataPoints.h"
+
+// DPs covered by the scenes of each endpoint, bit per TUYA_DATA_POINTS entry
+constexpr uint16_t sceneDataPointBit(uint8_t dpid) {
+  return 1U << tuyaDataPointIndex(dpid);
+}
+
+constexpr uint16_t SCENE_FAN_DATA_POINTS =
+  sceneDataPointBit(DP_FAN_SWITCH) | sceneDataPointBit(DP_FAN_MODE) |
+  sceneDataPointBit(DP_FAN_SPEED) | sceneDataPointBit(DP_FAN_DIRECTION);
+constexpr uint16_t SCENE_LIGHT_DATA_POINTS =
+  sceneDataPointBit(DP_LIGHT_SWITCH) | sceneDataPointBit(DP_LIGHT_DIMMER) | sceneDataPointBit(DP_LIGHT_COLOUR_TEMP);
+
+static_assert((SCENE_FAN_DATA_POINTS & SCENE_LIGHT_DATA_POINTS) == 0, "A DP belongs to one endpoint's scenes");
+
+// DP values making up a scene, one byte per TUYA_DATA_POINTS entry (as in DeviceStateRecord)
+struct SceneValues {
+  uint16_t known;  // Bit per entry that has a value
+  uint8_t values[TUYA_DATA_POINT_COUNT];
+
+  void set(uint8_t dpid, uint32_t value) {
+    int8_t slot = tuyaDataPointSlot(dpid);
+    if (slot >= 0 && isValidTuyaDataPoint(dpid, value)) {
+      known |= 1U << slot;
+      values[slot] = static_cast<uint8_t>(value);
+    }
+  }
+
+  bool get(uint8_t dpid, uint32_t* value) const {
+    int8_t slot = tuyaDataPointSlot(dpid);
+    if (slot < 0 || !(known & (1U << slot))) {
+      return false;
+    }
+    *value = values[slot];
+    return true;
+  }
+};
+
+// One scene of one group. The fan and light endpoints store their halves
+// independently; an entry with nothing known is free.
+struct SceneEntry {
+  uint16_t groupId;
+  uint8_t sceneId;
+  SceneValues contents;
+};
+
+// Stored form of the table - a version or layout mismatch starts it empty
+struct SceneTableRecord {
+  uint8_t version;
+  uint8_t count;  // TUYA_DATA_POINT_COUNT the values were laid out for
+  SceneEntry entries[SCENE_TABLE_SIZE];
+};
+
+struct SceneTableStats {
+  uint32_t stores;           // Store Scene and Add Scene commands taken
+  uint32_t recalls;          // Recalls that found a stored scene
+  uint32_t recallMisses;     // Recalls of a scene this fan does not hold
+  uint32_t tableFull;        // Scenes not stored for lack of a free entry
+  uint32_t commits;          // Tables written to flash
+};
+
+// Scenes are edited rarely, so every change is written back to NVS by the next commit()
+class SceneTable {
+private:
+  SceneTableRecord table;
+  const char* key;
+  bool dirty;
+  SceneTableStats stats;
+
+  SceneEntry* find(uint16_t groupId, uint8_t sceneId) {
+    for (SceneEntry& entry : table.entries) {
+      if (entry.contents.known != 0 && entry.groupId == groupId && entry.sceneId == sceneId) {
+        return &entry;
+      }
+    }
+    return nullptr;
+  }
+
+  void forget(SceneEntry& entry, uint16_t mask) {
+    if (entry.contents.known & mask) {
+      entry.contents.known &= ~mask;
+      dirty = true;
+    }
+  }
+
+  static bool isValid(const SceneTableRecord& record) {
+    if (record.version != SCENE_TABLE_VERSION || record.count != TUYA_DATA_POINT_COUNT) {
+      return false;
+    }
+    for (const SceneEntry& entry : record.entries) {
+      for (uint8_t i = 0; i < TUYA_DATA_POINT_COUNT; i++) {
+        if ((entry.contents.known & (1U << i)) &&
+            !isValidTuyaDataPoint(TUYA_DATA_POINT_TABLE[i].dpid, entry.contents.values[i])) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+public:
+  SceneTable() : key(SETTINGS_KEY_SCENES), dirty(false), stats{} {
+    memset(&table, 0, sizeof(table));
+    table.version = SCENE_TABLE_VERSION;
+    table.count = TUYA_DATA_POINT_COUNT;
+  }
+
+  // Read the saved table; false (no scenes) if there is none or it is unusable.
+  // Later commits go to the same key, which must outlive the table.
+  bool load(const char* recordKey = SETTINGS_KEY_SCENES) {
+    key = recordKey;
+    Preferences prefs;
+    if (!prefs.begin(SETTINGS_NAMESPACE, true)) {
+      return false;
+    }
+
+    SceneTableRecord record;
+    size_t len = prefs.getBytes(key, &record, sizeof(record));
+    prefs.end();
+
+    if (len != sizeof(record) || !isValid(record)) {
+      return false;
+    }
+    table = record;
+    dirty = false;
+    return true;
+  }
+
+  // Replace the DPs in mask with those given (the rest of the scene is kept);
+  // false when the scene is new and every entry is taken
+  bool store(uint16_t groupId, uint8_t sceneId, uint16_t mask, const SceneValues& values) {
+    SceneEntry* entry = find(groupId, sceneId);
+    if (!entry) {
+      for (SceneEntry& candidate : table.entries) {
+        if (candidate.contents.known == 0) {
+          entry = &candidate;
+          break;
+        }
+      }
+      if (!entry) {
+        stats.tableFull++;
+        return false;
+      }
+      memset(entry, 0, sizeof(SceneEntry));
+      entry->groupId = groupId;
+      entry->sceneId = sceneId;
+    }
+
+    entry->contents.known &= ~mask;
+    for (uint8_t i = 0; i < TUYA_DATA_POINT_COUNT; i++) {
+      if (values.known & mask & (1U << i)) {
+        entry->contents.known |= 1U << i;
+        entry->contents.values[i] = values.values[i];
+      }
+    }
+    stats.stores++;
+    dirty = true;
+    return true;
+  }
+
+  // Add the stored DPs in mask to values; false if the scene holds none of them
+  bool recall(uint16_t groupId, uint8_t sceneId, uint16_t mask, SceneValues* values) {
+    SceneEntry* entry = find(groupId, sceneId);
+    uint16_t stored = entry ? (entry->contents.known & mask) : 0;
+    if (stored == 0) {
+      stats.recallMisses++;
+      return false;
+    }
+
+    for (uint8_t i = 0; i < TUYA_DATA_POINT_COUNT; i++) {
+      if (stored & (1U << i)) {
+        values->known |= 1U << i;
+        values->values[i] = entry->contents.values[i];
+      }
+    }
+    stats.recalls++;
+    return true;
+  }
+
+  void remove(uint16_t groupId, uint8_t sceneId, uint16_t mask) {
+    SceneEntry* entry = find(groupId, sceneId);
+    if (entry) {
+      forget(*entry, mask);
+    }
+  }
+
+  // Remove All Scenes, and Remove Group (a group's scenes go with it)
+  void removeGroup(uint16_t groupId, uint16_t mask) {
+    for (SceneEntry& entry : table.entries) {
+      if (entry.groupId == groupId) {
+        forget(entry, mask);
+      }
+    }
+  }
+
+  // Remove All Groups, and factory reset
+  void removeAll(uint16_t mask) {
+    for (SceneEntry& entry : table.entries) {
+      forget(entry, mask);
+    }
+  }
+
+  uint8_t sceneCount() const {
+    uint8_t count = 0;
+    for (const SceneEntry& entry : table.entries) {
+      if (entry.contents.known != 0) {
+        count++;
+      }
+    }
+    return count;
+  }
+
+  // Write the table if anything changed since the last commit
+  bool commit() {
+    if (!dirty) {
+      return true;
+    }
+
+    Preferences prefs;
+    if (!prefs.begin(SETTINGS_NAMESPACE, false)) {
+      return false;
+    }
+    size_t written = prefs.putBytes(key, &table, sizeof(table));
+    prefs.end();
+
+    if (written != sizeof(table)) {
+      return false;
+    }
+    dirty = false;
+    stats.commits++;
+    return true;
+  }
+
+  bool isDirty() const {
+    return dirty;
+  }
+
+  const SceneTableStats& getStats() const {
+    return stats;
+  }
+};
+
+// A Scenes or Groups command for one endpoint, parsed from the raw ZCL frame
+struct SceneCommand {
+  uint16_t clusterId;
+  uint8_t cmdId;
+  bool light;             // For the light endpoint rather than the fan endpoint
+  uint16_t groupId;
+  uint8_t sceneId;
+  SceneValues contents;   // Add Scene only
+};
+
+// Scene commands arrive in the Zigbee task, but the table, the pending recall and
+// the MCU link belong to the main loop. post() may be called from the Zigbee task;
+// take() belongs to the main loop.
+class SceneCommandQueue {
+private:
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+  SceneCommand commands[SCENE_COMMAND_QUEUE_SIZE];
+  uint8_t head = 0;
+  uint8_t count = 0;
+
+public:
+  // False when the queue is full and the command was dropped
+  bool post(const SceneCommand& command) {
+    portENTER_CRITICAL(&lock);
+    bool queued = count < SCENE_COMMAND_QUEUE_SIZE;
+    if (queued) {
+      commands[(head + count) % SCENE_COMMAND_QUEUE_SIZE] = command;
+      count++;
+    }
+    portEXIT_CRITICAL(&lock);
+    return queued;
+  }
+
+  bool take(SceneCommand* command) {
+    portENTER_CRITICAL(&lock);
+    bool taken = count > 0;
+    if (taken) {
+      *command = commands[head];
+      head = (head + 1) % SCENE_COMMAND_QUEUE_SIZE;
+      count--;
+    }
+    portEXIT_CRITICAL(&lock);
+    return taken;
+  }
+};
+
+#endif // SKYFAN_SCENES_H
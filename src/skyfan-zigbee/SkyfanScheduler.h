@@ -0,0 +1,148 @@
+/*
+ * Skyfan Scheduler - Deadline timer scheduler with tickless idle for the main loop
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SKYFAN_SCHEDULER_H
+#define SKYFAN_SCHEDULER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "SkyfanConfig.h"
+
+typedef void (*SchedulerCallback)(void* context);
+
+static_assert(SCHEDULER_MAX_TIMERS <= 32, "Triggered timers are tracked in a 32-bit mask");
+
+struct SchedulerTimer {
+  SchedulerCallback callback;
+  void* context;
+  unsigned long deadline;
+  bool armed;
+};
+
+// Timers are one-shot: a callback re-arms itself with schedule() if it needs to run again.
+// schedule()/cancel()/run() belong to the owning task; trigger() may be called from any task
+// and triggerFromISR() from an interrupt to run a timer on the next pass.
+class SkyfanScheduler {
+private:
+  SchedulerTimer timers[SCHEDULER_MAX_TIMERS];
+  uint8_t timerCount;
+  std::atomic<uint32_t> triggered;
+  TaskHandle_t task;
+
+public:
+  SkyfanScheduler() : timerCount(0), triggered(0), task(nullptr) {}
+
+  // Bind to the calling task, which will run the timers
+  void begin() {
+    task = xTaskGetCurrentTaskHandle();
+  }
+
+  // Register a timer (disarmed) and return its id, or -1 when the table is full
+  int8_t addTimer(SchedulerCallback callback, void* context = nullptr) {
+    if (timerCount >= SCHEDULER_MAX_TIMERS) {
+      return -1;
+    }
+    SchedulerTimer& timer = timers[timerCount];
+    timer.callback = callback;
+    timer.context = context;
+    timer.deadline = 0;
+    timer.armed = false;
+    return timerCount++;
+  }
+
+  // Arm a timer to fire after delayMs (TIMER_NO_DEADLINE disarms it)
+  void schedule(int8_t id, unsigned long delayMs) {
+    if (id < 0 || id >= timerCount) {
+      return;
+    }
+    if (delayMs == TIMER_NO_DEADLINE) {
+      timers[id].armed = false;
+      return;
+    }
+    timers[id].deadline = millis() + delayMs;
+    timers[id].armed = true;
+  }
+
+  void cancel(int8_t id) {
+    schedule(id, TIMER_NO_DEADLINE);
+  }
+
+  void trigger(int8_t id) {
+    if (id < 0 || id >= SCHEDULER_MAX_TIMERS) {
+      return;
+    }
+    triggered.fetch_or(1UL << id);
+    if (task) {
+      xTaskNotifyGive(task);
+    }
+  }
+
+  void IRAM_ATTR triggerFromISR(int8_t id) {
+    if (id < 0 || id >= SCHEDULER_MAX_TIMERS) {
+      return;
+    }
+    triggered.fetch_or(1UL << id);
+    if (task) {
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR(task, &woken);
+      portYIELD_FROM_ISR(woken);
+    }
+  }
+
+  unsigned long msUntilNextDeadline() const {
+    unsigned long now = millis();
+    unsigned long next = TIMER_NO_DEADLINE;
+
+    for (uint8_t i = 0; i < timerCount; i++) {
+      if (!timers[i].armed) {
+        continue;
+      }
+      long remaining = (long)(timers[i].deadline - now);
+      if (remaining <= 0) {
+        return 0;
+      }
+      if ((unsigned long)remaining < next) {
+        next = remaining;
+      }
+    }
+    return next;
+  }
+
+  // Run every due or triggered timer, then block until the next deadline or trigger
+  void run() {
+    uint32_t fired = triggered.exchange(0);
+    unsigned long now = millis();
+
+    for (uint8_t i = 0; i < timerCount; i++) {
+      SchedulerTimer& timer = timers[i];
+      bool due = timer.armed && (long)(now - timer.deadline) >= 0;
+      if (due || (fired & (1UL << i))) {
+        timer.armed = false;
+        timer.callback(timer.context);
+      }
+    }
+
+    if (triggered.load() != 0) {
+      return;
+    }
+
+    unsigned long wait = msUntilNextDeadline();
+    ulTaskNotifyTake(pdTRUE, (wait == TIMER_NO_DEADLINE) ? portMAX_DELAY : pdMS_TO_TICKS(wait));
+  }
+};
+
+#endif // SKYFAN_SCHEDULER_H
@@ -0,0 +1,278 @@
+/*
+ * Skyfan Settings - Persistent device settings stored in NVS
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SKYFAN_SETTINGS_H
+#define SKYFAN_SETTINGS_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "SkyfanConfig.h"
+#include "TuyaDataPoints.h"
+
+#define SETTINGS_NAMESPACE        "skyfan"
+#define SETTINGS_KEY_TIMING       "timing"
+#define SETTINGS_KEY_STATE        "state"
+#define SETTINGS_KEY_SCENES       "scenes"
+#define TIMING_PROFILE_VERSION    2   // Bump when TuyaTimingProfile changes layout
+#define DEVICE_STATE_VERSION      1   // Bump when TUYA_DATA_POINTS changes order or gains a DP
+#define SCENE_TABLE_VERSION       1   // Bump when SceneEntry changes layout
+#define SETTINGS_KEY_SIZE         16
+
+// Key for one fan's copy of a setting: the first fan keeps the bare key, so a
+// single-fan bridge reads what it saved before multi-fan support; others add their index
+inline void fanSettingsKey(char* key, const char* base, uint8_t fanIndex) {
+  if (fanIndex == 0) {
+    snprintf(key, SETTINGS_KEY_SIZE, "%s", base);
+  } else {
+    snprintf(key, SETTINGS_KEY_SIZE, "%s%u", base, fanIndex);
+  }
+}
+
+// Stored form of the timing profile - a version or size mismatch falls back to the defaults
+struct TimingProfileRecord {
+  uint32_t version;
+  TuyaTimingProfile profile;
+};
+
+class TimingProfileStore {
+public:
+  // Replace profile with the saved one; false (profile untouched) if none is usable
+  static bool load(TuyaTimingProfile* profile, const char* key = SETTINGS_KEY_TIMING) {
+    Preferences prefs;
+    if (!prefs.begin(SETTINGS_NAMESPACE, true)) {
+      return false;
+    }
+    
+    TimingProfileRecord record;
+    size_t len = prefs.getBytes(key, &record, sizeof(record));
+    prefs.end();
+    
+    if (len != sizeof(record) || record.version != TIMING_PROFILE_VERSION || !isValidTimingProfile(record.profile)) {
+      return false;
+    }
+    *profile = record.profile;
+    return true;
+  }
+  
+  static bool save(const TuyaTimingProfile& profile, const char* key = SETTINGS_KEY_TIMING) {
+    Preferences prefs;
+    if (!prefs.begin(SETTINGS_NAMESPACE, false)) {
+      return false;
+    }
+    
+    TimingProfileRecord record;
+    record.version = TIMING_PROFILE_VERSION;
+    record.profile = profile;
+    size_t written = prefs.putBytes(key, &record, sizeof(record));
+    prefs.end();
+    return written == sizeof(record);
+  }
+  
+  // Forget the saved profile so the compiled defaults apply from the next boot
+  static void clear(const char* key = SETTINGS_KEY_TIMING) {
+    Preferences prefs;
+    if (prefs.begin(SETTINGS_NAMESPACE, false)) {
+      prefs.remove(key);
+      prefs.end();
+    }
+  }
+};
+
+// True when every registered DP value fits the one-byte slot of a state record
+constexpr bool dataPointsFitStateRecord(uint8_t index = 0) {
+  return (index >= TUYA_DATA_POINT_COUNT) ? true :
+         (TUYA_DATA_POINT_TABLE[index].max <= 0xFF) && dataPointsFitStateRecord(index + 1);
+}
+
+static_assert(TUYA_DATA_POINT_COUNT <= 16, "State record tracks known DPs in a 16-bit mask");
+static_assert(dataPointsFitStateRecord(), "State record stores each DP value in one byte");
+
+// Stored fan and light state, one byte per TUYA_DATA_POINTS entry in list order
+struct DeviceStateRecord {
+  uint8_t version;
+  uint8_t count;
+  uint16_t known;  // Bit per entry that has a value
+  uint8_t values[TUYA_DATA_POINT_COUNT];
+};
+
+struct DeviceStateStats {
+  uint32_t updates;          // DP changes fed in
+  uint32_t commits;          // Records written to flash
+  uint32_t bytesWritten;     // Record bytes written to flash
+  uint32_t unchangedCommits; // Quiet periods that ended where the last commit left off
+  uint32_t failedCommits;
+};
+
+// Last known DP values, kept in RAM and written to NVS only once changes have
+// stopped for STATE_COMMIT_QUIET_MS (or STATE_COMMIT_MAX_DELAY_MS after the first
+// unsaved change, if they never stop). A burst of slider steps costs one write.
+class DeviceStateStore {
+private:
+  DeviceStateRecord current;
+  DeviceStateRecord committed;  // What is in flash
+  const char* key;
+  bool dirty;
+  unsigned long firstChange;
+  unsigned long lastChange;
+  DeviceStateStats stats;
+  
+  static bool get(const DeviceStateRecord& record, uint8_t dpid, uint32_t* value) {
+    int8_t slot = tuyaDataPointSlot(dpid);
+    if (slot < 0 || !(record.known & (1U << slot))) {
+      return false;
+    }
+    *value = record.values[slot];
+    return true;
+  }
+  
+  static bool isValid(const DeviceStateRecord& record) {
+    if (record.version != DEVICE_STATE_VERSION || record.count != TUYA_DATA_POINT_COUNT) {
+      return false;
+    }
+    for (uint8_t i = 0; i < TUYA_DATA_POINT_COUNT; i++) {
+      if ((record.known & (1U << i)) && !isValidTuyaDataPoint(TUYA_DATA_POINT_TABLE[i].dpid, record.values[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+public:
+  DeviceStateStore() : key(SETTINGS_KEY_STATE), dirty(false), firstChange(0), lastChange(0), stats{} {
+    memset(&current, 0, sizeof(current));
+    current.version = DEVICE_STATE_VERSION;
+    current.count = TUYA_DATA_POINT_COUNT;
+    committed = current;
+  }
+  
+  // Read the saved record; false (nothing known) if there is none or it is unusable.
+  // Later commits go to the same key, which must outlive the store.
+  bool load(const char* recordKey = SETTINGS_KEY_STATE) {
+    key = recordKey;
+    Preferences prefs;
+    if (!prefs.begin(SETTINGS_NAMESPACE, true)) {
+      return false;
+    }
+    
+    DeviceStateRecord record;
+    size_t len = prefs.getBytes(key, &record, sizeof(record));
+    prefs.end();
+    
+    if (len != sizeof(record) || !isValid(record)) {
+      return false;
+    }
+    current = record;
+    committed = record;
+    dirty = false;
+    return true;
+  }
+  
+  // Feed a DP value from the status path; only real changes start the quiet period
+  void update(uint8_t dpid, uint32_t value) {
+    int8_t slot = tuyaDataPointSlot(dpid);
+    if (slot < 0 || value > 0xFF) {
+      return;
+    }
+    uint16_t bit = 1U << slot;
+    if ((current.known & bit) && current.values[slot] == value) {
+      return;
+    }
+    
+    current.known |= bit;
+    current.values[slot] = static_cast<uint8_t>(value);
+    stats.updates++;
+    
+    unsigned long now = millis();
+    if (!dirty) {
+      dirty = true;
+      firstChange = now;
+    }
+    lastChange = now;
+  }
+  
+  // Last value fed in (or loaded at boot)
+  bool get(uint8_t dpid, uint32_t* value) const {
+    return get(current, dpid, value);
+  }
+  
+  // Value as of the last commit - what survived the last power cut
+  bool getCommitted(uint8_t dpid, uint32_t* value) const {
+    return get(committed, dpid, value);
+  }
+  
+  // Commit if the quiet period has passed; returns the ms until it should run again
+  unsigned long service() {
+    if (!dirty) {
+      return TIMER_NO_DEADLINE;
+    }
+    
+    unsigned long now = millis();
+    unsigned long quietFor = now - lastChange;
+    unsigned long dirtyFor = now - firstChange;
+    if (quietFor >= STATE_COMMIT_QUIET_MS || dirtyFor >= STATE_COMMIT_MAX_DELAY_MS) {
+      if (commit()) {
+        return TIMER_NO_DEADLINE;
+      }
+      return STATE_COMMIT_QUIET_MS;  // Retry a failed write after another quiet period
+    }
+    
+    unsigned long untilQuiet = STATE_COMMIT_QUIET_MS - quietFor;
+    unsigned long untilMaxDelay = STATE_COMMIT_MAX_DELAY_MS - dirtyFor;
+    return (untilQuiet < untilMaxDelay) ? untilQuiet : untilMaxDelay;
+  }
+  
+  // Write any unsaved changes now (also the shutdown hint). Skips the flash write when
+  // the values have come back to what is already stored.
+  bool commit() {
+    if (!dirty) {
+      return true;
+    }
+    if (memcmp(&current, &committed, sizeof(DeviceStateRecord)) == 0) {
+      dirty = false;
+      stats.unchangedCommits++;
+      return true;
+    }
+    
+    Preferences prefs;
+    if (!prefs.begin(SETTINGS_NAMESPACE, false)) {
+      stats.failedCommits++;
+      return false;
+    }
+    size_t written = prefs.putBytes(key, &current, sizeof(current));
+    prefs.end();
+    
+    if (written != sizeof(current)) {
+      stats.failedCommits++;
+      return false;
+    }
+    committed = current;
+    dirty = false;
+    stats.commits++;
+    stats.bytesWritten += written;
+    return true;
+  }
+  
+  bool isDirty() const {
+    return dirty;
+  }
+  
+  const DeviceStateStats& getStats() const {
+    return stats;
+  }
+};
+
+#endif // SKYFAN_SETTINGS_H
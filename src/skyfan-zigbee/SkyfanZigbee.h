@@ -22,15 +22,150 @@
 #include "Zigbee.h"
 #include "ha/esp_zigbee_ha_standard.h"
 #include "SkyfanConfig.h"
+#include "SkyfanLog.h"
 
 // Custom Zigbee Attributes for Skyfan
 #define CUSTOM_ATTR_FAN_DIRECTION 0xF001  // Custom manufacturer attribute for fan direction
 #define VENTAIR_MANUFACTURER_CODE 0x1234  // Custom manufacturer code for Ventair
 
+// Timing profile attributes (uint32, ms) on the fan control cluster, writable by the coordinator
+#define CUSTOM_ATTR_HEARTBEAT_INTERVAL   0xF010
+#define CUSTOM_ATTR_HEARTBEAT_RETRY      0xF011
+#define CUSTOM_ATTR_CONNECTION_TIMEOUT   0xF012
+#define CUSTOM_ATTR_COMMAND_TIMEOUT      0xF013
+#define CUSTOM_ATTR_COALESCE_WINDOW      0xF014
+#define CUSTOM_ATTR_FRAME_TIMEOUT        0xF015
+#define CUSTOM_ATTR_SYNC_SETTLE          0xF016
+#define CUSTOM_ATTR_SYNC_TIMEOUT         0xF017
+#define CUSTOM_ATTR_RETRY_BACKOFF        0xF018
+#define CUSTOM_ATTR_COMMAND_ATTEMPTS     0xF019  // A count, not milliseconds
+#define CUSTOM_ATTR_COMMAND_DEADLINE     0xF01A
+
+struct TimingAttribute {
+  uint16_t attrId;
+  uint32_t TuyaTimingProfile::*field;
+};
+
+constexpr TimingAttribute TIMING_ATTRIBUTES[] = {
+  { CUSTOM_ATTR_HEARTBEAT_INTERVAL, &TuyaTimingProfile::heartbeatIntervalMs },
+  { CUSTOM_ATTR_HEARTBEAT_RETRY, &TuyaTimingProfile::heartbeatRetryMs },
+  { CUSTOM_ATTR_CONNECTION_TIMEOUT, &TuyaTimingProfile::connectionTimeoutMs },
+  { CUSTOM_ATTR_COMMAND_TIMEOUT, &TuyaTimingProfile::commandTimeoutMs },
+  { CUSTOM_ATTR_COALESCE_WINDOW, &TuyaTimingProfile::coalesceWindowMs },
+  { CUSTOM_ATTR_FRAME_TIMEOUT, &TuyaTimingProfile::frameTimeoutMs },
+  { CUSTOM_ATTR_SYNC_SETTLE, &TuyaTimingProfile::syncSettleMs },
+  { CUSTOM_ATTR_SYNC_TIMEOUT, &TuyaTimingProfile::syncTimeoutMs },
+  { CUSTOM_ATTR_RETRY_BACKOFF, &TuyaTimingProfile::retryBackoffMs },
+  { CUSTOM_ATTR_COMMAND_ATTEMPTS, &TuyaTimingProfile::commandAttempts },
+  { CUSTOM_ATTR_COMMAND_DEADLINE, &TuyaTimingProfile::commandDeadlineMs },
+};
+
+// Diagnostics cluster (0x0B05) attributes for the MCU link, in the manufacturer range
+#define DIAG_ATTR_FRAMES_SENT       0xF100  // uint32
+#define DIAG_ATTR_FRAMES_RECEIVED   0xF101  // uint32
+#define DIAG_ATTR_COMMANDS_ACKED    0xF102  // uint32
+#define DIAG_ATTR_COMMAND_TIMEOUTS  0xF103  // uint32
+#define DIAG_ATTR_FRAME_ERRORS      0xF104  // uint32 - bad checksums, oversize and stalled frames
+#define DIAG_ATTR_HEARTBEAT_MISSES  0xF105  // uint32
+#define DIAG_ATTR_LINK_DROPS        0xF106  // uint32
+#define DIAG_ATTR_MCU_RESTARTS      0xF107  // uint32
+#define DIAG_ATTR_ECHOES_ABSORBED   0xF108  // uint32 - MCU reports that only confirmed our write
+#define DIAG_ATTR_LOOPS_DETECTED    0xF109  // uint32 - coordinator writes echoing our own report
+#define DIAG_ATTR_REPORTS_SENT      0xF10A  // uint32 - coalesced attribute reports sent
+#define DIAG_ATTR_STATE_COMMITS     0xF10B  // uint32 - persistent state records written to flash
+#define DIAG_ATTR_STATE_BYTES       0xF10C  // uint32 - persistent state bytes written to flash
+#define DIAG_ATTR_COMMAND_RETRIES   0xF10D  // uint32 - DP writes resent after an ACK timeout
+#define DIAG_ATTR_WRITES_SKIPPED    0xF10E  // uint32 - DP writes not sent because the MCU already had the value
+#define DIAG_ATTR_REPORTS_SKIPPED   0xF10F  // uint32 - MCU reports dropped because the value had not changed
+#define DIAG_ATTR_ACK_LATENCY_P50   0xF110  // uint16, ms
+#define DIAG_ATTR_ACK_LATENCY_P95   0xF111  // uint16, ms
+#define DIAG_ATTR_ACK_LATENCY_P99   0xF112  // uint16, ms
+#define DIAG_ATTR_ACK_LATENCY_MAX   0xF113  // uint16, ms
+#define DIAG_ATTR_UPDATES_SKIPPED   0xF114  // uint32 - fan and light attribute updates that were already current
+
+// Snapshot of the MCU link published through the Diagnostics cluster
+struct SkyfanDiagnostics {
+  uint32_t framesSent;
+  uint32_t framesReceived;
+  uint32_t commandsAcked;
+  uint32_t commandTimeouts;
+  uint32_t commandRetries;
+  uint32_t frameErrors;
+  uint32_t heartbeatMisses;
+  uint32_t linkDrops;
+  uint32_t mcuRestarts;
+  uint32_t echoesAbsorbed;
+  uint32_t loopsDetected;
+  uint32_t reportsSent;
+  uint32_t stateCommits;
+  uint32_t stateBytes;
+  uint32_t suppressedWrites;
+  uint32_t suppressedReports;
+  uint32_t suppressedUpdates;
+  uint16_t ackLatencyP50;
+  uint16_t ackLatencyP95;
+  uint16_t ackLatencyP99;
+  uint16_t ackLatencyMax;
+};
+
+// Read the current value of a registered server attribute (false before registration).
+// The Zigbee task writes these, so call with the Zigbee lock held.
+template<typename T>
+inline bool readServerAttribute(uint8_t endpoint, uint16_t clusterId, uint16_t attrId, T* value) {
+  esp_zb_zcl_attr_t *attr = esp_zb_zcl_get_attribute(endpoint, clusterId, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE, attrId);
+  if (attr && attr->data_p) {
+    memcpy(value, attr->data_p, sizeof(T));
+    return true;
+  }
+  return false;
+}
+
+// Add the Groups (0x0004) and Scenes (0x0005) server clusters unless the endpoint
+// type already carries them. The stack keeps group membership and answers the
+// scene commands; scene contents live in the sketch's SceneTable.
+inline esp_err_t addGroupsAndScenesClusters(esp_zb_cluster_list_t *cluster_list) {
+  esp_err_t ret = ESP_OK;
+  if (!esp_zb_cluster_list_get_cluster(cluster_list, ESP_ZB_ZCL_CLUSTER_ID_GROUPS, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE)) {
+    esp_zb_groups_cluster_cfg_t groups_cfg = {};
+    ret = esp_zb_cluster_list_add_groups_cluster(cluster_list, esp_zb_groups_cluster_create(&groups_cfg),
+                                                 ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+  }
+  if (ret == ESP_OK &&
+      !esp_zb_cluster_list_get_cluster(cluster_list, ESP_ZB_ZCL_CLUSTER_ID_SCENES, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE)) {
+    esp_zb_scenes_cluster_cfg_t scenes_cfg = {};
+    ret = esp_zb_cluster_list_add_scenes_cluster(cluster_list, esp_zb_scenes_cluster_create(&scenes_cfg),
+                                                 ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+  }
+  return ret;
+}
+
 // Extended ZigbeeFanControl class with public setter methods for status updates
 class SkyfanZigbeeFanControl : public ZigbeeFanControl {
 private:
   void (*fanDirectionCallback)(uint8_t direction) = nullptr;
+  uint32_t suppressedUpdates = 0;
+
+  // Update a fan control attribute, skipping the update when nothing changes. The
+  // compare and the update share one Zigbee lock, so a coordinator write cannot
+  // land between them.
+  bool updateIfChanged(uint16_t attrId, uint8_t value) {
+    bool updated = false;
+    uint8_t current;
+    esp_zb_lock_acquire(portMAX_DELAY);
+    if (readServerAttribute(_endpoint, ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL, attrId, &current) && current == value) {
+      suppressedUpdates++;
+      updated = true;
+    } else {
+      // Update the Zigbee cluster attribute using protected member access
+      esp_zb_attribute_list_t *fan_control_cluster =
+        esp_zb_cluster_list_get_cluster(_cluster_list, ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+      if (fan_control_cluster) {
+        updated = (esp_zb_cluster_update_attr(fan_control_cluster, attrId, (void *)&value) == ESP_OK);
+      }
+    }
+    esp_zb_lock_release();
+    return updated;
+  }
 
 public:
   SkyfanZigbeeFanControl(uint8_t endpoint) : ZigbeeFanControl(endpoint) {}
@@ -42,15 +177,7 @@ public:
   
   // Public setter methods for bidirectional status updates
   bool setFanMode(ZigbeeFanMode mode) {
-    // Update the Zigbee cluster attribute using protected member access
-    esp_zb_attribute_list_t *fan_control_cluster =
-      esp_zb_cluster_list_get_cluster(_cluster_list, ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
-    
-    if (fan_control_cluster) {
-      esp_err_t ret = esp_zb_cluster_update_attr(fan_control_cluster, ESP_ZB_ZCL_ATTR_FAN_CONTROL_FAN_MODE_ID, (void *)&mode);
-      return (ret == ESP_OK);
-    }
-    return false;
+    return updateIfChanged(ESP_ZB_ZCL_ATTR_FAN_CONTROL_FAN_MODE_ID, static_cast<uint8_t>(mode));
   }
   
   // Convenience method to set fan state (on/off)
@@ -96,15 +223,7 @@ public:
       return false;
     }
     
-    // Update the custom manufacturer attribute
-    esp_zb_attribute_list_t *fan_control_cluster =
-      esp_zb_cluster_list_get_cluster(_cluster_list, ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
-    
-    if (fan_control_cluster) {
-      esp_err_t ret = esp_zb_cluster_update_attr(fan_control_cluster, CUSTOM_ATTR_FAN_DIRECTION, (void *)&direction);
-      return (ret == ESP_OK);
-    }
-    return false;
+    return updateIfChanged(CUSTOM_ATTR_FAN_DIRECTION, direction);
   }
   
   uint8_t getFanDirection() {
@@ -122,6 +241,11 @@ public:
     return static_cast<uint8_t>(FanDirection::FORWARD); // Default to forward
   }
   
+  // Attribute updates skipped because the value was already current
+  uint32_t getSuppressedUpdates() const {
+    return suppressedUpdates;
+  }
+  
   // Override cluster setup to add custom attributes
   void addCustomAttributes() {
     esp_zb_attribute_list_t *fan_control_cluster =
@@ -138,24 +262,207 @@ public:
                                                &default_direction);
       
       if (ret == ESP_OK) {
-        Serial.println("Added custom fan direction attribute");
+        LOG_EVENT(CUSTOM_ATTR_ADDED, _endpoint);
       } else {
-        Serial.printf("Failed to add custom fan direction attribute: %d\n", ret);
+        LOG_EVENT(CUSTOM_ATTR_ADD_FAILED, _endpoint, ret);
+      }
+    }
+  }
+  
+  // Groups and Scenes clusters, which the fan control device type lacks (call before Zigbee.begin())
+  void addSceneClusters() {
+    esp_err_t ret = addGroupsAndScenesClusters(_cluster_list);
+    if (ret == ESP_OK) {
+      LOG_EVENT(SCENE_CLUSTERS_ADDED, _endpoint, "fan");
+    } else {
+      LOG_EVENT(SCENE_CLUSTERS_ADD_FAILED, _endpoint, ret);
+    }
+  }
+  
+  // Add the timing profile attributes with their starting values (call before Zigbee.begin())
+  void addTimingAttributes(const TuyaTimingProfile& profile) {
+    esp_zb_attribute_list_t *fan_control_cluster =
+      esp_zb_cluster_list_get_cluster(_cluster_list, ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    
+    if (fan_control_cluster) {
+      for (const TimingAttribute& attr : TIMING_ATTRIBUTES) {
+        uint32_t value = profile.*attr.field;
+        esp_zb_cluster_add_attr(fan_control_cluster, ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL, attr.attrId,
+                                ESP_ZB_ZCL_ATTR_TYPE_U32, ESP_ZB_ZCL_ATTR_ACCESS_READ_WRITE, &value);
       }
     }
   }
   
+  // Current attribute values as a profile (not validated); false before registration.
+  // Read under one lock, so a multi-attribute write is seen whole or not at all.
+  bool readTimingProfile(TuyaTimingProfile* profile) {
+    bool read = true;
+    esp_zb_lock_acquire(portMAX_DELAY);
+    for (const TimingAttribute& attr : TIMING_ATTRIBUTES) {
+      if (!readServerAttribute(_endpoint, ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL, attr.attrId, &(profile->*attr.field))) {
+        read = false;
+        break;
+      }
+    }
+    esp_zb_lock_release();
+    return read;
+  }
+  
+  // Overwrite the attributes, e.g. to undo a rejected write
+  void setTimingProfile(const TuyaTimingProfile& profile) {
+    esp_zb_lock_acquire(portMAX_DELAY);
+    for (const TimingAttribute& attr : TIMING_ATTRIBUTES) {
+      uint32_t value = profile.*attr.field;
+      esp_zb_zcl_set_attribute_val(_endpoint, ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+                                   attr.attrId, &value, false);
+    }
+    esp_zb_lock_release();
+  }
+  
+  // Add a Diagnostics cluster carrying the MCU link counters (call before Zigbee.begin())
+  void addDiagnosticsCluster() {
+    esp_zb_attribute_list_t *diagnostics_cluster = esp_zb_zcl_attr_list_create(ESP_ZB_ZCL_CLUSTER_ID_DIAGNOSTICS);
+    uint32_t zero32 = 0;
+    uint16_t zero16 = 0;
+    
+    const uint16_t counters[] = {
+      DIAG_ATTR_FRAMES_SENT, DIAG_ATTR_FRAMES_RECEIVED, DIAG_ATTR_COMMANDS_ACKED, DIAG_ATTR_COMMAND_TIMEOUTS,
+      DIAG_ATTR_FRAME_ERRORS, DIAG_ATTR_HEARTBEAT_MISSES, DIAG_ATTR_LINK_DROPS, DIAG_ATTR_MCU_RESTARTS,
+      DIAG_ATTR_ECHOES_ABSORBED, DIAG_ATTR_LOOPS_DETECTED, DIAG_ATTR_REPORTS_SENT, DIAG_ATTR_STATE_COMMITS,
+      DIAG_ATTR_STATE_BYTES, DIAG_ATTR_COMMAND_RETRIES, DIAG_ATTR_WRITES_SKIPPED, DIAG_ATTR_REPORTS_SKIPPED,
+      DIAG_ATTR_UPDATES_SKIPPED
+    };
+    for (uint16_t attr_id : counters) {
+      esp_zb_cluster_add_attr(diagnostics_cluster, ESP_ZB_ZCL_CLUSTER_ID_DIAGNOSTICS, attr_id,
+                              ESP_ZB_ZCL_ATTR_TYPE_U32, ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero32);
+    }
+    
+    const uint16_t latencies[] = {
+      DIAG_ATTR_ACK_LATENCY_P50, DIAG_ATTR_ACK_LATENCY_P95, DIAG_ATTR_ACK_LATENCY_P99, DIAG_ATTR_ACK_LATENCY_MAX
+    };
+    for (uint16_t attr_id : latencies) {
+      esp_zb_cluster_add_attr(diagnostics_cluster, ESP_ZB_ZCL_CLUSTER_ID_DIAGNOSTICS, attr_id,
+                              ESP_ZB_ZCL_ATTR_TYPE_U16, ESP_ZB_ZCL_ATTR_ACCESS_READ_ONLY, &zero16);
+    }
+    
+    esp_err_t ret = esp_zb_cluster_list_add_custom_cluster(_cluster_list, diagnostics_cluster, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE);
+    if (ret == ESP_OK) {
+      LOG_EVENT(DIAGNOSTICS_ADDED, _endpoint);
+    } else {
+      LOG_EVENT(DIAGNOSTICS_ADD_FAILED, _endpoint, ret);
+    }
+  }
+  
+  // Publish a new snapshot; the coordinator reads it on demand
+  void setDiagnostics(const SkyfanDiagnostics& diag) {
+    const struct { uint16_t id; uint32_t value; } counters[] = {
+      { DIAG_ATTR_FRAMES_SENT, diag.framesSent },
+      { DIAG_ATTR_FRAMES_RECEIVED, diag.framesReceived },
+      { DIAG_ATTR_COMMANDS_ACKED, diag.commandsAcked },
+      { DIAG_ATTR_COMMAND_TIMEOUTS, diag.commandTimeouts },
+      { DIAG_ATTR_FRAME_ERRORS, diag.frameErrors },
+      { DIAG_ATTR_HEARTBEAT_MISSES, diag.heartbeatMisses },
+      { DIAG_ATTR_LINK_DROPS, diag.linkDrops },
+      { DIAG_ATTR_MCU_RESTARTS, diag.mcuRestarts },
+      { DIAG_ATTR_ECHOES_ABSORBED, diag.echoesAbsorbed },
+      { DIAG_ATTR_LOOPS_DETECTED, diag.loopsDetected },
+      { DIAG_ATTR_REPORTS_SENT, diag.reportsSent },
+      { DIAG_ATTR_STATE_COMMITS, diag.stateCommits },
+      { DIAG_ATTR_STATE_BYTES, diag.stateBytes },
+      { DIAG_ATTR_COMMAND_RETRIES, diag.commandRetries },
+      { DIAG_ATTR_WRITES_SKIPPED, diag.suppressedWrites },
+      { DIAG_ATTR_REPORTS_SKIPPED, diag.suppressedReports },
+      { DIAG_ATTR_UPDATES_SKIPPED, diag.suppressedUpdates },
+    };
+    const struct { uint16_t id; uint16_t value; } latencies[] = {
+      { DIAG_ATTR_ACK_LATENCY_P50, diag.ackLatencyP50 },
+      { DIAG_ATTR_ACK_LATENCY_P95, diag.ackLatencyP95 },
+      { DIAG_ATTR_ACK_LATENCY_P99, diag.ackLatencyP99 },
+      { DIAG_ATTR_ACK_LATENCY_MAX, diag.ackLatencyMax },
+    };
+    
+    esp_zb_lock_acquire(portMAX_DELAY);
+    for (const auto& counter : counters) {
+      esp_zb_zcl_set_attribute_val(_endpoint, ESP_ZB_ZCL_CLUSTER_ID_DIAGNOSTICS, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+                                   counter.id, (void *)&counter.value, false);
+    }
+    for (const auto& latency : latencies) {
+      esp_zb_zcl_set_attribute_val(_endpoint, ESP_ZB_ZCL_CLUSTER_ID_DIAGNOSTICS, ESP_ZB_ZCL_CLUSTER_SERVER_ROLE,
+                                   latency.id, (void *)&latency.value, false);
+    }
+    esp_zb_lock_release();
+  }
+  
   // Handle attribute changes for custom attributes
   void handleAttributeChange(uint16_t attr_id, uint8_t *data) {
     if (attr_id == CUSTOM_ATTR_FAN_DIRECTION && fanDirectionCallback) {
       uint8_t direction = *data;
       if (direction <= static_cast<uint8_t>(FanDirection::REVERSE)) {
         fanDirectionCallback(direction);
-        Serial.printf("Fan direction changed via Zigbee: %d (%s)\n", direction,
+        LOG_EVENT(FAN_DIRECTION_CHANGED, _endpoint, direction,
           (direction == static_cast<uint8_t>(FanDirection::FORWARD)) ? "FORWARD" : "REVERSE");
       }
     }
   }
 };
 
+// Extended ZigbeeColorDimmableLight class that skips attribute updates which change nothing
+class SkyfanZigbeeLight : public ZigbeeColorDimmableLight {
+private:
+  uint32_t suppressedUpdates = 0;
+
+  // Call with the Zigbee lock held, and keep it over the update that follows
+  template<typename T>
+  bool isCurrent(uint16_t clusterId, uint16_t attrId, T value) {
+    T current;
+    if (readServerAttribute(_endpoint, clusterId, attrId, &current) && current == value) {
+      suppressedUpdates++;
+      return true;
+    }
+    return false;
+  }
+
+public:
+  SkyfanZigbeeLight(uint8_t endpoint) : ZigbeeColorDimmableLight(endpoint) {}
+  
+  // The colour dimmable light device type normally has both already (call before Zigbee.begin())
+  void addSceneClusters() {
+    esp_err_t ret = addGroupsAndScenesClusters(_cluster_list);
+    if (ret == ESP_OK) {
+      LOG_EVENT(SCENE_CLUSTERS_ADDED, _endpoint, "light");
+    } else {
+      LOG_EVENT(SCENE_CLUSTERS_ADD_FAILED, _endpoint, ret);
+    }
+  }
+  
+  bool setLightState(bool on) {
+    esp_zb_lock_acquire(portMAX_DELAY);  // Recursive, so the base setter can take it too
+    bool updated = isCurrent<bool>(ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID, on) ||
+                   ZigbeeColorDimmableLight::setLightState(on);
+    esp_zb_lock_release();
+    return updated;
+  }
+  
+  bool setLightLevel(uint8_t level) {
+    esp_zb_lock_acquire(portMAX_DELAY);  // Recursive, so the base setter can take it too
+    bool updated = isCurrent<uint8_t>(ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL, ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_CURRENT_LEVEL_ID, level) ||
+                   ZigbeeColorDimmableLight::setLightLevel(level);
+    esp_zb_lock_release();
+    return updated;
+  }
+  
+  bool setLightColorTemperature(uint16_t mired) {
+    esp_zb_lock_acquire(portMAX_DELAY);  // Recursive, so the base setter can take it too
+    bool updated = isCurrent<uint16_t>(ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_COLOR_TEMPERATURE_ID, mired) ||
+                   ZigbeeColorDimmableLight::setLightColorTemperature(mired);
+    esp_zb_lock_release();
+    return updated;
+  }
+  
+  // Attribute updates skipped because the value was already current
+  uint32_t getSuppressedUpdates() const {
+    return suppressedUpdates;
+  }
+};
+
 #endif // SKYFAN_ZIGBEE_H
\ No newline at end of file
@@ -0,0 +1,141 @@
+/*
+ * Tuya Protocol Benchmark - On-device throughput measurement for the Tuya protocol code
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TUYA_BENCHMARK_H
+#define TUYA_BENCHMARK_H
+
+#include <Arduino.h>
+#include "SkyfanConfig.h"
+#include "TuyaProtocol.h"
+
+#if SKYFAN_BENCHMARK
+
+// Runs against a private TuyaProtocol instance whose frames go to a sink and whose
+// received bytes are injected, so the UART and the live link are never touched.
+namespace TuyaBenchmark {
+
+static volatile uint32_t sinkBytes = 0;
+
+static void sink(const uint8_t* /* frame */, uint16_t len) {
+  sinkBytes += len;
+}
+
+static uint16_t buildFrame(uint8_t* out, uint8_t cmd, const uint8_t* data, uint16_t len) {
+  uint16_t idx = 0;
+  out[idx++] = (TUYA_HEADER >> 8) & 0xFF;
+  out[idx++] = TUYA_HEADER & 0xFF;
+  out[idx++] = TUYA_VERSION;
+  out[idx++] = cmd;
+  out[idx++] = (len >> 8) & 0xFF;
+  out[idx++] = len & 0xFF;
+  memcpy(&out[idx], data, len);
+  idx += len;
+  out[idx] = TuyaProtocol::calculateChecksum(&out[2], idx - 2);
+  return idx + 1;
+}
+
+// Representative MCU traffic: a wall-remote style report of three DPs,
+// a heartbeat reply and a SEND_COMMAND echo
+static uint16_t buildTraffic(uint8_t* out) {
+  uint8_t report[3 * TUYA_DP_MAX_ENCODED_SIZE];
+  uint16_t reportLen = 0;
+  reportLen += TuyaProtocol::encodeDataPoint(&report[reportLen], DP_FAN_SWITCH, DP_TYPE_BOOL, 1);
+  reportLen += TuyaProtocol::encodeDataPoint(&report[reportLen], DP_FAN_SPEED, DP_TYPE_VALUE, FAN_SPEED_MEDIUM_TUYA);
+  reportLen += TuyaProtocol::encodeDataPoint(&report[reportLen], DP_FAN_DIRECTION, DP_TYPE_ENUM, FAN_DIRECTION_REVERSE);
+  
+  uint8_t heartbeatReply = 0x01;
+  uint16_t len = 0;
+  len += buildFrame(&out[len], TUYA_CMD_STATUS_REPORT, report, reportLen);
+  len += buildFrame(&out[len], TUYA_CMD_HEARTBEAT, &heartbeatReply, 1);
+  len += buildFrame(&out[len], TUYA_CMD_SEND_COMMAND, nullptr, 0);
+  return len;
+}
+
+static void printResult(const char* name, uint32_t frames, uint32_t bytes, unsigned long elapsedUs) {
+  if (elapsedUs == 0) {
+    elapsedUs = 1;
+  }
+  Serial.printf("  %-18s %8lu frames/s %10lu bytes/s (%lu us)\n", name,
+    (unsigned long)((uint64_t)frames * 1000000ULL / elapsedUs),
+    (unsigned long)((uint64_t)bytes * 1000000ULL / elapsedUs),
+    elapsedUs);
+}
+
+// False if the decoder dropped any of the traffic
+inline bool run(HardwareSerial* serial) {
+  static TuyaProtocol bench(serial);  // Never begun, so the UART is left alone
+  bench.setTransmitHook(sink);
+  
+  uint8_t traffic[TUYA_BUFFER_SIZE];
+  uint16_t trafficLen = buildTraffic(traffic);
+  const uint16_t trafficFrames = 3;
+  
+  Serial.printf("Tuya protocol benchmark (%lu iterations)\n", (unsigned long)BENCHMARK_ITERATIONS);
+  
+  // Checksum over a full-size frame
+  uint8_t block[TUYA_BUFFER_SIZE];
+  for (uint16_t i = 0; i < sizeof(block); i++) {
+    block[i] = (uint8_t)i;
+  }
+  volatile uint8_t checksum = 0;
+  unsigned long start = micros();
+  for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    checksum += TuyaProtocol::calculateChecksum(block, sizeof(block));
+  }
+  printResult("calculateChecksum", BENCHMARK_ITERATIONS, (uint32_t)BENCHMARK_ITERATIONS * sizeof(block), micros() - start);
+  
+  // Encoding a three-DP SEND_COMMAND frame
+  uint8_t payload[3 * TUYA_DP_MAX_ENCODED_SIZE];
+  uint16_t payloadLen = 0;
+  payloadLen += TuyaProtocol::encodeDataPoint(&payload[payloadLen], DP_LIGHT_SWITCH, DP_TYPE_BOOL, 1);
+  payloadLen += TuyaProtocol::encodeDataPoint(&payload[payloadLen], DP_LIGHT_DIMMER, DP_TYPE_VALUE, 3);
+  payloadLen += TuyaProtocol::encodeDataPoint(&payload[payloadLen], DP_LIGHT_COLOUR_TEMP, DP_TYPE_ENUM, COLOUR_TEMP_NATURAL);
+  
+  TuyaProtocolStats before = bench.getStats();
+  start = micros();
+  for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    bench.sendCommand(TUYA_CMD_SEND_COMMAND, payload, payloadLen);
+    bench.serviceTransmit();
+  }
+  unsigned long elapsed = micros() - start;
+  printResult("sendCommand", bench.getStats().framesSent - before.framesSent,
+              bench.getStats().bytesSent - before.bytesSent, elapsed);
+  
+  // Decoding mixed MCU traffic, one traffic block per pass
+  before = bench.getStats();
+  start = micros();
+  for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    bench.injectReceived(traffic, trafficLen);
+    bench.processResponse(true);
+    bench.serviceTransmit();
+  }
+  elapsed = micros() - start;
+  printResult("processResponse", bench.getStats().framesReceived - before.framesReceived,
+              bench.getStats().bytesReceived - before.bytesReceived, elapsed);
+  
+  if (bench.getStats().framesReceived - before.framesReceived != (uint32_t)BENCHMARK_ITERATIONS * trafficFrames) {
+    Serial.println("  WARNING: decoder dropped frames during benchmark");
+    return false;
+  }
+  return true;
+}
+
+} // namespace TuyaBenchmark
+
+#endif // SKYFAN_BENCHMARK
+
+#endif // TUYA_BENCHMARK_H
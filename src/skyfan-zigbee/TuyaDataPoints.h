@@ -0,0 +1,94 @@
+/*
+ * Tuya Data Points - Compile-time registry of the fan MCU's data points
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TUYA_DATA_POINTS_H
+#define TUYA_DATA_POINTS_H
+
+#include <Arduino.h>
+#include "SkyfanConfig.h"
+
+// Data Point Types
+#define DP_TYPE_BOOL 0x01
+#define DP_TYPE_VALUE 0x02
+#define DP_TYPE_ENUM 0x04
+
+// Data point registry - one entry per DP supported by the fan MCU:
+//   X(name, DPID, type, min, max, status handler)
+// DP_<name> constants, descriptors, range validation and the bridge's inbound
+// dispatch are all generated from this list. The handler is a SkyfanBridge
+// member taking the reported value; adding a DP needs only a new line and its handler.
+#define TUYA_DATA_POINTS(X) \
+  X(FAN_SWITCH,        1,  DP_TYPE_BOOL,  0,                   1,                   handleFanSwitchStatus) \
+  X(FAN_MODE,          2,  DP_TYPE_ENUM,  0,                   2,                   handleFanModeStatus) \
+  X(FAN_SPEED,         3,  DP_TYPE_VALUE, TUYA_FAN_SPEED_MIN,  TUYA_FAN_SPEED_MAX,  handleFanSpeedStatus) \
+  X(FAN_DIRECTION,     8,  DP_TYPE_ENUM,  0,                   1,                   handleFanDirectionStatus) \
+  X(LIGHT_SWITCH,      15, DP_TYPE_BOOL,  0,                   1,                   handleLightSwitchStatus) \
+  X(LIGHT_DIMMER,      16, DP_TYPE_VALUE, TUYA_BRIGHTNESS_MIN, TUYA_BRIGHTNESS_MAX, handleLightBrightnessStatus) \
+  X(LIGHT_COLOUR_TEMP, 19, DP_TYPE_ENUM,  0,                   2,                   handleLightColourTempStatus)
+
+// DPID constants (DP_FAN_SWITCH, DP_FAN_SPEED, ...)
+#define TUYA_DP_ID(name, dpid, type, min, max, handler) DP_##name = dpid,
+enum TuyaDataPointId : uint8_t {
+  TUYA_DATA_POINTS(TUYA_DP_ID)
+};
+#undef TUYA_DP_ID
+
+struct TuyaDataPoint {
+  uint8_t dpid;
+  uint8_t type;
+  uint32_t min;
+  uint32_t max;
+};
+
+#define TUYA_DP_DESCRIPTOR(name, dpid, type, min, max, handler) { dpid, type, min, max },
+constexpr TuyaDataPoint TUYA_DATA_POINT_TABLE[] = {
+  TUYA_DATA_POINTS(TUYA_DP_DESCRIPTOR)
+};
+#undef TUYA_DP_DESCRIPTOR
+
+constexpr uint8_t TUYA_DATA_POINT_COUNT = sizeof(TUYA_DATA_POINT_TABLE) / sizeof(TUYA_DATA_POINT_TABLE[0]);
+
+// Table position of a DPID, or -1. Only ever evaluated at compile time.
+constexpr int8_t tuyaDataPointIndex(uint8_t dpid, uint8_t index = 0) {
+  return (index >= TUYA_DATA_POINT_COUNT) ? -1 :
+         (TUYA_DATA_POINT_TABLE[index].dpid == dpid) ? index : tuyaDataPointIndex(dpid, index + 1);
+}
+
+// Descriptor for a DPID known at compile time
+template<uint8_t DPID>
+constexpr const TuyaDataPoint& tuyaDataPoint() {
+  static_assert(tuyaDataPointIndex(DPID) >= 0, "DPID missing from TUYA_DATA_POINTS");
+  return TUYA_DATA_POINT_TABLE[tuyaDataPointIndex(DPID)];
+}
+
+// Table position of a runtime DPID, or -1 (compiled to a switch, no search)
+inline int8_t tuyaDataPointSlot(uint8_t dpid) {
+#define TUYA_DP_SLOT(name, dpid, type, min, max, handler) case dpid: { constexpr int8_t slot = tuyaDataPointIndex(dpid); return slot; }
+  switch (dpid) {
+    TUYA_DATA_POINTS(TUYA_DP_SLOT)
+    default: return -1;
+  }
+#undef TUYA_DP_SLOT
+}
+
+// Check a runtime DPID/value pair against its descriptor
+inline bool isValidTuyaDataPoint(uint8_t dpid, uint32_t value) {
+  int8_t slot = tuyaDataPointSlot(dpid);
+  return slot >= 0 && value >= TUYA_DATA_POINT_TABLE[slot].min && value <= TUYA_DATA_POINT_TABLE[slot].max;
+}
+
+#endif // TUYA_DATA_POINTS_H
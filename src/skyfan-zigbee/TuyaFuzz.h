@@ -0,0 +1,332 @@
+/*
+ * Tuya Fuzz - On-device fuzzing of the frame decoder and DP parser
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TUYA_FUZZ_H
+#define TUYA_FUZZ_H
+
+#include <Arduino.h>
+#include "SkyfanConfig.h"
+#include "TuyaProtocol.h"
+#include <new>
+
+#if SKYFAN_FUZZ
+
+#define FUZZ_MAX_INPUT            (TUYA_RX_BUFFER_SIZE * 2)  // Longer than the ring, so overflow is reached too
+#define FUZZ_MAX_SIGNATURES       256
+#define FUZZ_HANG_US              20000  // A single input taking longer than this is reported
+#define FUZZ_REPORT_INTERVAL_MS   5000
+#define FUZZ_MAX_FAILURES         8      // Stop printing failing inputs after this many
+
+// Mutates real MCU frames and feeds them through a fresh TuyaProtocol per input, with
+// its transmit side going to a checker and its receive side injected, so the UART and
+// the live link are never touched. There is no compiler coverage on the device, so the
+// set of protocol statistics an input moves is used as its coverage signature: inputs
+// that produce a new signature join the corpus and are mutated further.
+namespace TuyaFuzz {
+
+struct Input {
+  uint16_t len;
+  uint8_t data[FUZZ_MAX_INPUT];
+};
+
+struct Results {
+  uint32_t execs;
+  uint32_t signatures;
+  uint32_t outOfRangeValues;   // Registered DP delivered with a value outside its descriptor
+  uint32_t overConsumed;       // Decoder accounted for more bytes than it was given
+  uint32_t badFrames;          // Malformed frame sent to the MCU in response
+  uint32_t hangs;
+  uint32_t slowestUs;
+};
+
+static Input corpus[FUZZ_CORPUS_SIZE];
+static uint8_t corpusCount = 0;
+static uint8_t seedCount = 0;
+static uint32_t signatures[FUZZ_MAX_SIGNATURES];
+static Results results;
+static uint32_t rngState = FUZZ_SEED;
+
+// Per-input observations from the callbacks
+static uint32_t caseCallbacks;
+static bool caseFailed;
+
+static uint32_t nextRandom() {
+  // xorshift32 - fast and repeatable for a given FUZZ_SEED
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+static uint32_t randomBelow(uint32_t limit) {
+  return (limit == 0) ? 0 : nextRandom() % limit;
+}
+
+static void onStatus(uint8_t dpid, uint32_t value) {
+  caseCallbacks |= 1UL << (dpid & 0x1F);
+  if (tuyaDataPointSlot(dpid) >= 0 && !isValidTuyaDataPoint(dpid, value)) {
+    results.outOfRangeValues++;
+    caseFailed = true;
+  }
+}
+
+// Everything TuyaProtocol sends must be a well-formed frame
+static void onTransmit(const uint8_t* frame, uint16_t len) {
+  bool valid = len >= TUYA_FRAME_OVERHEAD && len <= TUYA_BUFFER_SIZE &&
+               frame[0] == ((TUYA_HEADER >> 8) & 0xFF) && frame[1] == (TUYA_HEADER & 0xFF) &&
+               ((frame[4] << 8) | frame[5]) + TUYA_FRAME_OVERHEAD == len &&
+               TuyaProtocol::calculateChecksum(&frame[2], len - 3) == frame[len - 1];
+  if (!valid) {
+    results.badFrames++;
+    caseFailed = true;
+  }
+}
+
+static void addFrame(Input* in, uint8_t cmd, const uint8_t* data, uint16_t len) {
+  uint8_t* out = &in->data[in->len];
+  uint16_t idx = 0;
+  out[idx++] = (TUYA_HEADER >> 8) & 0xFF;
+  out[idx++] = TUYA_HEADER & 0xFF;
+  out[idx++] = TUYA_VERSION;
+  out[idx++] = cmd;
+  out[idx++] = (len >> 8) & 0xFF;
+  out[idx++] = len & 0xFF;
+  memcpy(&out[idx], data, len);
+  idx += len;
+  out[idx] = TuyaProtocol::calculateChecksum(&out[2], idx - 2);
+  in->len += idx + 1;
+}
+
+static void addSeed(uint8_t cmd, const uint8_t* data, uint16_t len) {
+  if (corpusCount < FUZZ_CORPUS_SIZE) {
+    corpus[corpusCount].len = 0;
+    addFrame(&corpus[corpusCount++], cmd, data, len);
+  }
+}
+
+// Frames a real fan MCU sends: heartbeat replies, product info, one report per
+// registered DP, a wall-remote style multi-DP report, ACKs and a network status query
+static void buildSeeds() {
+  uint8_t restarted = 0x00;
+  uint8_t running = 0x01;
+  const char productInfo[] = "{\"p\":\"skyfan\",\"v\":\"1.0.0\",\"m\":0}";
+  addSeed(TUYA_CMD_HEARTBEAT, &restarted, 1);
+  addSeed(TUYA_CMD_HEARTBEAT, &running, 1);
+  addSeed(TUYA_CMD_PRODUCT_INFO, (const uint8_t*)productInfo, sizeof(productInfo) - 1);
+  addSeed(TUYA_CMD_SEND_COMMAND, nullptr, 0);
+  addSeed(TUYA_CMD_NETWORK_STATUS, nullptr, 0);
+
+  uint8_t report[TUYA_DATA_POINT_COUNT * TUYA_DP_MAX_ENCODED_SIZE];
+  uint16_t reportLen = 0;
+  for (const TuyaDataPoint& dp : TUYA_DATA_POINT_TABLE) {
+    uint8_t single[TUYA_DP_MAX_ENCODED_SIZE];
+    uint16_t singleLen = TuyaProtocol::encodeDataPoint(single, dp.dpid, dp.type, dp.max);
+    addSeed(TUYA_CMD_STATUS_REPORT, single, singleLen);
+    reportLen += TuyaProtocol::encodeDataPoint(&report[reportLen], dp.dpid, dp.type, dp.min);
+  }
+  addSeed(TUYA_CMD_STATUS_REPORT, report, reportLen);
+
+  // Link-up sequence in one input: restart heartbeat followed by the DP dump
+  if (corpusCount < FUZZ_CORPUS_SIZE) {
+    Input* in = &corpus[corpusCount++];
+    in->len = 0;
+    addFrame(in, TUYA_CMD_HEARTBEAT, &restarted, 1);
+    addFrame(in, TUYA_CMD_STATUS_REPORT, report, reportLen);
+  }
+}
+
+// One random edit of the input
+static void mutate(Input* in) {
+  uint16_t pos = randomBelow(in->len ? in->len : 1);
+  switch (randomBelow(8)) {
+    case 0:  // Flip a bit
+      if (in->len) {
+        in->data[pos] ^= 1 << randomBelow(8);
+      }
+      break;
+    case 1:  // Random byte
+      if (in->len) {
+        in->data[pos] = nextRandom();
+      }
+      break;
+    case 2: {  // Interesting values where lengths and types live
+      static const uint8_t interesting[] = { 0x00, 0x01, 0x04, 0x7F, 0x80, 0xFE, 0xFF };
+      if (in->len) {
+        in->data[pos] = interesting[randomBelow(sizeof(interesting))];
+      }
+      break;
+    }
+    case 3:  // Insert a byte
+      if (in->len < FUZZ_MAX_INPUT) {
+        memmove(&in->data[pos + 1], &in->data[pos], in->len - pos);
+        in->data[pos] = nextRandom();
+        in->len++;
+      }
+      break;
+    case 4:  // Delete a byte
+      if (in->len) {
+        memmove(&in->data[pos], &in->data[pos + 1], in->len - pos - 1);
+        in->len--;
+      }
+      break;
+    case 5:  // Truncate
+      in->len = pos;
+      break;
+    case 6: {  // Append another corpus entry (frame sequences, split frames)
+      const Input& other = corpus[randomBelow(corpusCount)];
+      uint16_t take = (other.len < FUZZ_MAX_INPUT - in->len) ? other.len : FUZZ_MAX_INPUT - in->len;
+      memcpy(&in->data[in->len], other.data, take);
+      in->len += take;
+      break;
+    }
+    default: {  // Overwrite a 16-bit field, such as the frame or a DP length, with an edge value
+      static const uint16_t edges[] = { 0x0000, 0x0001, 0x00FF, 0x0100, TUYA_BUFFER_SIZE - TUYA_FRAME_OVERHEAD,
+                                        TUYA_BUFFER_SIZE, 0x7FFF, 0xFFFF };
+      if (in->len >= 2) {
+        uint16_t at = (pos < in->len - 1) ? pos : in->len - 2;
+        uint16_t edge = edges[randomBelow(sizeof(edges) / sizeof(edges[0]))];
+        in->data[at] = edge >> 8;
+        in->data[at + 1] = edge & 0xFF;
+      }
+      break;
+    }
+  }
+}
+
+static bool addSignature(uint32_t signature) {
+  for (uint32_t i = 0; i < results.signatures; i++) {
+    if (signatures[i] == signature) {
+      return false;
+    }
+  }
+  if (results.signatures < FUZZ_MAX_SIGNATURES) {
+    signatures[results.signatures++] = signature;
+  }
+  return true;
+}
+
+static void printInput(const char* reason, const Input& in) {
+  Serial.printf("  FAIL (%s) after %lu execs, %u bytes:\n  ", reason, (unsigned long)results.execs, in.len);
+  for (uint16_t i = 0; i < in.len; i++) {
+    Serial.printf("%02x", in.data[i]);
+  }
+  Serial.println();
+}
+
+// Run one input against a fresh decoder, delivered in two chunks split at the given
+// offset so partial frames are exercised; returns its coverage signature
+static uint32_t execute(HardwareSerial* serial, const Input& in, uint16_t split) {
+  // Rebuilt in place for every input; too big for the loop task's stack with its transmit queues
+  alignas(TuyaProtocol) static uint8_t targetStorage[sizeof(TuyaProtocol)];
+  TuyaProtocol& target = *new (targetStorage) TuyaProtocol(serial);  // Never begun, so the UART is left alone
+  target.setTransmitHook(onTransmit);
+  target.setDeviceStatusCallback(onStatus);
+  caseCallbacks = 0;
+  caseFailed = false;
+
+  unsigned long start = micros();
+  target.injectReceived(in.data, split);
+  target.update(true);
+  target.injectReceived(&in.data[split], in.len - split);
+  target.update(true);
+  unsigned long elapsed = micros() - start;
+
+  const TuyaProtocolStats& stats = target.getStats();
+  if (stats.bytesReceived + stats.bytesDiscarded + stats.rxOverflowBytes > in.len) {
+    results.overConsumed++;
+    caseFailed = true;
+  }
+  if (elapsed > FUZZ_HANG_US) {
+    results.hangs++;
+    caseFailed = true;
+  }
+  if (elapsed > results.slowestUs) {
+    results.slowestUs = elapsed;
+  }
+  results.execs++;
+
+  // Which counters moved, plus which DPs were delivered
+  static_assert(sizeof(TuyaProtocolStats) % sizeof(uint32_t) == 0, "Stats are read as a uint32 array");
+  const uint32_t* counters = reinterpret_cast<const uint32_t*>(&stats);
+  uint32_t signature = caseCallbacks * 2654435761UL;
+  for (uint8_t i = 0; i < sizeof(TuyaProtocolStats) / sizeof(uint32_t); i++) {
+    if (counters[i]) {
+      signature ^= 1UL << (i & 0x1F);
+    }
+  }
+  return signature;
+}
+
+inline void run(HardwareSerial* serial) {
+  static Input candidate;
+  uint32_t failures = 0;
+
+  buildSeeds();
+  seedCount = corpusCount;
+  Serial.printf("Tuya decoder fuzz (%d seeds, %lu s)\n", corpusCount, (unsigned long)(FUZZ_DURATION_MS / 1000));
+  for (uint8_t i = 0; i < corpusCount; i++) {
+    addSignature(execute(serial, corpus[i], randomBelow(corpus[i].len + 1)));
+  }
+
+  unsigned long start = millis();
+  unsigned long lastReport = start;
+  uint32_t lastExecs = results.execs;
+  while (millis() - start < FUZZ_DURATION_MS) {
+    candidate = corpus[randomBelow(corpusCount)];
+    uint8_t edits = 1 + randomBelow(4);
+    for (uint8_t i = 0; i < edits; i++) {
+      mutate(&candidate);
+    }
+
+    uint32_t signature = execute(serial, candidate, randomBelow(candidate.len + 1));
+    if (caseFailed && failures++ < FUZZ_MAX_FAILURES) {
+      printInput("invariant", candidate);
+    }
+    if (addSignature(signature) && (corpusCount < FUZZ_CORPUS_SIZE || corpusCount > seedCount)) {
+      // New behaviour: keep the input, replacing a random non-seed entry once full
+      uint8_t slot = (corpusCount < FUZZ_CORPUS_SIZE) ? corpusCount++ : seedCount + randomBelow(corpusCount - seedCount);
+      corpus[slot] = candidate;
+    }
+
+    unsigned long now = millis();
+    if (now - lastReport >= FUZZ_REPORT_INTERVAL_MS) {
+      Serial.printf("  %lu execs (%lu/s), corpus %u, signatures %lu\n", (unsigned long)results.execs,
+                    (unsigned long)((results.execs - lastExecs) * 1000UL / (now - lastReport)),
+                    corpusCount, (unsigned long)results.signatures);
+      lastReport = now;
+      lastExecs = results.execs;
+    }
+    if ((results.execs & 0x3FF) == 0) {
+      delay(1);  // Let the idle task feed the watchdog
+    }
+  }
+
+  unsigned long elapsed = millis() - start;
+  Serial.printf("Fuzz done: %lu execs in %lu ms (%lu execs/s), slowest input %lu us\n",
+                (unsigned long)results.execs, elapsed,
+                (unsigned long)((uint64_t)results.execs * 1000ULL / (elapsed ? elapsed : 1)),
+                (unsigned long)results.slowestUs);
+  Serial.printf("  out-of-range DPs %lu, over-consumed %lu, bad frames sent %lu, slow inputs %lu\n",
+                (unsigned long)results.outOfRangeValues, (unsigned long)results.overConsumed,
+                (unsigned long)results.badFrames, (unsigned long)results.hangs);
+}
+
+} // namespace TuyaFuzz
+
+#endif // SKYFAN_FUZZ
+
+#endif // TUYA_FUZZ_H
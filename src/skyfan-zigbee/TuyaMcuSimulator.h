@@ -0,0 +1,419 @@
+/*
+ * Tuya MCU Simulator - Simulated fan MCU and scripted load for testing without a fan
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TUYA_MCU_SIMULATOR_H
+#define TUYA_MCU_SIMULATOR_H
+
+#include <Arduino.h>
+#include "SkyfanConfig.h"
+#include "TuyaProtocol.h"
+
+#if SKYFAN_MCU_SIMULATOR
+
+#define SIMULATOR_MAX_FRAME_SIZE  64
+#define SIMULATOR_MAX_DPID        32   // DPIDs in TUYA_DATA_POINTS must be below this
+#define SIMULATOR_MAX_TRACKED     TUYA_MAX_PENDING_COMMANDS
+#define SIMULATOR_PRODUCT_INFO    "{\"p\":\"skyfansim\",\"v\":\"1.0.0\",\"m\":0}"
+
+// Runtime copy of the SIMULATOR_* settings, so the host tool can take them from its
+// command line; the compiled values are the defaults
+struct SimulatorProfile {
+  uint32_t latencyMs = SIMULATOR_LATENCY_MS;
+  uint32_t jitterMs = SIMULATOR_JITTER_MS;
+  uint32_t dropPerMille = SIMULATOR_DROP_PER_MILLE;
+  uint32_t burstIntervalMs = SIMULATOR_BURST_INTERVAL_MS;
+  uint32_t burstSize = SIMULATOR_BURST_SIZE;
+  uint32_t loadRate = SIMULATOR_LOAD_RATE;
+  uint32_t reportIntervalMs = SIMULATOR_REPORT_INTERVAL_MS;
+};
+
+// Frame waiting to be "sent" by the simulated MCU
+struct SimulatorFrame {
+  bool used;
+  unsigned long due;
+  uint16_t len;
+  uint8_t data[SIMULATOR_MAX_FRAME_SIZE];
+};
+
+// Scripted load results
+struct SimulatorLoadStats {
+  uint32_t issued;
+  uint32_t rejected;       // Outstanding-command table full
+  uint32_t acked;
+  uint32_t timedOut;
+  uint32_t latencyTotalUs;
+  uint32_t latencyMaxUs;
+  uint8_t maxQueueDepth;
+};
+
+// Answers the frames TuyaProtocol transmits, so the whole stack above the UART runs as
+// normal. On the device the link is looped back: frames arrive through the transmit hook
+// and responses are injected into the receive path. The host tool puts it on a serial
+// line (a pty) instead, where bytes arrive through receiveBytes() and responses are
+// written to the line.
+class TuyaMcuSimulator {
+private:
+  static inline TuyaMcuSimulator* active = nullptr;
+
+  TuyaProtocol* link;      // Bridge under test, target of the scripted load
+  Print* wire;             // Serial line to answer on, or nullptr when looped back
+  SimulatorProfile profile;
+  SimulatorFrame outbox[SIMULATOR_OUTBOX_SIZE];
+  uint8_t rxFrame[SIMULATOR_MAX_FRAME_SIZE];  // Frame being reassembled from the serial line
+  uint16_t rxLen;
+  uint32_t dpValues[SIMULATOR_MAX_DPID];
+  uint8_t dpTypes[SIMULATOR_MAX_DPID];
+  bool heartbeatSeen;
+
+  unsigned long nextBurst;
+  unsigned long nextLoadCommand;
+  unsigned long nextReport;
+  uint32_t loadStep;
+
+  struct { uint8_t handle; unsigned long sentUs; } tracked[SIMULATOR_MAX_TRACKED];
+  SimulatorLoadStats load;
+
+  static void onTransmit(const uint8_t* frame, uint16_t len) {
+    if (active) {
+      active->receiveFrame(frame, len);
+    }
+  }
+
+  // Queue a response after the configured latency and jitter
+  void queueFrame(uint8_t cmd, const uint8_t* data, uint16_t len) {
+    if (len + TUYA_FRAME_OVERHEAD > SIMULATOR_MAX_FRAME_SIZE) {
+      return;
+    }
+    for (uint8_t i = 0; i < SIMULATOR_OUTBOX_SIZE; i++) {
+      SimulatorFrame& frame = outbox[i];
+      if (frame.used) {
+        continue;
+      }
+
+      uint16_t idx = 0;
+      frame.data[idx++] = (TUYA_HEADER >> 8) & 0xFF;
+      frame.data[idx++] = TUYA_HEADER & 0xFF;
+      frame.data[idx++] = TUYA_VERSION;
+      frame.data[idx++] = cmd;
+      frame.data[idx++] = (len >> 8) & 0xFF;
+      frame.data[idx++] = len & 0xFF;
+      if (data && len > 0) {
+        memcpy(&frame.data[idx], data, len);
+        idx += len;
+      }
+      frame.data[idx] = TuyaProtocol::calculateChecksum(&frame.data[2], idx - 2);
+      frame.len = idx + 1;
+      frame.due = millis() + profile.latencyMs + (profile.jitterMs ? random(profile.jitterMs + 1) : 0);
+      frame.used = true;
+      return;
+    }
+    // Outbox full - the response is lost, as it would be from an overloaded MCU
+  }
+
+  void queueStatusReport(const uint8_t* dpids, uint8_t count) {
+    uint8_t data[SIMULATOR_MAX_FRAME_SIZE];
+    uint16_t len = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      if (len + TUYA_DP_MAX_ENCODED_SIZE + TUYA_FRAME_OVERHEAD > SIMULATOR_MAX_FRAME_SIZE) {
+        break;
+      }
+      uint8_t dpid = dpids[i];
+      len += TuyaProtocol::encodeDataPoint(&data[len], dpid, dpTypes[dpid], dpValues[dpid]);
+    }
+    queueFrame(TUYA_CMD_STATUS_REPORT, data, len);
+  }
+
+  void queueFullReport() {
+    uint8_t dpids[SIMULATOR_MAX_DPID];
+    uint8_t count = 0;
+    for (uint8_t dpid = 0; dpid < SIMULATOR_MAX_DPID; dpid++) {
+      if (dpTypes[dpid] != 0) {
+        dpids[count++] = dpid;
+      }
+    }
+    queueStatusReport(dpids, count);
+  }
+
+  // Apply the DP records of a SEND_COMMAND and report back the DPs it touched
+  void applyCommand(const uint8_t* data, uint16_t len) {
+    uint8_t changed[SIMULATOR_MAX_DPID];
+    uint8_t count = 0;
+    uint16_t idx = 0;
+
+    while (idx + 4 <= len) {
+      uint8_t dpid = data[idx];
+      uint8_t type = data[idx + 1];
+      uint16_t dpLen = (data[idx + 2] << 8) | data[idx + 3];
+      idx += 4;
+      if (idx + dpLen > len) {
+        break;
+      }
+
+      uint32_t value = 0;
+      for (uint16_t i = 0; i < dpLen && i < 4; i++) {
+        value = (value << 8) | data[idx + i];
+      }
+      idx += dpLen;
+
+      if (dpid < SIMULATOR_MAX_DPID && dpTypes[dpid] == type) {
+        dpValues[dpid] = value;
+        changed[count++] = dpid;
+      }
+    }
+
+    if (count > 0) {
+      queueStatusReport(changed, count);
+    }
+  }
+
+  // Move due frames into the protocol's receive path or onto the line, dropping bytes if configured
+  void deliver(unsigned long now) {
+    for (uint8_t i = 0; i < SIMULATOR_OUTBOX_SIZE; i++) {
+      SimulatorFrame& frame = outbox[i];
+      if (!frame.used || (long)(now - frame.due) < 0) {
+        continue;
+      }
+
+      uint8_t bytes[SIMULATOR_MAX_FRAME_SIZE];
+      uint16_t byteCount = 0;
+      for (uint16_t b = 0; b < frame.len; b++) {
+        if (profile.dropPerMille == 0 || random(1000) >= (long)profile.dropPerMille) {
+          bytes[byteCount++] = frame.data[b];
+        }
+      }
+      if (wire) {
+        wire->write(bytes, byteCount);
+      } else {
+        link->injectReceived(bytes, byteCount);
+      }
+      frame.used = false;
+    }
+  }
+
+  // Scripted load: step the dimmer and fan speed through their ranges
+  void issueLoadCommand() {
+    uint8_t depth = link->pendingCommandCount();
+    if (depth > load.maxQueueDepth) {
+      load.maxQueueDepth = depth;
+    }
+
+    uint8_t handle;
+    if (loadStep & 1) {
+      handle = link->sendDataPoint(DP_FAN_SPEED, DP_TYPE_VALUE, 1 + (loadStep / 2) % TUYA_FAN_SPEED_MAX);
+    } else {
+      handle = link->sendDataPoint(DP_LIGHT_DIMMER, DP_TYPE_VALUE, (loadStep / 2) % (TUYA_BRIGHTNESS_MAX + 1));
+    }
+    loadStep++;
+
+    if (handle == TUYA_INVALID_HANDLE) {
+      load.rejected++;
+      return;
+    }
+    load.issued++;
+    tracked[handle % SIMULATOR_MAX_TRACKED].handle = handle;
+    tracked[handle % SIMULATOR_MAX_TRACKED].sentUs = micros();
+  }
+
+public:
+  // Scripted load results and the bridge's transmit queues
+  void printLoadStats() {
+    Serial.printf("Simulator: issued %lu, rejected %lu, acked %lu, timed out %lu, ACK latency avg %lu us max %lu us, max queue %d\n",
+      (unsigned long)load.issued, (unsigned long)load.rejected, (unsigned long)load.acked, (unsigned long)load.timedOut,
+      (unsigned long)(load.acked ? load.latencyTotalUs / load.acked : 0), (unsigned long)load.latencyMaxUs,
+      load.maxQueueDepth);
+    
+    // Bridge-side transmit queue, per priority class
+    static const char* const classNames[TUYA_TX_CLASS_COUNT] = { "user", "reply", "sync", "heartbeat" };
+    for (uint8_t i = 0; i < TUYA_TX_CLASS_COUNT; i++) {
+      const TuyaTxClassStats& tx = link->getTxStats(static_cast<TuyaTxClass>(i));
+      Serial.printf("  TX %-9s sent %lu, dropped %lu, max depth %d, wait avg %lu us max %lu us, promoted %lu\n",
+        classNames[i], (unsigned long)tx.frames, (unsigned long)tx.dropped, tx.maxDepth,
+        (unsigned long)(tx.frames ? tx.totalWaitUs / tx.frames : 0), (unsigned long)tx.maxWaitUs,
+        (unsigned long)tx.promoted);
+    }
+  }
+
+  TuyaMcuSimulator()
+    : link(nullptr), wire(nullptr), rxLen(0), heartbeatSeen(false), nextBurst(0), nextLoadCommand(0), nextReport(0),
+      loadStep(0), load() {
+    memset(outbox, 0, sizeof(outbox));
+    memset(dpValues, 0, sizeof(dpValues));
+    memset(dpTypes, 0, sizeof(dpTypes));
+    memset(tracked, 0, sizeof(tracked));
+
+    // Every registered DP, with the fan off and the light on at level 3
+    for (uint8_t i = 0; i < TUYA_DATA_POINT_COUNT; i++) {
+      dpTypes[TUYA_DATA_POINT_TABLE[i].dpid] = TUYA_DATA_POINT_TABLE[i].type;
+      dpValues[TUYA_DATA_POINT_TABLE[i].dpid] = TUYA_DATA_POINT_TABLE[i].min;
+    }
+    dpValues[DP_FAN_SPEED] = FAN_SPEED_LOW_TUYA;
+    dpValues[DP_LIGHT_SWITCH] = 1;
+    dpValues[DP_LIGHT_DIMMER] = 3;
+  }
+
+  // Set before attach()
+  void setProfile(const SimulatorProfile& settings) {
+    profile = settings;
+  }
+
+  const SimulatorLoadStats& getLoadStats() const {
+    return load;
+  }
+
+  // Loop the protocol's link back to the simulator
+  void attach(TuyaProtocol* protocol) {
+    active = this;
+    protocol->setTransmitHook(onTransmit);
+    attach(protocol, nullptr);
+  }
+
+  // Answer on a serial line. The protocol, if any, is the bridge on the other end of
+  // the line, which the scripted load is aimed at.
+  void attach(TuyaProtocol* protocol, Print* serialWire) {
+    link = protocol;
+    wire = serialWire;
+
+    unsigned long now = millis();
+    nextBurst = now + profile.burstIntervalMs;
+    nextLoadCommand = now;
+    nextReport = now + profile.reportIntervalMs;
+  }
+
+  // Bytes read from the serial line; complete frames with a good checksum are answered
+  void receiveBytes(const uint8_t* data, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) {
+      uint8_t b = data[i];
+      if ((rxLen == 0 && b != ((TUYA_HEADER >> 8) & 0xFF)) || (rxLen == 1 && b != (TUYA_HEADER & 0xFF))) {
+        rxLen = (b == ((TUYA_HEADER >> 8) & 0xFF)) ? 1 : 0;
+        continue;
+      }
+      rxFrame[rxLen++] = b;
+      if (rxLen < TUYA_FRAME_HEADER_SIZE) {
+        continue;
+      }
+
+      uint16_t frameLen = ((rxFrame[4] << 8) | rxFrame[5]) + TUYA_FRAME_OVERHEAD;
+      if (frameLen > SIMULATOR_MAX_FRAME_SIZE) {
+        rxLen = 0;
+      } else if (rxLen == frameLen) {
+        if (TuyaProtocol::calculateChecksum(&rxFrame[2], frameLen - 3) == rxFrame[frameLen - 1]) {
+          receiveFrame(rxFrame, frameLen);
+        }
+        rxLen = 0;
+      }
+    }
+  }
+
+  // A frame transmitted by TuyaProtocol arrives at the simulated MCU
+  void receiveFrame(const uint8_t* frame, uint16_t len) {
+    if (len < TUYA_FRAME_OVERHEAD) {
+      return;
+    }
+    uint8_t cmd = frame[3];
+    uint16_t dataLen = (frame[4] << 8) | frame[5];
+    const uint8_t* data = &frame[TUYA_FRAME_HEADER_SIZE];
+
+    switch (cmd) {
+      case TUYA_CMD_HEARTBEAT: {
+        // 0x00 on the first reply after power-up, 0x01 afterwards
+        uint8_t reply = heartbeatSeen ? 0x01 : 0x00;
+        heartbeatSeen = true;
+        queueFrame(TUYA_CMD_HEARTBEAT, &reply, 1);
+        break;
+      }
+      case TUYA_CMD_PRODUCT_INFO:
+        queueFrame(TUYA_CMD_PRODUCT_INFO, (const uint8_t*)SIMULATOR_PRODUCT_INFO, strlen(SIMULATOR_PRODUCT_INFO));
+        break;
+      case TUYA_CMD_QUERY_STATUS:
+        queueFullReport();
+        break;
+      case TUYA_CMD_NETWORK_STATUS:
+        // Not acknowledged: the bridge takes any NETWORK_STATUS from the MCU as a
+        // query and would answer it, and the two would bounce frames forever
+        break;
+      case TUYA_CMD_SEND_COMMAND:
+        applyCommand(data, dataLen);
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Called by TuyaProtocol's owner when a tracked command completes
+  void onCommandComplete(uint8_t handle, TuyaCommandStatus status) {
+    if (tracked[handle % SIMULATOR_MAX_TRACKED].handle != handle) {
+      return;
+    }
+    if (status == TuyaCommandStatus::ACKED) {
+      uint32_t latency = micros() - tracked[handle % SIMULATOR_MAX_TRACKED].sentUs;
+      load.acked++;
+      load.latencyTotalUs += latency;
+      if (latency > load.latencyMaxUs) {
+        load.latencyMaxUs = latency;
+      }
+    } else if (status == TuyaCommandStatus::TIMED_OUT) {
+      load.timedOut++;
+    }
+  }
+
+  // Run the simulated MCU and load script; returns ms until it next needs to run
+  unsigned long update() {
+    unsigned long now = millis();
+    deliver(now);
+
+    if (profile.burstIntervalMs > 0 && (long)(now - nextBurst) >= 0) {
+      for (uint32_t i = 0; i < profile.burstSize; i++) {
+        queueFullReport();
+      }
+      nextBurst = now + profile.burstIntervalMs;
+    }
+
+    if (link && profile.loadRate > 0) {
+      while ((long)(now - nextLoadCommand) >= 0) {
+        issueLoadCommand();
+        nextLoadCommand += max(1000 / profile.loadRate, (uint32_t)1);
+      }
+    }
+
+    if (link && (long)(now - nextReport) >= 0) {
+      printLoadStats();
+      nextReport = now + profile.reportIntervalMs;
+    }
+
+    // Earliest of: next response, next load command, next burst, next report
+    unsigned long next = link ? nextReport - now : profile.reportIntervalMs;
+    for (uint8_t i = 0; i < SIMULATOR_OUTBOX_SIZE; i++) {
+      if (outbox[i].used) {
+        long remaining = (long)(outbox[i].due - now);
+        next = min(next, (unsigned long)(remaining > 0 ? remaining : 0));
+      }
+    }
+    if (link && profile.loadRate > 0) {
+      long remaining = (long)(nextLoadCommand - now);
+      next = min(next, (unsigned long)(remaining > 0 ? remaining : 0));
+    }
+    if (profile.burstIntervalMs > 0) {
+      long remaining = (long)(nextBurst - now);
+      next = min(next, (unsigned long)(remaining > 0 ? remaining : 0));
+    }
+    return next;
+  }
+};
+
+#endif // SKYFAN_MCU_SIMULATOR
+
+#endif // TUYA_MCU_SIMULATOR_H
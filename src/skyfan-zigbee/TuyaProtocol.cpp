@@ -18,44 +18,71 @@
 #include "TuyaProtocol.h"
 
 TuyaProtocol::TuyaProtocol(HardwareSerial* serialInterface) 
-  : lastHeartbeat(0), tuyaConnected(false), deviceStatusCallback(nullptr), serial(serialInterface), rxState(TuyaProtocolState::WAIT_HEADER_1), rxIndex(0), expectedLen(0), currentCmd(0) {
+  : lastHeartbeat(0), lastHeartbeatSent(0), heartbeatUnanswered(false), tuyaConnected(false), deviceStatusCallback(nullptr), serial(serialInterface), transmitHook(nullptr), traceHook(nullptr), receiveNotifyCallback(nullptr),
+    rxStalled(false), rxStallStart(0),
+    nextHandle(0), nextPendingSlot(0), commandCallback(nullptr),
+    batchOpen(false), batchUncoalesced(false), batchLen(0), batchFirstDpid(0),
+    txQueues(), txStats(), baudRate(MCU_SERIAL_BAUD_RATE), txBusy(false), txFreeAt(0),
+    syncActive(false), syncStart(0), syncLastReport(0), syncReported(0), syncAfterRestart(false), syncCallback(nullptr),
+    networkStatusSent(false), lastZigbeeState(false), stats() {
+  // Backdate so the first heartbeat goes out on the first update(), whatever the timing profile
+  lastHeartbeatSent = millis() - (TIMER_NO_DEADLINE / 2);
+  productInfo[0] = '\0';
+  for (uint8_t i = 0; i < TUYA_MAX_PENDING_COMMANDS; i++) {
+    pendingCommands[i].status = TuyaCommandStatus::UNKNOWN;
+  }
+  for (uint8_t i = 0; i < TUYA_MAX_COALESCED_DPS; i++) {
+    coalesceSlots[i].active = false;
+    coalesceSlots[i].pending = false;
+  }
+  invalidateState();
 }
 
-void TuyaProtocol::begin(uint32_t baudRate) {
-  serial->begin(baudRate);
+void TuyaProtocol::begin(uint32_t baudRate, int8_t rxPin, int8_t txPin) {
+  this->baudRate = baudRate;
+  // Drain the UART from its event task as soon as bytes arrive rather than waiting for update()
+  serial->onReceive([this]() { receiveFromUart(); });
+  serial->begin(baudRate, SERIAL_8N1, rxPin, txPin);
 }
 
 void TuyaProtocol::update(bool zigbeeConnected) {
   processResponse(zigbeeConnected);
+  updateSync();
+  expirePendingCommands();
+  flushCoalescedWrites();
   
-  // Send heartbeat every 10 seconds
-  static unsigned long lastHeartbeatSent = 0;
-  if (millis() - lastHeartbeatSent > TUYA_HEARTBEAT_INTERVAL_MS) {
+  // Send heartbeat every 10 seconds (every second until the MCU answers)
+  if (millis() - lastHeartbeatSent > heartbeatInterval()) {
+    if (heartbeatUnanswered) {
+      stats.heartbeatMisses++;
+    }
+    heartbeatUnanswered = true;
     sendHeartbeat();
     lastHeartbeatSent = millis();
     // Heartbeat sent to MCU
   }
   
   // Check connection status
-  if (tuyaConnected && (millis() - lastHeartbeat > TUYA_CONNECTION_TIMEOUT_MS)) {
+  if (tuyaConnected && (millis() - lastHeartbeat > timing.connectionTimeoutMs)) {
     tuyaConnected = false;
+    stats.linkDrops++;
     // MCU connection lost
   }
   
   // Send network status updates when Zigbee connection state changes
-  static bool lastZigbeeState = false;
-  static bool firstRun = true;
-  
-  if (firstRun || lastZigbeeState != zigbeeConnected) {
+  if (!networkStatusSent || lastZigbeeState != zigbeeConnected) {
     uint8_t status = zigbeeConnected ? NETWORK_STATUS_CONNECTED : NETWORK_STATUS_DISCONNECTED;
     sendNetworkStatus(status);
     lastZigbeeState = zigbeeConnected;
-    firstRun = false;
+    networkStatusSent = true;
     // Zigbee status change - sent status
   }
+  
+  // Everything queued since the last pass (here or by the send paths) goes out in priority order
+  serviceTransmit();
 }
 
-uint8_t TuyaProtocol::calculateChecksum(uint8_t* data, uint16_t len) {
+uint8_t TuyaProtocol::calculateChecksum(const uint8_t* data, uint16_t len) {
   uint16_t sum = 0;
   for (uint16_t i = 0; i < len; i++) {
     sum += data[i];
@@ -63,7 +90,19 @@ uint8_t TuyaProtocol::calculateChecksum(uint8_t* data, uint16_t len) {
   return (uint8_t)(sum & 0xFF);
 }
 
-void TuyaProtocol::sendCommand(uint8_t cmd, uint8_t* data, uint16_t len) {
+bool TuyaProtocol::sendCommand(uint8_t cmd, uint8_t* data, uint16_t len, TuyaTxClass txClass) {
+  if (TUYA_FRAME_OVERHEAD + len > TUYA_TX_FRAME_SIZE) {
+    txStats[static_cast<uint8_t>(txClass)].dropped++;
+    return false;
+  }
+  if (data && len > 0) {
+    memcpy(&tuyaBuffer[TUYA_FRAME_HEADER_SIZE], data, len);
+  }
+  return sendFrame(cmd, len, txClass);
+}
+
+// Wrap the payload already placed after the header in tuyaBuffer and queue it
+bool TuyaProtocol::sendFrame(uint8_t cmd, uint16_t len, TuyaTxClass txClass) {
   uint8_t* packet = tuyaBuffer;
   uint16_t idx = 0;
   
@@ -73,271 +112,1101 @@ void TuyaProtocol::sendCommand(uint8_t cmd, uint8_t* data, uint16_t len) {
   packet[idx++] = cmd;
   packet[idx++] = (len >> 8) & 0xFF;
   packet[idx++] = len & 0xFF;
-  
-  if (data && len > 0) {
-    memcpy(&packet[idx], data, len);
-    idx += len;
-  }
+  idx += len;
   
   uint8_t checksum = calculateChecksum(&packet[2], idx - 2);
   packet[idx++] = checksum;
   
-  serial->write(packet, idx);
-  serial->flush();
+  return enqueueFrame(txClass, packet, idx);
+}
+
+bool TuyaProtocol::hasTxRoom(TuyaTxClass txClass) const {
+  return txQueues[static_cast<uint8_t>(txClass)].count < TUYA_TX_QUEUE_DEPTH;
+}
+
+// Housekeeping frames only ever need their latest copy, so a repeat of a queued
+// command replaces it in place (keeping its age). DP writes are all tracked and queue up.
+bool TuyaProtocol::enqueueFrame(TuyaTxClass txClass, const uint8_t* frame, uint16_t len) {
+  uint8_t cls = static_cast<uint8_t>(txClass);
+  TuyaTxQueue& queue = txQueues[cls];
+  TuyaTxClassStats& classStats = txStats[cls];
+  TuyaTxFrame* entry = nullptr;
+  
+  if (txClass != TuyaTxClass::USER) {
+    for (uint8_t i = 0; i < queue.count; i++) {
+      TuyaTxFrame& queued = queue.frames[(queue.head + i) % TUYA_TX_QUEUE_DEPTH];
+      if (queued.cmd == frame[3]) {
+        entry = &queued;
+        classStats.replaced++;
+        break;
+      }
+    }
+  }
+  
+  if (!entry) {
+    if (queue.count >= TUYA_TX_QUEUE_DEPTH) {
+      classStats.dropped++;
+      return false;
+    }
+    entry = &queue.frames[(queue.head + queue.count) % TUYA_TX_QUEUE_DEPTH];
+    entry->queuedAt = micros();
+    queue.count++;
+    classStats.depth = queue.count;
+    if (queue.count > classStats.maxDepth) {
+      classStats.maxDepth = queue.count;
+    }
+  }
+  
+  entry->cmd = frame[3];
+  entry->len = len;
+  memcpy(entry->data, frame, len);
+  return true;
 }
 
-void TuyaProtocol::sendDataPoint(uint8_t dpid, uint8_t type, uint32_t value) {
-  uint8_t data[8];
+// Highest class with a frame waiting, unless a lower class has waited past
+// TUYA_TX_MAX_WAIT_MS - then the longest-waiting frame goes first
+int8_t TuyaProtocol::nextTxClass(unsigned long now) {
+  int8_t highest = -1;
+  int8_t overdue = -1;
+  unsigned long longestWait = 0;
+  
+  for (uint8_t cls = 0; cls < TUYA_TX_CLASS_COUNT; cls++) {
+    const TuyaTxQueue& queue = txQueues[cls];
+    if (queue.count == 0) {
+      continue;
+    }
+    if (highest < 0) {
+      highest = cls;
+    }
+    unsigned long waited = now - queue.frames[queue.head].queuedAt;
+    if (waited >= TUYA_TX_MAX_WAIT_MS * 1000UL && waited > longestWait) {
+      overdue = cls;
+      longestWait = waited;
+    }
+  }
+  
+  if (overdue >= 0 && overdue != highest) {
+    txStats[overdue].promoted++;
+    return overdue;
+  }
+  return highest;
+}
+
+// Put queued frames on the wire, each once the previous one has gone out, so a DP
+// write never waits behind housekeeping already sitting in the UART. Frames handed
+// to a transmit hook take no wire time.
+void TuyaProtocol::serviceTransmit() {
+  while (true) {
+    unsigned long now = micros();
+    if (txBusy && (long)(now - txFreeAt) < 0) {
+      return;
+    }
+    txBusy = false;
+    
+    int8_t cls = nextTxClass(now);
+    if (cls < 0) {
+      return;
+    }
+    TuyaTxQueue& queue = txQueues[cls];
+    TuyaTxFrame& frame = queue.frames[queue.head];
+    queue.head = (queue.head + 1) % TUYA_TX_QUEUE_DEPTH;
+    queue.count--;
+    
+    TuyaTxClassStats& classStats = txStats[cls];
+    unsigned long waited = now - frame.queuedAt;
+    classStats.frames++;
+    classStats.depth = queue.count;
+    classStats.totalWaitUs += waited;
+    if (waited > classStats.maxWaitUs) {
+      classStats.maxWaitUs = waited;
+    }
+    
+    stats.framesSent++;
+    stats.bytesSent += frame.len;
+    if (traceHook) {
+      traceHook(true, frame.data, frame.len);
+    }
+    
+    if (transmitHook) {
+      transmitHook(frame.data, frame.len);
+    } else {
+      // The FIFO is empty, so this never blocks; 10 bits per byte on the wire
+      serial->write(frame.data, frame.len);
+      txBusy = true;
+      txFreeAt = now + (uint32_t)frame.len * 10UL * 1000000UL / baudRate;
+    }
+  }
+}
+
+// Encode a single DP record (DPID, type, length, value) and return its size
+uint16_t TuyaProtocol::encodeDataPoint(uint8_t* out, uint8_t dpid, uint8_t type, uint32_t value) {
   uint16_t dataLen = 0;
   
-  data[dataLen++] = dpid;
-  data[dataLen++] = type;
+  out[dataLen++] = dpid;
+  out[dataLen++] = type;
   
   if (type == DP_TYPE_BOOL) {
-    data[dataLen++] = 0x00;
-    data[dataLen++] = 0x01;
-    data[dataLen++] = value ? 0x01 : 0x00;
+    out[dataLen++] = 0x00;
+    out[dataLen++] = 0x01;
+    out[dataLen++] = value ? 0x01 : 0x00;
   } else if (type == DP_TYPE_VALUE || type == DP_TYPE_ENUM) {
-    data[dataLen++] = 0x00;
-    data[dataLen++] = 0x04;
-    data[dataLen++] = (value >> 24) & 0xFF;
-    data[dataLen++] = (value >> 16) & 0xFF;
-    data[dataLen++] = (value >> 8) & 0xFF;
-    data[dataLen++] = value & 0xFF;
+    out[dataLen++] = 0x00;
+    out[dataLen++] = 0x04;
+    out[dataLen++] = (value >> 24) & 0xFF;
+    out[dataLen++] = (value >> 16) & 0xFF;
+    out[dataLen++] = (value >> 8) & 0xFF;
+    out[dataLen++] = value & 0xFF;
+  }
+  
+  return dataLen;
+}
+
+uint8_t TuyaProtocol::sendDataPoint(uint8_t dpid, uint8_t type, uint32_t value) {
+  uint8_t data[TUYA_DP_MAX_ENCODED_SIZE];
+  uint16_t dataLen = encodeDataPoint(data, dpid, type, value);
+  
+  if (!hasTxRoom(TuyaTxClass::USER)) {
+    txStats[static_cast<uint8_t>(TuyaTxClass::USER)].dropped++;
+    return TUYA_INVALID_HANDLE;
+  }
+  uint8_t handle = trackCommand(TUYA_CMD_SEND_COMMAND, dpid, data, dataLen);
+  if (handle == TUYA_INVALID_HANDLE) {
+    // Outstanding-request table full
+    return TUYA_INVALID_HANDLE;
   }
   
   sendCommand(TUYA_CMD_SEND_COMMAND, data, dataLen);
-  waitForResponse(TUYA_CMD_SEND_COMMAND, TUYA_COMMAND_TIMEOUT_MS);
+  return handle;
 }
 
-// Fan control functions
-bool TuyaProtocol::setFanSwitch(bool on) {
-  sendDataPoint(DP_FAN_SWITCH, DP_TYPE_BOOL, on ? 1 : 0);
-  return true;
+// Batching - DP records are packed straight into tuyaBuffer after the frame header
+void TuyaProtocol::beginBatch(bool uncoalesced) {
+  batchOpen = true;
+  batchUncoalesced = uncoalesced;
+  batchLen = 0;
+  batchFirstDpid = 0;
 }
 
-bool TuyaProtocol::setFanSpeed(uint8_t speed) {
-  // Validate fan speed range
-  if (!isValidTuyaFanSpeed(speed)) {
-    // Invalid fan speed
+// Outside a batch the DP is sent immediately as its own frame. Writes arriving
+// within the coalescing window of the previous one are parked and flushed by update().
+bool TuyaProtocol::addDataPoint(uint8_t dpid, uint8_t type, uint32_t value) {
+  bool uncoalesced = batchOpen && batchUncoalesced;
+  
+  // Drop writes that would not change the MCU's known state. A parked write is in the
+  // shadow already, but an uncoalesced batch still has to carry it to the MCU.
+  int8_t slot = tuyaDataPointSlot(dpid);
+  if (slot >= 0) {
+    if (shadow[slot].known && shadow[slot].value == value && !(uncoalesced && isWriteParked(dpid))) {
+      stats.suppressedWrites++;
+      return true;
+    }
+  }
+  
+  if (!uncoalesced && !admitWrite(dpid, type, value)) {
+    // Parked; flushCoalescedWrites() only releases it once it can be queued
+    noteCommanded(dpid, value);
+    return true;
+  }
+  if (!appendDataPoint(dpid, type, value)) {
     return false;
   }
-  sendDataPoint(DP_FAN_SPEED, DP_TYPE_VALUE, speed);
+  if (!batchOpen) {
+    noteCommanded(dpid, value);
+  }
   return true;
 }
 
-bool TuyaProtocol::setFanMode(uint8_t mode) {
-  // Validate fan mode
-  if (mode > static_cast<uint8_t>(TuyaFanMode::SLEEP)) {
-    // Invalid fan mode
-    return false;
+// The shadow takes a written value only once the write is tracked and queued,
+// so a write that never left can't suppress the same write later
+void TuyaProtocol::noteCommanded(uint8_t dpid, uint32_t value) {
+  int8_t slot = tuyaDataPointSlot(dpid);
+  if (slot >= 0) {
+    shadow[slot].known = true;
+    shadow[slot].value = value;
+    shadow[slot].commanded = true;
+    shadow[slot].commandedAt = millis();
   }
-  sendDataPoint(DP_FAN_MODE, DP_TYPE_ENUM, mode);
-  return true;
 }
 
-bool TuyaProtocol::setFanDirection(uint8_t direction) {
-  // Validate fan direction
-  if (direction > static_cast<uint8_t>(FanDirection::REVERSE)) {
-    // Invalid fan direction
+bool TuyaProtocol::appendDataPoint(uint8_t dpid, uint8_t type, uint32_t value) {
+  if (!batchOpen) {
+    return sendDataPoint(dpid, type, value) != TUYA_INVALID_HANDLE;
+  }
+  
+  if (TUYA_FRAME_OVERHEAD + batchLen + TUYA_DP_MAX_ENCODED_SIZE > TUYA_TX_FRAME_SIZE) {
+    // No room left in the frame
     return false;
   }
-  sendDataPoint(DP_FAN_DIRECTION, DP_TYPE_ENUM, direction);
+  
+  if (batchLen == 0) {
+    batchFirstDpid = dpid;
+  }
+  batchLen += encodeDataPoint(&tuyaBuffer[TUYA_FRAME_HEADER_SIZE + batchLen], dpid, type, value);
   return true;
 }
 
+uint8_t TuyaProtocol::commitBatch() {
+  bool uncoalesced = batchUncoalesced;
+  batchOpen = false;
+  batchUncoalesced = false;
+  if (batchLen == 0) {
+    return TUYA_INVALID_HANDLE;
+  }
+  
+  if (!hasTxRoom(TuyaTxClass::USER)) {
+    txStats[static_cast<uint8_t>(TuyaTxClass::USER)].dropped++;
+    batchLen = 0;
+    return TUYA_INVALID_HANDLE;
+  }
+  
+  // The first DP's report (or a 0x06 echo) acknowledges the whole frame
+  uint8_t handle = trackCommand(TUYA_CMD_SEND_COMMAND, batchFirstDpid, &tuyaBuffer[TUYA_FRAME_HEADER_SIZE], batchLen);
+  if (handle != TUYA_INVALID_HANDLE) {
+    // Every DP in the frame is on its way now
+    const uint8_t* payload = &tuyaBuffer[TUYA_FRAME_HEADER_SIZE];
+    uint16_t index = 0;
+    while (index + 4 <= batchLen) {
+      uint16_t dpLen = (payload[index + 2] << 8) | payload[index + 3];
+      uint32_t value = 0;
+      for (uint16_t i = 0; i < dpLen && i < 4; i++) {
+        value = (value << 8) | payload[index + 4 + i];
+      }
+      noteCommanded(payload[index], value);
+      if (uncoalesced) {
+        dropParkedWrite(payload[index]);  // Superseded by this frame
+      }
+      index += 4 + dpLen;
+    }
+    sendFrame(TUYA_CMD_SEND_COMMAND, batchLen, TuyaTxClass::USER);
+  }
+  batchLen = 0;
+  return handle;
+}
+
+// Write coalescing - the first write to a DP goes straight out, later ones inside
+// the window only replace the parked value
+bool TuyaProtocol::admitWrite(uint8_t dpid, uint8_t type, uint32_t value) {
+  TuyaCoalesceSlot* slot = nullptr;
+  TuyaCoalesceSlot* freeSlot = nullptr;
+  
+  for (uint8_t i = 0; i < TUYA_MAX_COALESCED_DPS; i++) {
+    if (coalesceSlots[i].active && coalesceSlots[i].dpid == dpid) {
+      slot = &coalesceSlots[i];
+      break;
+    }
+    if (!coalesceSlots[i].active && !freeSlot) {
+      freeSlot = &coalesceSlots[i];
+    }
+  }
+  
+  unsigned long now = millis();
+  
+  if (!slot) {
+    if (freeSlot) {
+      freeSlot->active = true;
+      freeSlot->pending = false;
+      freeSlot->dpid = dpid;
+      freeSlot->lastSent = now;
+    }
+    // Untracked or first write - no added latency
+    return true;
+  }
+  
+  if (!slot->pending && now - slot->lastSent >= timing.coalesceWindowMs) {
+    slot->lastSent = now;
+    return true;
+  }
+  
+  if (slot->pending) {
+    stats.supersededWrites++;
+  }
+  slot->pending = true;
+  slot->type = type;
+  slot->value = value;
+  return false;
+}
+
+bool TuyaProtocol::isWriteParked(uint8_t dpid) const {
+  for (uint8_t i = 0; i < TUYA_MAX_COALESCED_DPS; i++) {
+    if (coalesceSlots[i].pending && coalesceSlots[i].dpid == dpid) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Forget the parked write for a DP, which a frame has just overtaken. The window
+// restarts from that frame.
+void TuyaProtocol::dropParkedWrite(uint8_t dpid) {
+  for (uint8_t i = 0; i < TUYA_MAX_COALESCED_DPS; i++) {
+    if (coalesceSlots[i].active && coalesceSlots[i].dpid == dpid) {
+      coalesceSlots[i].pending = false;
+      coalesceSlots[i].lastSent = millis();
+      return;
+    }
+  }
+}
+
+// Send every parked write whose window has elapsed, together in one frame. Runs from
+// update(), on the same task as every other batch writer, so it never finds a batch
+// half built; should one be open anyway, it is left alone and the writes stay parked.
+void TuyaProtocol::flushCoalescedWrites() {
+  if (batchOpen) {
+    return;
+  }
+  if (pendingCommandCount() >= TUYA_MAX_PENDING_COMMANDS || !hasTxRoom(TuyaTxClass::USER)) {
+    // Nothing can be tracked or queued right now - keep the values parked
+    return;
+  }
+  
+  unsigned long now = millis();
+  beginBatch();
+  
+  for (uint8_t i = 0; i < TUYA_MAX_COALESCED_DPS; i++) {
+    TuyaCoalesceSlot& slot = coalesceSlots[i];
+    if (slot.pending && now - slot.lastSent >= timing.coalesceWindowMs) {
+      if (!appendDataPoint(slot.dpid, slot.type, slot.value)) {
+        break;
+      }
+      slot.pending = false;
+      slot.lastSent = now;
+    }
+  }
+  
+  commitBatch();
+}
+
+// Command pipeline - record a sent command so its ACK can be matched later
+uint8_t TuyaProtocol::trackCommand(uint8_t cmd, uint8_t dpid, const uint8_t* payload, uint16_t len) {
+  for (uint8_t i = 0; i < TUYA_MAX_PENDING_COMMANDS; i++) {
+    uint8_t slot = (nextPendingSlot + i) % TUYA_MAX_PENDING_COMMANDS;
+    TuyaPendingCommand& entry = pendingCommands[slot];
+    
+    if (entry.status != TuyaCommandStatus::PENDING) {
+      entry.handle = nextHandle;
+      entry.cmd = cmd;
+      entry.dpid = dpid;
+      entry.status = TuyaCommandStatus::PENDING;
+      entry.sentAt = millis();
+      entry.deadline = entry.sentAt + timing.commandTimeoutMs;
+      entry.attempts = 1;
+      entry.retryScheduled = false;
+      entry.payloadLen = len;
+      memcpy(entry.payload, payload, len);
+      
+      nextPendingSlot = (slot + 1) % TUYA_MAX_PENDING_COMMANDS;
+      nextHandle = (nextHandle + 1) % TUYA_INVALID_HANDLE;  // Never hand out TUYA_INVALID_HANDLE
+      return entry.handle;
+    }
+  }
+  return TUYA_INVALID_HANDLE;
+}
+
+// Match an incoming frame against the oldest pending command it acknowledges.
+// The MCU confirms SEND_COMMAND either by echoing 0x06 or by reporting the DP (0x07).
+void TuyaProtocol::acknowledgeCommand(uint8_t cmd, uint8_t dpid) {
+  TuyaPendingCommand* oldest = nullptr;
+  unsigned long now = millis();
+  
+  for (uint8_t i = 0; i < TUYA_MAX_PENDING_COMMANDS; i++) {
+    TuyaPendingCommand& entry = pendingCommands[i];
+    if (entry.status != TuyaCommandStatus::PENDING) {
+      continue;
+    }
+    
+    bool matches = (cmd == entry.cmd) ||
+                   (cmd == TUYA_CMD_STATUS_REPORT && entry.cmd == TUYA_CMD_SEND_COMMAND && dpid == entry.dpid);
+    if (matches && (!oldest || (now - entry.sentAt) > (now - oldest->sentAt))) {
+      oldest = &entry;
+    }
+  }
+  
+  if (oldest) {
+    completeCommand(*oldest, TuyaCommandStatus::ACKED);
+  }
+}
+
+// An ACK timeout schedules a resend after an exponentially growing backoff; the
+// command is given up on when neither the attempts nor the overall deadline allow another
+void TuyaProtocol::expirePendingCommands() {
+  unsigned long now = millis();
+  
+  for (uint8_t i = 0; i < TUYA_MAX_PENDING_COMMANDS; i++) {
+    TuyaPendingCommand& entry = pendingCommands[i];
+    if (entry.status != TuyaCommandStatus::PENDING || (long)(now - entry.deadline) < 0) {
+      continue;
+    }
+    
+    if (entry.retryScheduled) {
+      retryCommand(entry, now);
+      continue;
+    }
+    
+    unsigned long backoff = timing.retryBackoffMs << (entry.attempts - 1);
+    if (entry.attempts < timing.commandAttempts && now + backoff - entry.sentAt < timing.commandDeadlineMs) {
+      entry.retryScheduled = true;
+      entry.deadline = now + backoff;
+    } else {
+      revertCommand(entry);
+      completeCommand(entry, TuyaCommandStatus::TIMED_OUT);
+    }
+  }
+}
+
+// Each DP record is DPID + Type + Length(2) + value
+static bool payloadHasDataPoint(const uint8_t* payload, uint16_t len, uint8_t dpid) {
+  uint16_t index = 0;
+  while (index + 4 <= len) {
+    if (payload[index] == dpid) {
+      return true;
+    }
+    index += 4 + ((payload[index + 2] << 8) | payload[index + 3]);
+  }
+  return false;
+}
+
+// A later write to the DP (queued or parked) owns its value now
+bool TuyaProtocol::isWriteSuperseded(const TuyaPendingCommand& entry, uint8_t dpid) const {
+  if (isWriteParked(dpid)) {
+    return true;
+  }
+  for (uint8_t i = 0; i < TUYA_MAX_PENDING_COMMANDS; i++) {
+    const TuyaPendingCommand& other = pendingCommands[i];
+    if (&other != &entry && other.status == TuyaCommandStatus::PENDING &&
+        (long)(other.sentAt - entry.sentAt) >= 0 &&
+        payloadHasDataPoint(other.payload, other.payloadLen, dpid)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Resend the DP records of a pending command that no later write has superseded.
+// While a batch is being assembled in tuyaBuffer or the user queue is full the
+// retry waits another backoff step, until the overall deadline gives up on it.
+void TuyaProtocol::retryCommand(TuyaPendingCommand& entry, unsigned long now) {
+  if (batchOpen || !hasTxRoom(TuyaTxClass::USER)) {
+    if (now + timing.retryBackoffMs - entry.sentAt < timing.commandDeadlineMs) {
+      entry.deadline = now + timing.retryBackoffMs;
+    } else {
+      revertCommand(entry);
+      completeCommand(entry, TuyaCommandStatus::TIMED_OUT);
+    }
+    return;
+  }
+  
+  // Drop superseded records so a resend never undoes a newer value
+  uint16_t kept = 0;
+  uint16_t index = 0;
+  while (index + 4 <= entry.payloadLen) {
+    uint16_t recordLen = 4 + ((entry.payload[index + 2] << 8) | entry.payload[index + 3]);
+    uint8_t dpid = entry.payload[index];
+    if (!isWriteSuperseded(entry, dpid)) {
+      memmove(&entry.payload[kept], &entry.payload[index], recordLen);
+      kept += recordLen;
+      
+      // Keep the eventual report inside the echo window
+      int8_t slot = tuyaDataPointSlot(dpid);
+      if (slot >= 0 && shadow[slot].commanded) {
+        shadow[slot].commandedAt = now;
+      }
+    }
+    index += recordLen;
+  }
+  entry.payloadLen = kept;
+  entry.retryScheduled = false;
+  
+  if (kept == 0) {
+    // Nothing of ours left to deliver; the newer writes report their own outcome
+    completeCommand(entry, TuyaCommandStatus::SUPERSEDED);
+    return;
+  }
+  
+  // A report of the first remaining DP acknowledges the resent frame
+  entry.dpid = entry.payload[0];
+  memcpy(&tuyaBuffer[TUYA_FRAME_HEADER_SIZE], entry.payload, entry.payloadLen);
+  sendFrame(entry.cmd, entry.payloadLen, TuyaTxClass::USER);
+  entry.attempts++;
+  stats.commandRetries++;
+  
+  // The last attempt is cut short by the overall deadline
+  unsigned long deadline = now + timing.commandTimeoutMs;
+  unsigned long cutoff = entry.sentAt + timing.commandDeadlineMs;
+  entry.deadline = ((long)(cutoff - deadline) < 0) ? cutoff : deadline;
+}
+
+// Undo the optimistic shadow update of a write the MCU never confirmed, and hand the
+// last reported value back to the sketch so the Zigbee attribute follows
+void TuyaProtocol::revertCommand(const TuyaPendingCommand& entry) {
+  uint16_t index = 0;
+  
+  while (index + 4 <= entry.payloadLen) {
+    uint8_t dpid = entry.payload[index];
+    index += 4 + ((entry.payload[index + 2] << 8) | entry.payload[index + 3]);
+    
+    // A newer write to the same DP still has its own chance to land
+    int8_t slot = tuyaDataPointSlot(dpid);
+    if (slot < 0 || !shadow[slot].commanded || isWriteSuperseded(entry, dpid)) {
+      continue;
+    }
+    
+    TuyaShadowEntry& shadowEntry = shadow[slot];
+    shadowEntry.commanded = false;
+    shadowEntry.known = shadowEntry.confirmed;
+    shadowEntry.value = shadowEntry.confirmedValue;
+    stats.writesReverted++;
+    
+    if (shadowEntry.confirmed && deviceStatusCallback) {
+      deviceStatusCallback(dpid, shadowEntry.confirmedValue);
+    }
+  }
+}
+
+void TuyaProtocol::completeCommand(TuyaPendingCommand& entry, TuyaCommandStatus status) {
+  entry.status = status;
+  if (status == TuyaCommandStatus::ACKED) {
+    stats.commandsAcked++;
+    ackLatency.record(millis() - entry.sentAt);
+  } else if (status == TuyaCommandStatus::TIMED_OUT) {
+    stats.commandsTimedOut++;
+  }
+  if (commandCallback) {
+    commandCallback(entry.handle, entry.dpid, status);
+  }
+}
+
+// Fan control functions - ranges and types come from the DP registry
+bool TuyaProtocol::setFanSwitch(bool on) {
+  return setDataPoint<DP_FAN_SWITCH>(on ? 1 : 0);
+}
+
+bool TuyaProtocol::setFanSpeed(uint8_t speed) {
+  return setDataPoint<DP_FAN_SPEED>(speed);
+}
+
+bool TuyaProtocol::setFanMode(uint8_t mode) {
+  return setDataPoint<DP_FAN_MODE>(mode);
+}
+
+bool TuyaProtocol::setFanDirection(uint8_t direction) {
+  return setDataPoint<DP_FAN_DIRECTION>(direction);
+}
+
 // Light control functions
 bool TuyaProtocol::setLightSwitch(bool on) {
-  sendDataPoint(DP_LIGHT_SWITCH, DP_TYPE_BOOL, on ? 1 : 0);
-  return true;
+  return setDataPoint<DP_LIGHT_SWITCH>(on ? 1 : 0);
 }
 
 bool TuyaProtocol::setLightBrightness(uint8_t brightness) {
-  // Validate brightness range
-  if (!isValidTuyaBrightness(brightness)) {
-    // Invalid brightness
-    return false;
-  }
-  sendDataPoint(DP_LIGHT_DIMMER, DP_TYPE_VALUE, brightness);
-  return true;
+  return setDataPoint<DP_LIGHT_DIMMER>(brightness);
 }
 
 bool TuyaProtocol::setLightColourTemp(uint8_t colourTemp) {
-  // Validate colour temperature
-  if (colourTemp > static_cast<uint8_t>(ColourTempLevel::COOL)) {
-    // Invalid colour temperature
-    return false;
-  }
-  sendDataPoint(DP_LIGHT_COLOUR_TEMP, DP_TYPE_ENUM, colourTemp);
-  return true;
+  return setDataPoint<DP_LIGHT_COLOUR_TEMP>(colourTemp);
 }
 
 void TuyaProtocol::sendHeartbeat() {
-  sendCommand(TUYA_CMD_HEARTBEAT, nullptr, 0);
+  sendCommand(TUYA_CMD_HEARTBEAT, nullptr, 0, TuyaTxClass::HEARTBEAT);
 }
 
 void TuyaProtocol::sendNetworkStatus(uint8_t status) {
-  sendCommand(TUYA_CMD_NETWORK_STATUS, &status, 1);
+  sendCommand(TUYA_CMD_NETWORK_STATUS, &status, 1, TuyaTxClass::REPLY);
 }
 
 void TuyaProtocol::setDeviceStatusCallback(void (*callback)(uint8_t dpid, uint32_t value)) {
   deviceStatusCallback = callback;
 }
 
+void TuyaProtocol::setTransmitHook(void (*hook)(const uint8_t* frame, uint16_t len)) {
+  transmitHook = hook;
+}
+
+void TuyaProtocol::setTraceHook(void (*hook)(bool sent, const uint8_t* data, uint16_t len)) {
+  traceHook = hook;
+}
+
+void TuyaProtocol::setReceiveNotifyCallback(void (*callback)()) {
+  receiveNotifyCallback = callback;
+}
+
+void TuyaProtocol::setCommandCallback(TuyaCommandCallback callback) {
+  commandCallback = callback;
+}
+
+TuyaCommandStatus TuyaProtocol::getCommandStatus(uint8_t handle) const {
+  for (uint8_t i = 0; i < TUYA_MAX_PENDING_COMMANDS; i++) {
+    if (pendingCommands[i].status != TuyaCommandStatus::UNKNOWN && pendingCommands[i].handle == handle) {
+      return pendingCommands[i].status;
+    }
+  }
+  return TuyaCommandStatus::UNKNOWN;
+}
+
+// Shadow state - last value reported by or written to the MCU, per registered DP
+bool TuyaProtocol::getDataPointState(uint8_t dpid, uint32_t* value) const {
+  int8_t slot = tuyaDataPointSlot(dpid);
+  if (slot < 0 || !shadow[slot].known) {
+    return false;
+  }
+  *value = shadow[slot].value;
+  return true;
+}
+
+void TuyaProtocol::invalidateState() {
+  for (uint8_t i = 0; i < TUYA_DATA_POINT_COUNT; i++) {
+    shadow[i].known = false;
+    shadow[i].value = 0;
+    shadow[i].commanded = false;
+    shadow[i].confirmed = false;
+  }
+}
+
+void TuyaProtocol::setSyncCallback(void (*callback)(bool mcuRestarted)) {
+  syncCallback = callback;
+}
+
+bool TuyaProtocol::isSyncing() const {
+  return syncActive;
+}
+
+const char* TuyaProtocol::getProductInfo() const {
+  return productInfo;
+}
+
+void TuyaProtocol::setCoalesceWindow(unsigned long windowMs) {
+  timing.coalesceWindowMs = windowMs;
+}
+
+// Takes effect immediately; commands already in flight keep their original deadline
+void TuyaProtocol::setTimingProfile(const TuyaTimingProfile& profile) {
+  timing = profile;
+}
+
+const TuyaTimingProfile& TuyaProtocol::getTimingProfile() const {
+  return timing;
+}
 
-bool TuyaProtocol::waitForResponse(uint8_t expectedCmd, unsigned long timeout) {
-  unsigned long startTime = millis();
+const TuyaProtocolStats& TuyaProtocol::getStats() const {
+  return stats;
+}
+
+const LatencyHistogram& TuyaProtocol::getAckLatency() const {
+  return ackLatency;
+}
+
+const TuyaTxClassStats& TuyaProtocol::getTxStats(TuyaTxClass txClass) const {
+  return txStats[static_cast<uint8_t>(txClass)];
+}
+
+uint8_t TuyaProtocol::pendingCommandCount() const {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < TUYA_MAX_PENDING_COMMANDS; i++) {
+    if (pendingCommands[i].status == TuyaCommandStatus::PENDING) {
+      count++;
+    }
+  }
+  return count;
+}
+
+
+// UART event task - move everything the driver holds straight into the ring buffer
+void TuyaProtocol::receiveFromUart() {
+  while (serial->available() > 0) {
+    uint8_t* region;
+    uint16_t space = rxRing.writableSpan(&region);
+    if (space == 0) {
+      // Decoder has fallen behind - drop what we cannot hold
+      while (serial->available() > 0) {
+        serial->read();
+        stats.rxOverflowBytes++;
+      }
+      break;
+    }
+    
+    size_t received = serial->read(region, space);
+    if (received == 0) {
+      break;
+    }
+    if (traceHook) {
+      traceHook(false, region, received);
+    }
+    rxRing.commitWrite(received);
+  }
   
-  while (millis() - startTime < timeout) {
-    if (serial->available() >= 6) {
-      if (serial->read() == 0x55 && serial->read() == 0xAA) {
-        uint8_t version = serial->read();
-        uint8_t cmd = serial->read();
-        uint16_t len = (serial->read() << 8) | serial->read();
-        
-        if (cmd == expectedCmd || expectedCmd == 0xFF) {
-          for (uint16_t i = 0; i < len + 1; i++) {
-            if (serial->available()) {
-              serial->read();
-            }
-          }
-          return true;
-        } else {
-          for (uint16_t i = 0; i < len + 1; i++) {
-            if (serial->available()) {
-              serial->read();
-            }
-          }
-        }
+  if (receiveNotifyCallback) {
+    receiveNotifyCallback();
+  }
+}
+
+// Feed bytes into the receive path as if they had arrived on the UART. Must not
+// run concurrently with UART reception; returns how many bytes were accepted.
+uint16_t TuyaProtocol::injectReceived(const uint8_t* data, uint16_t len) {
+  uint16_t accepted = 0;
+  
+  while (accepted < len) {
+    uint8_t* region;
+    uint16_t space = rxRing.writableSpan(&region);
+    if (space == 0) {
+      break;
+    }
+    
+    uint16_t chunk = (len - accepted < space) ? len - accepted : space;
+    memcpy(region, &data[accepted], chunk);
+    if (traceHook) {
+      traceHook(false, region, chunk);
+    }
+    rxRing.commitWrite(chunk);
+    accepted += chunk;
+  }
+  
+  stats.rxOverflowBytes += len - accepted;
+  if (receiveNotifyCallback) {
+    receiveNotifyCallback();
+  }
+  return accepted;
+}
+
+// Decode complete frames in place from the ring buffer
+void TuyaProtocol::processResponse(bool zigbeeConnected) {
+  while (rxRing.available() > 0) {
+    // Header must be 0x55AA - anything else means we are out of step
+    if (rxRing.peek(0) != 0x55) {
+      resynchronise();
+      continue;
+    }
+    if (rxRing.available() < 2) {
+      break;
+    }
+    if (rxRing.peek(1) != 0xAA) {
+      resynchronise();
+      continue;
+    }
+    
+    if (rxRing.available() < TUYA_FRAME_OVERHEAD) {
+      if (frameStalled()) {
+        continue;
       }
+      break;
     }
-    delay(10);
+    
+    uint8_t cmd = rxRing.peek(3);
+    uint16_t len = (rxRing.peek(4) << 8) | rxRing.peek(5);
+    
+    // Bound the length before waiting for data - a frame that can never fit is a corrupt header
+    if (len > TuyaRingBuffer::capacity() - TUYA_FRAME_OVERHEAD) {
+      stats.oversizeFrames++;
+      resynchronise();
+      continue;
+    }
+    
+    if (rxRing.available() < TUYA_FRAME_OVERHEAD + len) {
+      // Rest of the frame still in flight (or the length field was corrupt)
+      if (frameStalled()) {
+        continue;
+      }
+      break;
+    }
+    
+    if (!isFrameChecksumValid(len)) {
+      stats.badChecksums++;
+      resynchronise();
+      continue;
+    }
+    
+    if (cmd == TUYA_CMD_STATUS_REPORT) {
+      processStatusReport(len);
+    } else if (cmd == TUYA_CMD_SEND_COMMAND) {
+      acknowledgeCommand(TUYA_CMD_SEND_COMMAND, 0);
+    } else if (cmd == TUYA_CMD_HEARTBEAT) {
+      // The first reply after MCU power-up carries 0x00, later ones 0x01
+      bool restarted = len >= 1 && rxRing.peek(TUYA_FRAME_HEADER_SIZE) == 0x00;
+      bool linkUp = !tuyaConnected;
+      tuyaConnected = true;
+      heartbeatUnanswered = false;
+      lastHeartbeat = millis();
+      if (restarted) {
+        stats.mcuRestarts++;
+      }
+      if (linkUp || restarted) {
+        startSync(restarted);
+      }
+    } else if (cmd == TUYA_CMD_PRODUCT_INFO) {
+      processProductInfo(len);
+    } else if (cmd == TUYA_CMD_NETWORK_STATUS) {
+      // MCU is requesting network status - respond with current Zigbee connection status
+      uint8_t status = zigbeeConnected ? NETWORK_STATUS_CONNECTED : NETWORK_STATUS_DISCONNECTED;
+      sendNetworkStatus(status);
+    }
+    
+    stats.framesReceived++;
+    stats.bytesReceived += TUYA_FRAME_OVERHEAD + len;
+    rxRing.consume(TUYA_FRAME_OVERHEAD + len);
+    rxStalled = false;
+  }
+}
+
+// Drop the bad byte at the head of the ring and skip straight to the next
+// possible 0x55AA header, so recovery never costs more than the corrupt frame
+void TuyaProtocol::resynchronise() {
+  uint16_t available = rxRing.available();
+  uint16_t skip = 1;
+  
+  while (skip < available) {
+    if (rxRing.peek(skip) == 0x55 && (skip + 1 >= available || rxRing.peek(skip + 1) == 0xAA)) {
+      break;
+    }
+    skip++;
+  }
+  
+  rxRing.consume(skip);
+  rxStalled = false;
+  stats.resyncs++;
+  stats.bytesDiscarded += skip;
+}
+
+// Track an incomplete frame at the head of the ring. Returns true (after resyncing)
+// when it has waited longer than any real frame takes to arrive.
+bool TuyaProtocol::frameStalled() {
+  unsigned long now = millis();
+  
+  if (!rxStalled) {
+    rxStalled = true;
+    rxStallStart = now;
+    return false;
+  }
+  
+  if (now - rxStallStart >= timing.frameTimeoutMs) {
+    stats.frameTimeouts++;
+    resynchronise();
+    return true;
   }
   return false;
 }
 
-void TuyaProtocol::processResponse(bool zigbeeConnected) {
-  while (serial->available()) {
-    uint8_t byte = serial->read();
+// Checksum covers version, command, length and data. The frame may wrap around
+// the ring, so each contiguous span is summed separately.
+bool TuyaProtocol::isFrameChecksumValid(uint16_t len) const {
+  uint16_t offset = 2;
+  uint16_t remaining = 4 + len;
+  uint8_t sum = 0;
+  
+  while (remaining > 0) {
+    const uint8_t* region;
+    uint16_t span = rxRing.readableSpan(offset, &region);
+    if (span > remaining) {
+      span = remaining;
+    }
+    sum += calculateChecksum(region, span);
+    offset += span;
+    remaining -= span;
+  }
+  
+  return sum == rxRing.peek(TUYA_FRAME_HEADER_SIZE + len);
+}
+
+// Parse the DP records of a STATUS_REPORT frame sitting at the head of the ring
+void TuyaProtocol::processStatusReport(uint16_t len) {
+  uint16_t dataIndex = TUYA_FRAME_HEADER_SIZE;
+  uint16_t dataEnd = TUYA_FRAME_HEADER_SIZE + len;
+  
+  // Each DP record needs at least DPID + Type + Length (4 bytes)
+  while (dataIndex + 4 <= dataEnd) {
+    uint8_t dpid = rxRing.peek(dataIndex++);
+    uint8_t type = rxRing.peek(dataIndex++);
+    uint16_t dpLen = (rxRing.peek(dataIndex) << 8) | rxRing.peek(dataIndex + 1);
+    dataIndex += 2;
     
-    switch (rxState) {
-      case TuyaProtocolState::WAIT_HEADER_1:
-        if (byte == 0x55) {
-          rxBuffer[rxIndex++] = byte;
-          rxState = TuyaProtocolState::WAIT_HEADER_2;
-        }
-        break;
-        
-      case TuyaProtocolState::WAIT_HEADER_2:
-        if (byte == 0xAA) {
-          rxBuffer[rxIndex++] = byte;
-          rxState = TuyaProtocolState::WAIT_VERSION;
-        } else {
-          rxState = TuyaProtocolState::WAIT_HEADER_1;
-          rxIndex = 0;
+    // Validate data length doesn't exceed the frame
+    if (dataIndex + dpLen > dataEnd) {
+      // Invalid data point length
+      break;
+    }
+    
+    uint32_t value = 0;
+    bool validDataPoint = false;
+    
+    if (type == DP_TYPE_BOOL && dpLen == 1) {
+      value = rxRing.peek(dataIndex);
+      validDataPoint = true;
+    } else if ((type == DP_TYPE_VALUE || type == DP_TYPE_ENUM) && dpLen == 4) {
+      value = ((uint32_t)rxRing.peek(dataIndex) << 24) | ((uint32_t)rxRing.peek(dataIndex + 1) << 16) |
+              ((uint32_t)rxRing.peek(dataIndex + 2) << 8) | rxRing.peek(dataIndex + 3);
+      validDataPoint = true;
+    }
+    // Unknown or invalid data points are skipped
+    dataIndex += dpLen;
+    
+    if (validDataPoint && tuyaDataPointSlot(dpid) >= 0 && !isValidTuyaDataPoint(dpid, value)) {
+      // Corrupt or unexpected; keep it out of the shadow and away from the sketch
+      stats.rejectedReports++;
+      continue;
+    }
+    
+    if (validDataPoint) {
+      // A reported DP confirms any pending write to it
+      acknowledgeCommand(TUYA_CMD_STATUS_REPORT, dpid);
+      
+      // Only pass on values that differ from the known state
+      int8_t slot = tuyaDataPointSlot(dpid);
+      if (slot >= 0) {
+        shadow[slot].confirmed = true;
+        shadow[slot].confirmedValue = value;
+        if (syncActive) {
+          // Held until the sync completes
+          shadow[slot].known = true;
+          shadow[slot].value = value;
+          syncReported |= 1UL << slot;
+          syncLastReport = millis();
+          continue;
         }
-        break;
+        TuyaShadowEntry& entry = shadow[slot];
         
-      case TuyaProtocolState::WAIT_VERSION:
-        rxBuffer[rxIndex++] = byte;
-        rxState = TuyaProtocolState::WAIT_COMMAND;
-        break;
+        // Reports inside the ACK window of our own write are (usually) its echo
+        bool echo = entry.commanded && millis() - entry.commandedAt <= timing.commandTimeoutMs;
         
-      case TuyaProtocolState::WAIT_COMMAND:
-        currentCmd = byte;
-        rxBuffer[rxIndex++] = byte;
-        rxState = TuyaProtocolState::WAIT_LENGTH_HIGH;
-        break;
-        
-      case TuyaProtocolState::WAIT_LENGTH_HIGH:
-        expectedLen = byte << 8;
-        rxBuffer[rxIndex++] = byte;
-        rxState = TuyaProtocolState::WAIT_LENGTH_LOW;
-        break;
-        
-      case TuyaProtocolState::WAIT_LENGTH_LOW:
-        expectedLen |= byte;
-        rxBuffer[rxIndex++] = byte;
-        rxState = TuyaProtocolState::WAIT_DATA_AND_CHECKSUM;
-        break;
+        if (entry.known && entry.value == value) {
+          if (echo) {
+            stats.echoesAbsorbed++;
+          } else {
+            stats.suppressedReports++;
+          }
+          entry.commanded = false;
+          continue;
+        }
         
-      case TuyaProtocolState::WAIT_DATA_AND_CHECKSUM:
-        // Prevent buffer overflow
-        if (rxIndex < TUYA_RX_BUFFER_SIZE) {
-          rxBuffer[rxIndex++] = byte;
-        } else {
-          // Buffer overflow protection - reset state machine
-          rxState = TuyaProtocolState::WAIT_HEADER_1;
-          rxIndex = 0;
-          expectedLen = 0;
-          // Buffer overflow protection triggered
-          break;
+        if (isWriteParked(dpid)) {
+          // Echo of an earlier write; the newer value is about to go out and would be undone
+          stats.echoesAbsorbed++;
+          continue;
         }
         
-        if (rxIndex >= 6 + expectedLen + 1) {
-          if (currentCmd == TUYA_CMD_STATUS_REPORT) {
-            // Parse status report data points
-            uint16_t dataIndex = 6; // Skip header, version, cmd, length
-            while (dataIndex < 6 + expectedLen && dataIndex < rxIndex) {
-              // Validate we have enough bytes for header (DPID + Type + Length = 4 bytes)
-              if (dataIndex + 4 > rxIndex) {
-                break;
-              }
-              
-              uint8_t dpid = rxBuffer[dataIndex++];
-              uint8_t type = rxBuffer[dataIndex++];
-              uint16_t len = (rxBuffer[dataIndex] << 8) | rxBuffer[dataIndex + 1];
-              dataIndex += 2;
-              
-              // Validate data length doesn't exceed remaining buffer
-              if (dataIndex + len > rxIndex || len > 8) {  // Sanity check on length
-                // Invalid data point length
-                break;
-              }
-              
-              uint32_t value = 0;
-              bool validDataPoint = false;
-              
-              if (type == DP_TYPE_BOOL && len == 1) {
-                value = rxBuffer[dataIndex];
-                dataIndex += 1;
-                validDataPoint = true;
-              } else if ((type == DP_TYPE_VALUE || type == DP_TYPE_ENUM) && len == 4) {
-                value = (rxBuffer[dataIndex] << 24) | (rxBuffer[dataIndex + 1] << 16) | 
-                        (rxBuffer[dataIndex + 2] << 8) | rxBuffer[dataIndex + 3];
-                dataIndex += 4;
-                validDataPoint = true;
-              } else {
-                // Skip unknown or invalid data point
-                dataIndex += len;
-                // Skipping unknown data point
-              }
-              
-              // Call status callback if we have a valid data point and callback is registered
-              if (validDataPoint && deviceStatusCallback) {
-                deviceStatusCallback(dpid, value);
-                // Status update received
-              }
-            }
-          } else if (currentCmd == TUYA_CMD_HEARTBEAT) {
-            tuyaConnected = true;
-            lastHeartbeat = millis();
-          } else if (currentCmd == TUYA_CMD_NETWORK_STATUS) {
-            // MCU is requesting network status - respond with current Zigbee connection status
-            uint8_t status = zigbeeConnected ? NETWORK_STATUS_CONNECTED : NETWORK_STATUS_DISCONNECTED;
-            sendNetworkStatus(status);
-            // Network status request received
-          }
-          
-          rxState = TuyaProtocolState::WAIT_HEADER_1;
-          rxIndex = 0;
-          expectedLen = 0;
+        if (echo) {
+          // The MCU settled on something other than what we asked for
+          stats.echoMismatches++;
         }
-        break;
+        entry.known = true;
+        entry.value = value;
+        entry.commanded = false;
+      }
+      
+      if (deviceStatusCallback) {
+        deviceStatusCallback(dpid, value);
+      }
     }
   }
 }
 
+// Product info reply is a JSON string; keep it for diagnostics
+void TuyaProtocol::processProductInfo(uint16_t len) {
+  uint16_t copyLen = (len < TUYA_PRODUCT_INFO_SIZE - 1) ? len : TUYA_PRODUCT_INFO_SIZE - 1;
+  for (uint16_t i = 0; i < copyLen; i++) {
+    productInfo[i] = rxRing.peek(TUYA_FRAME_HEADER_SIZE + i);
+  }
+  productInfo[copyLen] = '\0';
+}
+
+// Forget everything we believe about the MCU and ask it for a full DP dump
+void TuyaProtocol::startSync(bool mcuRestarted) {
+  invalidateState();
+  syncAfterRestart = mcuRestarted;
+  syncActive = true;
+  syncStart = millis();
+  syncLastReport = syncStart;
+  syncReported = 0;
+  stats.syncs++;
+  
+  sendCommand(TUYA_CMD_PRODUCT_INFO, nullptr, 0, TuyaTxClass::SYNC);
+  sendCommand(TUYA_CMD_QUERY_STATUS, nullptr, 0, TuyaTxClass::SYNC);
+}
+
+// Finish the sync once every DP has reported, the dump has gone quiet or the
+// timeout passes, then deliver the collected values back to back
+void TuyaProtocol::updateSync() {
+  if (!syncActive) {
+    return;
+  }
+  
+  unsigned long now = millis();
+  const uint32_t allReported = (uint32_t)((1ULL << TUYA_DATA_POINT_COUNT) - 1);
+  bool complete = syncReported == allReported;
+  bool settled = syncReported != 0 && now - syncLastReport >= timing.syncSettleMs;
+  bool expired = now - syncStart >= timing.syncTimeoutMs;
+  
+  if (!complete && !settled && !expired) {
+    return;
+  }
+  
+  syncActive = false;
+  if (deviceStatusCallback) {
+    for (uint8_t i = 0; i < TUYA_DATA_POINT_COUNT; i++) {
+      if (syncReported & (1UL << i)) {
+        deviceStatusCallback(TUYA_DATA_POINT_TABLE[i].dpid, shadow[i].value);
+      }
+    }
+  }
+  if (syncCallback) {
+    syncCallback(syncAfterRestart);
+  }
+}
+
+unsigned long TuyaProtocol::heartbeatInterval() const {
+  return tuyaConnected ? timing.heartbeatIntervalMs : timing.heartbeatRetryMs;
+}
+
+// Time until update() next has timed work to do: heartbeat, link timeout,
+// command deadlines, parked writes or queued frames. Received data is signalled separately.
+unsigned long TuyaProtocol::msUntilNextEvent() const {
+  unsigned long now = millis();
+  unsigned long next = TIMER_NO_DEADLINE;
+  
+  auto consider = [&](unsigned long deadline) {
+    long remaining = (long)(deadline - now);
+    unsigned long wait = (remaining > 0) ? (unsigned long)remaining : 0;
+    if (wait < next) {
+      next = wait;
+    }
+  };
+  
+  consider(lastHeartbeatSent + heartbeatInterval() + 1);
+  if (tuyaConnected) {
+    consider(lastHeartbeat + timing.connectionTimeoutMs + 1);
+  }
+  
+  for (uint8_t i = 0; i < TUYA_MAX_PENDING_COMMANDS; i++) {
+    if (pendingCommands[i].status == TuyaCommandStatus::PENDING) {
+      consider(pendingCommands[i].deadline);
+    }
+  }
+  
+  for (uint8_t i = 0; i < TUYA_MAX_COALESCED_DPS; i++) {
+    if (coalesceSlots[i].pending) {
+      consider(coalesceSlots[i].lastSent + timing.coalesceWindowMs);
+    }
+  }
+  
+  if (rxStalled) {
+    consider(rxStallStart + timing.frameTimeoutMs);
+  }
+  
+  if (syncActive) {
+    consider(syncStart + timing.syncTimeoutMs);
+    if (syncReported != 0) {
+      consider(syncLastReport + timing.syncSettleMs);
+    }
+  }
+  
+  // Queued frames go out as soon as the wire is free (rounded up to the next ms)
+  for (uint8_t cls = 0; cls < TUYA_TX_CLASS_COUNT; cls++) {
+    if (txQueues[cls].count > 0) {
+      long busyUs = txBusy ? (long)(txFreeAt - micros()) : 0;
+      consider(now + ((busyUs > 0) ? (busyUs + 999) / 1000 : 0));
+      break;
+    }
+  }
+  
+  return next;
+}
+
 bool TuyaProtocol::isConnected() const {
   return tuyaConnected;
 }
\ No newline at end of file
@@ -20,6 +20,9 @@
 
 #include <Arduino.h>
 #include "SkyfanConfig.h"
+#include "TuyaRingBuffer.h"
+#include "TuyaDataPoints.h"
+#include "LatencyHistogram.h"
 // #include <SoftwareSerial.h>
 
 // External debug serial reference
@@ -33,22 +36,9 @@
 #define TUYA_CMD_NETWORK_STATUS 0x03
 #define TUYA_CMD_SEND_COMMAND 0x06
 #define TUYA_CMD_STATUS_REPORT 0x07
+#define TUYA_CMD_QUERY_STATUS 0x08
 
-// Fan Control Data Points (DPIDs)
-#define DP_FAN_SWITCH 1       // Boolean: Fan on/off
-#define DP_FAN_MODE 2         // Enum: 0=normal, 1=eco, 2=sleep
-#define DP_FAN_SPEED 3        // Value: Fan speed (0-5)
-#define DP_FAN_DIRECTION 8    // Enum: 0=forward, 1=reverse
-
-// Light Control Data Points (DPIDs)
-#define DP_LIGHT_SWITCH 15    // Boolean: Light on/off
-#define DP_LIGHT_DIMMER 16    // Value: Light brightness (0-5)
-#define DP_LIGHT_COLOUR_TEMP 19 // Enum: 0=warm(3000K), 1=natural(4200K), 2=cool(6500K)
-
-// Data Point Types
-#define DP_TYPE_BOOL 0x01
-#define DP_TYPE_VALUE 0x02
-#define DP_TYPE_ENUM 0x04
+// Data points (DP_* DPIDs and DP_TYPE_* types) are defined in TuyaDataPoints.h
 
 // Fan Mode Values
 #define FAN_MODE_NORMAL 0
@@ -68,41 +58,255 @@
 #define NETWORK_STATUS_DISCONNECTED 3  // Zigbee not connected to coordinator
 #define NETWORK_STATUS_CONNECTED 5     // Zigbee connected to coordinator
 
+// Frame layout: header(2) + version(1) + command(1) + length(2) + data + checksum(1)
+#define TUYA_FRAME_HEADER_SIZE 6
+#define TUYA_FRAME_OVERHEAD 7
+#define TUYA_DP_MAX_ENCODED_SIZE 8
+
+// Product info JSON reported by the MCU, e.g. {"p":"...","v":"1.0.0","m":0}
+#define TUYA_PRODUCT_INFO_SIZE 64
+
+// Returned by sendDataPoint() when the command could not be queued
+#define TUYA_INVALID_HANDLE 0xFF
+
+// Completion callback for queued commands: handle, DPID and final status
+typedef void (*TuyaCommandCallback)(uint8_t handle, uint8_t dpid, TuyaCommandStatus status);
+
+static_assert(TUYA_FRAME_OVERHEAD + TUYA_DATA_POINT_COUNT * TUYA_DP_MAX_ENCODED_SIZE <= TUYA_TX_FRAME_SIZE,
+              "A batch of every registered DP must fit one queued frame");
+static_assert(TUYA_TX_FRAME_SIZE <= 0xFF, "Queued frame lengths are stored in one byte");
+
+// Entry in the outstanding-request table. The DP records are kept so an
+// unacknowledged write can be resent.
+struct TuyaPendingCommand {
+  uint8_t handle;
+  uint8_t cmd;
+  uint8_t dpid;
+  TuyaCommandStatus status;
+  unsigned long sentAt;        // First send; the overall deadline runs from here
+  unsigned long deadline;      // ACK timeout, or the end of the backoff when retryScheduled
+  uint8_t attempts;
+  bool retryScheduled;
+  uint8_t payloadLen;
+  uint8_t payload[TUYA_TX_FRAME_SIZE - TUYA_FRAME_OVERHEAD];
+};
+
+// Latest pending write for one DPID, held back until its coalescing window elapses
+struct TuyaCoalesceSlot {
+  bool active;
+  bool pending;
+  uint8_t dpid;
+  uint8_t type;
+  uint32_t value;
+  unsigned long lastSent;
+};
+
+// Last known MCU value of one registered DP, and whether we set it ourselves
+struct TuyaShadowEntry {
+  bool known;
+  uint32_t value;
+  bool commanded;              // Value came from our write and the MCU has not reported it yet
+  unsigned long commandedAt;
+  bool confirmed;              // The MCU has reported this DP since the last sync
+  uint32_t confirmedValue;     // Restored when a write to it is given up on
+};
+
+// A frame waiting for the UART
+struct TuyaTxFrame {
+  uint8_t cmd;
+  uint8_t len;
+  unsigned long queuedAt;  // micros()
+  uint8_t data[TUYA_TX_FRAME_SIZE];
+};
+
+struct TuyaTxQueue {
+  TuyaTxFrame frames[TUYA_TX_QUEUE_DEPTH];
+  uint8_t head;
+  uint8_t count;
+};
+
+// Transmit queue statistics, one set per priority class
+struct TuyaTxClassStats {
+  uint32_t frames;             // Frames sent
+  uint32_t dropped;            // Frames refused because the class queue was full
+  uint32_t replaced;           // Queued housekeeping frames overwritten by a newer one of the same command
+  uint32_t promoted;           // Frames sent ahead of a higher class after waiting TUYA_TX_MAX_WAIT_MS
+  uint8_t depth;               // Frames queued now
+  uint8_t maxDepth;
+  uint64_t totalWaitUs;        // Queue-to-wire time summed over sent frames
+  uint32_t maxWaitUs;
+};
+
+// Link statistics
+struct TuyaProtocolStats {
+  uint32_t supersededWrites;   // Coalesced writes replaced by a newer value before being sent
+  uint32_t rxOverflowBytes;    // Received bytes dropped because the ring buffer was full
+  uint32_t suppressedWrites;   // DP writes dropped because the MCU already had the value
+  uint32_t suppressedReports;  // DP reports dropped because the value had not changed
+  uint32_t echoesAbsorbed;     // DP reports dropped because they only confirmed our own write
+  uint32_t echoMismatches;     // Reports within the ACK window that contradicted our write
+  uint32_t rejectedReports;    // Registered DPs reported with a value outside their range
+  uint32_t badChecksums;       // Frames rejected for a checksum mismatch
+  uint32_t oversizeFrames;     // Headers whose length could never fit the receive buffer
+  uint32_t frameTimeouts;      // Partial frames abandoned after the frame timeout
+  uint32_t resyncs;            // Times the decoder skipped ahead to the next 0x55AA
+  uint32_t bytesDiscarded;     // Bytes skipped while resynchronising
+  uint32_t syncs;              // Full-state syncs started (link up or MCU restart)
+  uint32_t mcuRestarts;        // Heartbeat replies showing the MCU had restarted
+  uint32_t commandsAcked;
+  uint32_t commandRetries;     // DP writes resent after an ACK timeout
+  uint32_t commandsTimedOut;   // DP writes given up on after every attempt
+  uint32_t writesReverted;     // Shadow values restored after a write was given up on
+  uint32_t heartbeatMisses;    // Heartbeats sent while the previous one was still unanswered
+  uint32_t linkDrops;          // Connection timeouts after the MCU had been answering
+  uint32_t framesSent;
+  uint32_t bytesSent;
+  uint32_t framesReceived;
+  uint32_t bytesReceived;
+};
+
+// One MCU link. Apart from the UART receive callback, which only fills rxRing, every
+// member belongs to the task that calls update(): the send paths claim command slots
+// and queue frames, and update() matches, retries and expires them with no locking.
 class TuyaProtocol {
 private:
   uint8_t tuyaBuffer[TUYA_BUFFER_SIZE];
   uint8_t responseBuffer[TUYA_BUFFER_SIZE];
   unsigned long lastHeartbeat;
+  unsigned long lastHeartbeatSent;
+  bool heartbeatUnanswered;
   bool tuyaConnected;
   void (*deviceStatusCallback)(uint8_t dpid, uint32_t value);
   HardwareSerial* serial;
+  void (*transmitHook)(const uint8_t* frame, uint16_t len);
+  void (*traceHook)(bool sent, const uint8_t* data, uint16_t len);
+  
+  // Receive path: filled from the UART event task, decoded in place by processResponse()
+  TuyaRingBuffer rxRing;
+  void (*receiveNotifyCallback)();
+  
+  bool rxStalled;
+  unsigned long rxStallStart;
   
-  // Internal state for response processing
-  TuyaProtocolState rxState;
-  uint8_t rxBuffer[TUYA_RX_BUFFER_SIZE];
-  uint16_t rxIndex;
-  uint16_t expectedLen;
-  uint8_t currentCmd;
+  void receiveFromUart();
+  void processStatusReport(uint16_t len);
+  void resynchronise();
+  bool frameStalled();
+  bool isFrameChecksumValid(uint16_t len) const;
+  
+  // Outstanding commands awaiting an ACK from the MCU (owning task only, see above)
+  TuyaPendingCommand pendingCommands[TUYA_MAX_PENDING_COMMANDS];
+  uint8_t nextHandle;
+  uint8_t nextPendingSlot;
+  TuyaCommandCallback commandCallback;
+  
+  // Multi-DP batch being assembled in tuyaBuffer
+  bool batchOpen;
+  bool batchUncoalesced;       // Bypasses the coalescing slots, see beginBatch()
+  uint16_t batchLen;
+  uint8_t batchFirstDpid;
+  
+  bool sendFrame(uint8_t cmd, uint16_t len, TuyaTxClass txClass);
+  bool appendDataPoint(uint8_t dpid, uint8_t type, uint32_t value);
+  void noteCommanded(uint8_t dpid, uint32_t value);
+  
+  // Priority transmit queue: one frame on the wire at a time, the next chosen by class
+  TuyaTxQueue txQueues[TUYA_TX_CLASS_COUNT];
+  TuyaTxClassStats txStats[TUYA_TX_CLASS_COUNT];
+  uint32_t baudRate;
+  bool txBusy;
+  unsigned long txFreeAt;      // micros() when the frame on the wire has gone out
+  
+  bool enqueueFrame(TuyaTxClass txClass, const uint8_t* frame, uint16_t len);
+  bool hasTxRoom(TuyaTxClass txClass) const;
+  int8_t nextTxClass(unsigned long now);
+  
+  // Per-DPID write coalescing
+  TuyaCoalesceSlot coalesceSlots[TUYA_MAX_COALESCED_DPS];
+  
+  bool admitWrite(uint8_t dpid, uint8_t type, uint32_t value);
+  void flushCoalescedWrites();
+  bool isWriteParked(uint8_t dpid) const;
+  void dropParkedWrite(uint8_t dpid);
+  
+  // Shadow state, indexed by position in TUYA_DATA_POINTS
+  TuyaShadowEntry shadow[TUYA_DATA_POINT_COUNT];
+  
+  // Full-state sync: DP reports are collected in the shadow and applied together
+  static_assert(TUYA_DATA_POINT_COUNT <= 32, "Sync tracks reported DPs in a 32-bit mask");
+  bool syncActive;
+  unsigned long syncStart;
+  unsigned long syncLastReport;
+  uint32_t syncReported;
+  bool syncAfterRestart;  // The MCU came up fresh, so its DPs are at power-on defaults
+  void (*syncCallback)(bool mcuRestarted);
+  char productInfo[TUYA_PRODUCT_INFO_SIZE];
+  
+  void startSync(bool mcuRestarted);
+  void updateSync();
+  void processProductInfo(uint16_t len);
+  unsigned long heartbeatInterval() const;
+  
+  // Network status last sent to the MCU (sent on the first update(), then on every change)
+  bool networkStatusSent;
+  bool lastZigbeeState;
+  
+  TuyaTimingProfile timing;
+  TuyaProtocolStats stats;
+  LatencyHistogram ackLatency;  // Send-to-ACK time of every acknowledged command
+  
+  uint8_t trackCommand(uint8_t cmd, uint8_t dpid, const uint8_t* payload, uint16_t len);
+  void acknowledgeCommand(uint8_t cmd, uint8_t dpid);
+  void expirePendingCommands();
+  void retryCommand(TuyaPendingCommand& entry, unsigned long now);
+  void revertCommand(const TuyaPendingCommand& entry);
+  bool isWriteSuperseded(const TuyaPendingCommand& entry, uint8_t dpid) const;
+  void completeCommand(TuyaPendingCommand& entry, TuyaCommandStatus status);
 
 public:
   TuyaProtocol(HardwareSerial* serialInterface);
   
-  void begin(uint32_t baudRate = MCU_SERIAL_BAUD_RATE);
+  void begin(uint32_t baudRate = MCU_SERIAL_BAUD_RATE, int8_t rxPin = -1, int8_t txPin = -1);  // -1 = UART default pin
   void update(bool zigbeeConnected);
+  unsigned long msUntilNextEvent() const;  // TIMER_NO_DEADLINE when only received data can wake it
   
-  // Core protocol functions
-  void sendCommand(uint8_t cmd, uint8_t* data, uint16_t len);
-  void sendDataPoint(uint8_t dpid, uint8_t type, uint32_t value);
+  // Core protocol functions. Frames are queued by priority class and handed to the
+  // UART one at a time; false if the class queue is full or the frame too long.
+  // Only serviceTransmit() puts frames on the wire, and update() ends with it; code
+  // that queues frames outside update() wakes its owner so the next pass sends them.
+  bool sendCommand(uint8_t cmd, uint8_t* data, uint16_t len, TuyaTxClass txClass = TuyaTxClass::USER);
+  void serviceTransmit();
+  uint8_t sendDataPoint(uint8_t dpid, uint8_t type, uint32_t value);
   void sendHeartbeat();
   void sendNetworkStatus(uint8_t status);
   
-  // Fan control functions (return false on validation failure)
+  // Multi-DP batching: DP writes between beginBatch() and commitBatch() go out
+  // as one SEND_COMMAND frame with a single ACK. The batch is built in the buffer
+  // update() also sends from, so both must be called from the same task.
+  // An uncoalesced batch sends every DP in its one frame even inside the coalescing
+  // window, and replaces any write still parked for those DPs.
+  void beginBatch(bool uncoalesced = false);
+  bool addDataPoint(uint8_t dpid, uint8_t type, uint32_t value);
+  uint8_t commitBatch();
+  bool isBatchEmpty() const { return batchLen == 0; }
+  
+  // Validated, typed write of any registered DP (descriptor resolved at compile time)
+  template<uint8_t DPID>
+  bool setDataPoint(uint32_t value) {
+    constexpr TuyaDataPoint dp = tuyaDataPoint<DPID>();
+    if (value < dp.min || value > dp.max) {
+      return false;
+    }
+    return addDataPoint(DPID, dp.type, value);
+  }
+  
+  // Fan control functions (return false on validation failure or full command table)
   bool setFanSwitch(bool on);
   bool setFanSpeed(uint8_t speed);
   bool setFanMode(uint8_t mode);
   bool setFanDirection(uint8_t direction);
   
-  // Light control functions (return false on validation failure)
+  // Light control functions (return false on validation failure or full command table)
   bool setLightSwitch(bool on);
   bool setLightBrightness(uint8_t brightness);
   bool setLightColourTemp(uint8_t colourTemp);
@@ -112,9 +316,51 @@ public:
   void processResponse(bool zigbeeConnected);
   void setDeviceStatusCallback(void (*callback)(uint8_t dpid, uint32_t value));
   
+  // Called from the UART event task whenever new bytes are buffered (use it to wake the main loop)
+  void setReceiveNotifyCallback(void (*callback)());
+  
+  // Link substitution for benchmarks and simulation: frames go to the hook instead of
+  // the UART, and injected bytes enter the receive path as if the MCU had sent them
+  void setTransmitHook(void (*hook)(const uint8_t* frame, uint16_t len));
+  uint16_t injectReceived(const uint8_t* data, uint16_t len);
+  
+  // Link tap for trace recording: every frame sent and every chunk of bytes received
+  // (from the UART event task, or injected). Observes only, unlike the transmit hook.
+  void setTraceHook(void (*hook)(bool sent, const uint8_t* data, uint16_t len));
+  
+  // Command pipeline status (non-blocking; ACKs are matched in processResponse(),
+  // and the callback runs there or in update(), on the owning task).
+  // Unacknowledged writes are resent with exponential backoff; once the attempts or
+  // the overall deadline run out the DPs revert to their last reported value (through
+  // the device status callback) before the command callback sees TIMED_OUT. A write
+  // whose DPs were all rewritten before its retry ends SUPERSEDED, which is no failure.
+  void setCommandCallback(TuyaCommandCallback callback);
+  TuyaCommandStatus getCommandStatus(uint8_t handle) const;
+  uint8_t pendingCommandCount() const;
+  
+  // Shadow state: last value reported by or written to the MCU
+  bool getDataPointState(uint8_t dpid, uint32_t* value) const;
+  void invalidateState();
+  
+  // Full-state sync, started automatically when the link comes up or the MCU restarts.
+  // The callback runs after the collected DP values have been delivered as one batch.
+  void setSyncCallback(void (*callback)(bool mcuRestarted));
+  bool isSyncing() const;
+  const char* getProductInfo() const;  // Empty until the MCU has answered
+  
+  // Write coalescing: repeated writes to a DP within the window collapse to the latest value
+  void setCoalesceWindow(unsigned long windowMs);
+  
+  // Runtime timing (heartbeat, timeouts, coalescing, sync); defaults come from SkyfanConfig.h
+  void setTimingProfile(const TuyaTimingProfile& profile);
+  const TuyaTimingProfile& getTimingProfile() const;
+  const TuyaProtocolStats& getStats() const;
+  const LatencyHistogram& getAckLatency() const;
+  const TuyaTxClassStats& getTxStats(TuyaTxClass txClass) const;
+  
   // Utility functions
-  static uint8_t calculateChecksum(uint8_t* data, uint16_t len);
-  bool waitForResponse(uint8_t expectedCmd, unsigned long timeout = TUYA_RESPONSE_TIMEOUT_MS);
+  static uint8_t calculateChecksum(const uint8_t* data, uint16_t len);
+  static uint16_t encodeDataPoint(uint8_t* out, uint8_t dpid, uint8_t type, uint32_t value);
 };
 
 #endif // TUYA_PROTOCOL_H
\ No newline at end of file
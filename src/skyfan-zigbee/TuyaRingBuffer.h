@@ -0,0 +1,89 @@
+/*
+ * Tuya Ring Buffer - Lock-free single-producer/single-consumer receive buffer
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TUYA_RING_BUFFER_H
+#define TUYA_RING_BUFFER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "SkyfanConfig.h"
+
+// The producer (UART event task) only moves head, the consumer (frame decoder)
+// only moves tail. Indices run freely and are masked on access.
+class TuyaRingBuffer {
+private:
+  static constexpr uint16_t CAPACITY = TUYA_RX_BUFFER_SIZE;
+  static constexpr uint16_t MASK = CAPACITY - 1;
+  static_assert((CAPACITY & MASK) == 0, "TUYA_RX_BUFFER_SIZE must be a power of two");
+
+  uint8_t buffer[CAPACITY];
+  std::atomic<uint16_t> head;
+  std::atomic<uint16_t> tail;
+
+public:
+  TuyaRingBuffer() : head(0), tail(0) {}
+
+  static constexpr uint16_t capacity() {
+    return CAPACITY;
+  }
+
+  // === Producer side ===
+
+  // Contiguous free region starting at the write position (may be shorter than freeSpace())
+  uint16_t writableSpan(uint8_t** region) {
+    uint16_t h = head.load(std::memory_order_relaxed);
+    uint16_t t = tail.load(std::memory_order_acquire);
+    uint16_t space = CAPACITY - (uint16_t)(h - t);
+    uint16_t toEnd = CAPACITY - (h & MASK);
+    *region = &buffer[h & MASK];
+    return (space < toEnd) ? space : toEnd;
+  }
+
+  // Publish bytes written into the region returned by writableSpan()
+  void commitWrite(uint16_t len) {
+    head.store(head.load(std::memory_order_relaxed) + len, std::memory_order_release);
+  }
+
+  // === Consumer side ===
+
+  uint16_t available() const {
+    return (uint16_t)(head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed));
+  }
+
+  // Read a byte relative to the read position without consuming it
+  uint8_t peek(uint16_t offset) const {
+    return buffer[(tail.load(std::memory_order_relaxed) + offset) & MASK];
+  }
+
+  // Contiguous readable region starting offset bytes past the read position
+  uint16_t readableSpan(uint16_t offset, const uint8_t** region) const {
+    uint16_t avail = available();
+    if (offset >= avail) {
+      return 0;
+    }
+    uint16_t t = tail.load(std::memory_order_relaxed) + offset;
+    uint16_t toEnd = CAPACITY - (t & MASK);
+    *region = &buffer[t & MASK];
+    return (avail - offset < toEnd) ? avail - offset : toEnd;
+  }
+
+  void consume(uint16_t len) {
+    tail.store(tail.load(std::memory_order_relaxed) + len, std::memory_order_release);
+  }
+};
+
+#endif // TUYA_RING_BUFFER_H
@@ -0,0 +1,400 @@
+/*
+ * Tuya Trace - Link trace recording and replay
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TUYA_TRACE_H
+#define TUYA_TRACE_H
+
+#include <Arduino.h>
+#include "SkyfanConfig.h"
+#include "TuyaProtocol.h"
+
+static_assert(!(SKYFAN_TRACE && SKYFAN_TRACE_REPLAY), "A replay reads the trace ring, so it cannot record at the same time");
+static_assert(!(SKYFAN_TRACE_REPLAY && SKYFAN_MCU_SIMULATOR), "Replay and the MCU simulator both replace the link");
+static_assert(!(SKYFAN_TRACE || SKYFAN_TRACE_REPLAY) || SKYFAN_FAN_COUNT == 1, "Trace records carry no fan index, so tracing needs a single fan");
+
+#if SKYFAN_TRACE || SKYFAN_TRACE_REPLAY
+
+// Record layout: timestamp (uint32 us, little-endian), event, payload length, payload
+#define TRACE_HEADER_SIZE         6
+#define TRACE_MAX_PAYLOAD         255
+#define TRACE_DUMP_LINE_BYTES     32
+#define TRACE_LINE_PREFIX         "TRACE "
+
+enum class TraceEvent : uint8_t {
+  MCU_RX = 1,            // Bytes from the MCU as they left the UART
+  MCU_TX = 2,            // One frame sent to the MCU
+  ZIGBEE_FAN_MODE = 3,   // mode
+  ZIGBEE_FAN_DIRECTION = 4,  // direction
+  ZIGBEE_LIGHT = 5,      // on, level, mired (low byte, high byte)
+  ZIGBEE_NETWORK = 6,    // connected
+  ZIGBEE_TRANSITION = 7, // hasLevel, level, hasColourTemp, colourTemp, durationMs (uint32, little-endian)
+  ZIGBEE_SCENE = 8       // SceneValues of a recall as applied (same build only)
+};
+
+struct TraceRecord {
+  uint32_t timestampUs;
+  TraceEvent event;
+  uint8_t len;
+  uint8_t data[TRACE_MAX_PAYLOAD];
+};
+
+// Byte ring of variable-length records. Producers are the UART event task, the loop
+// and the Zigbee task, so appends take a critical section; when the ring is full the
+// oldest records are dropped to make room, keeping the most recent history.
+class TuyaTrace {
+private:
+  static constexpr uint32_t CAPACITY = TRACE_BUFFER_SIZE;
+  static constexpr uint32_t MASK = CAPACITY - 1;
+  static_assert((CAPACITY & MASK) == 0, "TRACE_BUFFER_SIZE must be a power of two");
+
+  uint8_t buffer[CAPACITY];
+  uint32_t head;  // Free-running byte positions, masked on access
+  uint32_t tail;
+  portMUX_TYPE lock;
+  volatile bool recording;
+  uint32_t overwritten;  // Records dropped to make room
+
+  uint8_t at(uint32_t pos) const {
+    return buffer[pos & MASK];
+  }
+
+  void put(uint8_t value) {
+    buffer[head++ & MASK] = value;
+  }
+
+  void append(TraceEvent event, uint32_t timestampUs, const uint8_t* data, uint8_t len) {
+    uint32_t needed = TRACE_HEADER_SIZE + len;
+    while (CAPACITY - (head - tail) < needed) {
+      tail += TRACE_HEADER_SIZE + at(tail + 5);
+      overwritten++;
+    }
+    put(timestampUs & 0xFF);
+    put((timestampUs >> 8) & 0xFF);
+    put((timestampUs >> 16) & 0xFF);
+    put((timestampUs >> 24) & 0xFF);
+    put(static_cast<uint8_t>(event));
+    put(len);
+    for (uint8_t i = 0; i < len; i++) {
+      put(data[i]);
+    }
+  }
+
+  static int8_t hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+      return c - 'A' + 10;
+    }
+    return -1;
+  }
+
+public:
+  TuyaTrace() : head(0), tail(0), lock(portMUX_INITIALIZER_UNLOCKED), recording(false), overwritten(0) {}
+
+  void start() {
+    recording = true;
+  }
+
+  void stop() {
+    recording = false;
+    // Let an append that passed the check before the flag changed finish
+    portENTER_CRITICAL(&lock);
+    portEXIT_CRITICAL(&lock);
+  }
+
+  void clear() {
+    portENTER_CRITICAL(&lock);
+    head = tail = 0;
+    overwritten = 0;
+    portEXIT_CRITICAL(&lock);
+  }
+
+  // Append an event; payloads longer than one record are split
+  void record(TraceEvent event, const uint8_t* data, uint16_t len) {
+    if (!recording) {
+      return;
+    }
+    uint32_t now = micros();
+    portENTER_CRITICAL(&lock);
+    do {
+      uint8_t chunk = (len > TRACE_MAX_PAYLOAD) ? TRACE_MAX_PAYLOAD : len;
+      append(event, now, data, chunk);
+      data += chunk;
+      len -= chunk;
+    } while (len > 0);
+    portEXIT_CRITICAL(&lock);
+  }
+
+  uint32_t size() const {
+    return head - tail;
+  }
+
+  uint32_t getOverwritten() const {
+    return overwritten;
+  }
+
+  // Read the record starting cursor bytes into the trace and advance the cursor past it
+  bool read(uint32_t* cursor, TraceRecord* rec) const {
+    uint32_t available = head - tail;
+    if (*cursor + TRACE_HEADER_SIZE > available) {
+      return false;
+    }
+    uint32_t pos = tail + *cursor;
+    rec->timestampUs = at(pos) | (at(pos + 1) << 8) | (at(pos + 2) << 16) | ((uint32_t)at(pos + 3) << 24);
+    rec->event = static_cast<TraceEvent>(at(pos + 4));
+    rec->len = at(pos + 5);
+    if (*cursor + TRACE_HEADER_SIZE + rec->len > available) {
+      return false;
+    }
+    for (uint8_t i = 0; i < rec->len; i++) {
+      rec->data[i] = at(pos + TRACE_HEADER_SIZE + i);
+    }
+    *cursor += TRACE_HEADER_SIZE + rec->len;
+    return true;
+  }
+
+  // Print the trace as hex lines a host can save and send back for replay:
+  //   TRACE BEGIN <bytes> <records overwritten>
+  //   TRACE <up to 32 bytes of the record stream>
+  //   TRACE END
+  void dump(Print& out) {
+    bool wasRecording = recording;
+    stop();
+
+    uint32_t bytes = head - tail;
+    out.printf("\n" TRACE_LINE_PREFIX "BEGIN %lu %lu\n", (unsigned long)bytes, (unsigned long)overwritten);
+    for (uint32_t offset = 0; offset < bytes; offset += TRACE_DUMP_LINE_BYTES) {
+      out.print(TRACE_LINE_PREFIX);
+      for (uint32_t i = offset; i < offset + TRACE_DUMP_LINE_BYTES && i < bytes; i++) {
+        out.printf("%02x", at(tail + i));
+      }
+      out.println();
+    }
+    out.println(TRACE_LINE_PREFIX "END");
+
+    recording = wasRecording;
+  }
+
+  // Take back one dumped line. Returns true once the END line has been seen;
+  // BEGIN discards whatever was loaded before.
+  bool load(const char* line) {
+    if (strncmp(line, TRACE_LINE_PREFIX, strlen(TRACE_LINE_PREFIX)) != 0) {
+      return false;
+    }
+    line += strlen(TRACE_LINE_PREFIX);
+    if (strncmp(line, "BEGIN", 5) == 0) {
+      clear();
+      return false;
+    }
+    if (strncmp(line, "END", 3) == 0) {
+      return true;
+    }
+
+    while (line[0] && line[1]) {
+      int8_t high = hexValue(line[0]);
+      int8_t low = hexValue(line[1]);
+      if (high < 0 || low < 0 || head - tail >= CAPACITY) {
+        break;
+      }
+      put((high << 4) | low);
+      line += 2;
+    }
+    return false;
+  }
+};
+
+inline TuyaTrace linkTrace;
+
+#endif // SKYFAN_TRACE || SKYFAN_TRACE_REPLAY
+
+// Record a Zigbee callback with its arguments as payload bytes
+#if SKYFAN_TRACE
+#define TRACE_ZIGBEE(event, ...) \
+  do { \
+    const uint8_t traceData[] = { __VA_ARGS__ }; \
+    linkTrace.record(TraceEvent::event, traceData, sizeof(traceData)); \
+  } while (0)
+#else
+#define TRACE_ZIGBEE(event, ...) do { } while (0)
+#endif
+
+#if SKYFAN_TRACE_REPLAY
+
+#define TRACE_REPLAY_SETTLE_MS    TUYA_COMMAND_TIMEOUT_MS  // Wait for answers to the last input before scoring
+
+struct TraceReplayStats {
+  uint32_t records;
+  uint32_t framesMatched;    // Sent frames identical to the recorded ones
+  uint32_t framesDiffered;
+  uint32_t framesExtra;      // Sent after the recording ran out of frames
+  uint32_t framesMissing;    // Recorded frames that were never sent
+  uint32_t recordedUs;       // Span of the recording
+  uint32_t elapsedUs;        // Time the replay took
+};
+
+// Feeds a loaded trace back through TuyaProtocol: received bytes are injected at their
+// recorded times (divided by the replay speed), Zigbee callbacks are handed to the
+// sketch, and every frame TuyaProtocol sends is compared against the recorded frames
+// in order. The UART is never opened.
+class TraceReplayer {
+private:
+  static inline TraceReplayer* active = nullptr;
+
+  TuyaProtocol* link;
+  TuyaTrace* trace;
+  void (*zigbeeHandler)(TraceEvent event, const uint8_t* data, uint8_t len);
+  uint32_t inputCursor;
+  uint32_t frameCursor;
+  uint32_t firstTimestampUs;
+  uint32_t startUs;
+  uint32_t speed;
+  bool running;
+  bool settling;
+  uint32_t settleStartUs;
+  TraceRecord pending;
+  bool hasPending;
+  TraceReplayStats stats;
+
+  static void onTransmit(const uint8_t* frame, uint16_t len) {
+    if (active && active->running) {
+      active->compareFrame(frame, len);
+    }
+  }
+
+  void compareFrame(const uint8_t* frame, uint16_t len) {
+    TraceRecord expected;
+    while (trace->read(&frameCursor, &expected)) {
+      if (expected.event == TraceEvent::MCU_TX) {
+        if (expected.len == len && memcmp(expected.data, frame, len) == 0) {
+          stats.framesMatched++;
+        } else {
+          stats.framesDiffered++;
+        }
+        return;
+      }
+    }
+    stats.framesExtra++;
+  }
+
+  // Scaled time since the start of the recording at which a record is due
+  uint32_t dueUs(const TraceRecord& rec) const {
+    uint32_t offset = rec.timestampUs - firstTimestampUs;
+    return (speed > 0) ? offset / speed : 0;
+  }
+
+  void finish() {
+    running = false;
+    stats.elapsedUs = settleStartUs - startUs;
+
+    TraceRecord rec;
+    while (trace->read(&frameCursor, &rec)) {
+      if (rec.event == TraceEvent::MCU_TX) {
+        stats.framesMissing++;
+      }
+    }
+
+    Serial.printf("Replay: %lu records, recorded %lu ms, replayed in %lu ms\n",
+                  (unsigned long)stats.records, (unsigned long)(stats.recordedUs / 1000),
+                  (unsigned long)(stats.elapsedUs / 1000));
+    Serial.printf("Replay: frames matched %lu, differed %lu, extra %lu, missing %lu\n",
+                  (unsigned long)stats.framesMatched, (unsigned long)stats.framesDiffered,
+                  (unsigned long)stats.framesExtra, (unsigned long)stats.framesMissing);
+  }
+
+public:
+  TraceReplayer() : link(nullptr), trace(nullptr), zigbeeHandler(nullptr), inputCursor(0), frameCursor(0),
+                    firstTimestampUs(0), startUs(0), speed(TRACE_REPLAY_SPEED), running(false), settling(false),
+                    settleStartUs(0), hasPending(false), stats() {}
+
+  void attach(TuyaProtocol* protocol, TuyaTrace* source) {
+    link = protocol;
+    trace = source;
+    active = this;
+    link->setTransmitHook(onTransmit);
+  }
+
+  // 1 = original timing, N = N times faster, 0 = as fast as possible
+  void setSpeed(uint32_t replaySpeed) {
+    speed = replaySpeed;
+  }
+
+  void setZigbeeHandler(void (*handler)(TraceEvent event, const uint8_t* data, uint8_t len)) {
+    zigbeeHandler = handler;
+  }
+
+  void start() {
+    inputCursor = 0;
+    frameCursor = 0;
+    stats = TraceReplayStats();
+    hasPending = trace->read(&inputCursor, &pending);
+    firstTimestampUs = hasPending ? pending.timestampUs : 0;
+    startUs = micros();
+    running = true;
+    settling = false;
+    Serial.printf("Replaying %lu byte trace\n", (unsigned long)trace->size());
+  }
+
+  bool isRunning() const {
+    return running;
+  }
+
+  // Deliver every record that is due; returns the ms until the next one
+  unsigned long update() {
+    if (!running) {
+      return TIMER_NO_DEADLINE;
+    }
+
+    uint32_t now = micros() - startUs;
+    while (hasPending && dueUs(pending) <= now) {
+      stats.records++;
+      stats.recordedUs = pending.timestampUs - firstTimestampUs;
+      if (pending.event == TraceEvent::MCU_RX) {
+        link->injectReceived(pending.data, pending.len);
+      } else if (pending.event != TraceEvent::MCU_TX && zigbeeHandler) {
+        zigbeeHandler(pending.event, pending.data, pending.len);
+      }
+      hasPending = trace->read(&inputCursor, &pending);
+    }
+
+    // Owners may call early (the host tools do), so the settle time is kept here
+    if (!hasPending) {
+      if (!settling) {
+        settling = true;
+        settleStartUs = micros();
+      }
+      uint32_t settledUs = micros() - settleStartUs;
+      if (settledUs < TRACE_REPLAY_SETTLE_MS * 1000UL) {
+        return (TRACE_REPLAY_SETTLE_MS * 1000UL - settledUs + 999) / 1000;
+      }
+      finish();
+      return TIMER_NO_DEADLINE;
+    }
+    return (dueUs(pending) - now + 999) / 1000;
+  }
+
+  const TraceReplayStats& getStats() const {
+    return stats;
+  }
+};
+
+#endif // SKYFAN_TRACE_REPLAY
+
+#endif // TUYA_TRACE_H
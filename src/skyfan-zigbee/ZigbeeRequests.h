@@ -0,0 +1,95 @@
+/*
+ * Zigbee Requests - Hands fan and light changes from the Zigbee task to the main loop
+ * Copyright (C) 2025 Rhys Frederick at Front Left Speaker
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ZIGBEE_REQUESTS_H
+#define ZIGBEE_REQUESTS_H
+
+#include <Arduino.h>
+
+// Light state asked for by the coordinator
+struct LightRequest {
+  bool on;
+  uint8_t level;
+  uint16_t colourTempMired;
+};
+
+// The latest fan mode, fan direction and light state written by the coordinator.
+// The post functions are called from the Zigbee task; the take functions belong to
+// the main loop, which is the only task that talks to TuyaProtocol. A newer request
+// replaces one that has not been taken yet, as the MCU only needs the final state.
+class ZigbeeRequests {
+private:
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+  bool hasFanMode = false;
+  uint8_t fanMode = 0;
+  bool hasFanDirection = false;
+  uint8_t fanDirection = 0;
+  bool hasLight = false;
+  LightRequest light = {};
+
+public:
+  void postFanMode(uint8_t mode) {
+    portENTER_CRITICAL(&lock);
+    fanMode = mode;
+    hasFanMode = true;
+    portEXIT_CRITICAL(&lock);
+  }
+
+  void postFanDirection(uint8_t direction) {
+    portENTER_CRITICAL(&lock);
+    fanDirection = direction;
+    hasFanDirection = true;
+    portEXIT_CRITICAL(&lock);
+  }
+
+  void postLight(const LightRequest& request) {
+    portENTER_CRITICAL(&lock);
+    light = request;
+    hasLight = true;
+    portEXIT_CRITICAL(&lock);
+  }
+
+  bool takeFanMode(uint8_t* mode) {
+    portENTER_CRITICAL(&lock);
+    bool taken = hasFanMode;
+    *mode = fanMode;
+    hasFanMode = false;
+    portEXIT_CRITICAL(&lock);
+    return taken;
+  }
+
+  bool takeFanDirection(uint8_t* direction) {
+    portENTER_CRITICAL(&lock);
+    bool taken = hasFanDirection;
+    *direction = fanDirection;
+    hasFanDirection = false;
+    portEXIT_CRITICAL(&lock);
+    return taken;
+  }
+
+  bool takeLight(LightRequest* request) {
+    portENTER_CRITICAL(&lock);
+    bool taken = hasLight;
+    *request = light;
+    hasLight = false;
+    portEXIT_CRITICAL(&lock);
+    return taken;
+  }
+};
+
+#endif // ZIGBEE_REQUESTS_H
@@ -21,10 +21,24 @@
 #endif
 
 #include "Zigbee.h"
+#include "zboss_api.h"
 #include "SkyfanConfig.h"
+#include "SkyfanLog.h"
 #include "TuyaProtocol.h"
 #include "SkyfanZigbee.h"
+#include "SkyfanScheduler.h"
+#include "SkyfanSettings.h"
+#include "SkyfanScenes.h"
+#include "LightTransition.h"
+#include "ZigbeeRequests.h"
+#include "SkyfanReporter.h"
+#include "TuyaBenchmark.h"
+#include "TuyaFuzz.h"
+#include "TuyaMcuSimulator.h"
+#include "TuyaTrace.h"
+#include "SkyfanBridge.h"
 #include <HardwareSerial.h>
+#include <utility>
 
 #ifdef RGB_BUILTIN
 uint8_t led = RGB_BUILTIN;
@@ -35,297 +49,817 @@ uint8_t led = 2;
 DebouncedButton factoryResetButton(FACTORY_RESET_BUTTON_PIN);
 LedStatusIndicator statusLed(led);
 
-// Hardware UART for Tuya MCU communication
-HardwareSerial tuyaSerial(0);
-
-SkyfanZigbeeFanControl zbFanControl = SkyfanZigbeeFanControl(ZIGBEE_FAN_CONTROL_ENDPOINT);
-ZigbeeColorDimmableLight zbLight = ZigbeeColorDimmableLight(ZIGBEE_LIGHT_CONTROL_ENDPOINT);
-TuyaProtocol tuya(&tuyaSerial);
+// Main loop scheduler - each component arms a timer for its next deadline
+SkyfanScheduler scheduler;
+int8_t buttonTimer = -1;
+int8_t ledTimer = -1;
+int8_t zigbeeStatusTimer = -1;
+int8_t diagnosticsTimer = -1;
+int8_t reportTimer = -1;
+bool zigbeeConnected = false;
+
+// Attribute reports for MCU-originated changes, one frame per cluster
+SkyfanReporter reporter;
+
+// One fan MCU and the fan/light endpoint pair that controls it. SkyfanBridge maps
+// between the two; this side publishes to the endpoints and runs the timers.
+struct FanBridge : SkyfanBridge {
+  int8_t rxPin;
+  int8_t txPin;
+
+  SkyfanZigbeeFanControl zbFanControl;
+  SkyfanZigbeeLight zbLight;
+
+  int8_t tuyaTimer;
+  int8_t transitionTimer;
+  int8_t stateTimer;
+
+  // Coordinator writes waiting for the main loop to send them to the MCU
+  ZigbeeRequests zigbeeRequests;
+
+  // Protocol timing in use (compiled defaults until NVS or the coordinator override them)
+  TuyaTimingProfile timingProfile;
+  char timingKey[SETTINGS_KEY_SIZE];
+
+  // Key of the fan and light state kept in NVS by SkyfanBridge::deviceState
+  char stateKey[SETTINGS_KEY_SIZE];
+
+  // Scenes stored on this fan's endpoints, commands for them from the Zigbee task,
+  // and the DPs of a recall waiting out its merge window (main loop only)
+  SceneTable scenes;
+  char scenesKey[SETTINGS_KEY_SIZE];
+  int8_t sceneTimer;
+  SceneCommandQueue sceneCommands;
+  SceneValues sceneRecall;
+  bool sceneRecallHeld;
+
+  FanBridge(uint8_t uart, int8_t rxPin, int8_t txPin, uint8_t fanEndpoint, uint8_t lightEndpoint)
+    : SkyfanBridge(uart), rxPin(rxPin), txPin(txPin),
+      zbFanControl(fanEndpoint), zbLight(lightEndpoint),
+      tuyaTimer(-1), transitionTimer(-1), stateTimer(-1),
+      sceneTimer(-1), sceneRecall{}, sceneRecallHeld(false) {}
+
+protected:
+  // MCU state reaching an endpoint is reported by our reporter, never by the stack
+  bool publishFanMode(uint8_t mode) override {
+    markChanged(zbFanControl.getEndpoint(), ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL);
+    return zbFanControl.setFanMode(static_cast<ZigbeeFanMode>(mode));
+  }
 
-// USB Serial (Serial) is used for debug output
+  bool publishFanSpeed(uint8_t speed) override {
+    markChanged(zbFanControl.getEndpoint(), ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL);
+    return zbFanControl.setFanSpeed(speed);
+  }
 
-/********************* fan control callback functions **************************/
-void setFan(ZigbeeFanMode mode) {
-  switch (mode) {
-    case FAN_MODE_OFF:
-      tuya.setFanSwitch(false);
-      Serial.println("Fan mode: OFF");
-      break;
-    case FAN_MODE_LOW:
-      tuya.setFanSwitch(true);
-      if (!tuya.setFanSpeed(FAN_SPEED_LOW_TUYA)) {
-        Serial.println("Failed to set fan speed: LOW");
-      }
-      Serial.println("Fan mode: LOW");
-      break;
-    case FAN_MODE_MEDIUM:
-      tuya.setFanSwitch(true);
-      if (!tuya.setFanSpeed(FAN_SPEED_MEDIUM_TUYA)) {
-        Serial.println("Failed to set fan speed: MEDIUM");
-      }
-      Serial.println("Fan mode: MEDIUM");
-      break;
-    case FAN_MODE_HIGH:
-      tuya.setFanSwitch(true);
-      if (!tuya.setFanSpeed(FAN_SPEED_HIGH_TUYA)) {
-        Serial.println("Failed to set fan speed: HIGH");
-      }
-      Serial.println("Fan mode: HIGH");
-      break;
-    case FAN_MODE_ON:
-      tuya.setFanSwitch(true);
-      Serial.println("Fan mode: ON");
-      break;
-    default: Serial.printf("Unhandled fan mode: %d\n", mode); break;
+  bool publishFanDirection(uint8_t direction) override {
+    markChanged(zbFanControl.getEndpoint(), ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL);
+    return zbFanControl.setFanDirection(direction);
   }
-}
 
-// Fan direction control callback function
-void setFanDirection(uint8_t direction) {
-  if (tuya.setFanDirection(direction)) {
-    Serial.printf("Fan direction set to: %d (%s)\n", direction,
-      (direction == static_cast<uint8_t>(FanDirection::FORWARD)) ? "FORWARD" : "REVERSE");
-  } else {
-    Serial.printf("Failed to set fan direction: %d\n", direction);
+  bool publishLightState(bool on) override {
+    markChanged(zbLight.getEndpoint(), ESP_ZB_ZCL_CLUSTER_ID_ON_OFF);
+    return zbLight.setLightState(on);
   }
-}
 
-/********************* light control callback functions **************************/
-void setLight(bool on, uint8_t level, uint16_t colourTempMired) {
-  // Light callback - handle all light changes (on/off, brightness, colour temp)
-  tuya.setLightSwitch(on);
-  
-  if (on) {
-    // Convert Zigbee brightness (0-254) to Tuya brightness (0-5)
-    uint8_t tuyaBrightness = zigbeeBrightnessToTuya(level);
-    if (!tuya.setLightBrightness(tuyaBrightness)) {
-      Serial.printf("Failed to set light brightness: %d\n", tuyaBrightness);
-    }
-    
-    // Convert mired to Tuya colour temp values
-    ColourTempLevel tuyaColourTemp = miredToTuyaColourTemp(colourTempMired);
-    if (!tuya.setLightColourTemp(static_cast<uint8_t>(tuyaColourTemp))) {
-      Serial.printf("Failed to set light colour temperature: %d\n", static_cast<uint8_t>(tuyaColourTemp));
-    }
+  bool publishLightLevel(uint8_t level) override {
+    markChanged(zbLight.getEndpoint(), ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL);
+    return zbLight.setLightLevel(level);
   }
-  
-  Serial.printf("Light: %s, Level: %d, Temp: %d mired (%dK)\n", on ? "ON" : "OFF", level, colourTempMired, miredToKelvin(colourTempMired));
-}
 
-/********************* individual device status handlers **************************/
+  bool publishLightColourTemp(uint16_t mired) override {
+    markChanged(zbLight.getEndpoint(), ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL);
+    return zbLight.setLightColorTemperature(mired);
+  }
 
-// Handle fan switch status updates from MCU
-void handleFanSwitchStatus(uint32_t value) {
-  bool fanOn = (value != 0);
-  if (!zbFanControl.setFanState(fanOn)) {
-    Serial.printf("Failed to update Zigbee fan switch status: %s\n", fanOn ? "ON" : "OFF");
+  void linkPending() override {
+    scheduler.trigger(tuyaTimer);
   }
-  Serial.printf("Fan switch status: %s\n", fanOn ? "ON" : "OFF");
-}
 
-// Handle fan speed status updates from MCU
-void handleFanSpeedStatus(uint32_t value) {
-  uint8_t speed = static_cast<uint8_t>(value);
-  if (isValidTuyaFanSpeed(speed)) {
-    if (!zbFanControl.setFanSpeed(speed)) {
-      Serial.printf("Failed to update Zigbee fan speed status: %d\n", speed);
-    }
-    Serial.printf("Fan speed status: %d\n", speed);
-  } else {
-    Serial.printf("Invalid fan speed status received: %d\n", speed);
+  void transitionPending() override {
+    scheduler.trigger(transitionTimer);
   }
-}
 
-// Handle fan mode status updates from MCU (MCU-only, not exposed to Zigbee)
-void handleFanModeStatus(uint32_t value) {
-  uint8_t mode = static_cast<uint8_t>(value);
-  if (mode <= static_cast<uint8_t>(TuyaFanMode::SLEEP)) {
-    Serial.printf("Fan mode status: %d (%s)\n", mode, 
-      (mode == static_cast<uint8_t>(TuyaFanMode::NORMAL)) ? "NORMAL" :
-      (mode == static_cast<uint8_t>(TuyaFanMode::ECO)) ? "ECO" : "SLEEP");
-  } else {
-    Serial.printf("Invalid fan mode status received: %d\n", mode);
+  void stateChanged() override {
+    scheduler.trigger(stateTimer);
   }
-}
 
-// Handle fan direction status updates from MCU
-void handleFanDirectionStatus(uint32_t value) {
-  uint8_t direction = static_cast<uint8_t>(value);
-  if (direction <= static_cast<uint8_t>(FanDirection::REVERSE)) {
-    // Update custom manufacturer attribute for fan direction
-    if (!zbFanControl.setFanDirection(direction)) {
-      Serial.printf("Failed to update Zigbee fan direction status: %d\n", direction);
-    }
-    Serial.printf("Fan direction status: %d (%s)\n", direction, 
-      (direction == static_cast<uint8_t>(FanDirection::FORWARD)) ? "FORWARD" : "REVERSE");
-  } else {
-    Serial.printf("Invalid fan direction status received: %d\n", direction);
+private:
+  void markChanged(uint8_t endpoint, uint16_t clusterId) {
+    reporter.markChanged(endpoint, clusterId);
+    scheduler.trigger(reportTimer);
   }
-}
+};
+
+#define FAN_BRIDGE(uart, rxPin, txPin, fanEndpoint, lightEndpoint) { uart, rxPin, txPin, fanEndpoint, lightEndpoint },
+FanBridge fans[SKYFAN_FAN_COUNT] = { SKYFAN_FANS(FAN_BRIDGE) };
+#undef FAN_BRIDGE
+
+#if SKYFAN_MCU_SIMULATOR
+TuyaMcuSimulator mcuSimulator;  // Stands in for the first fan's MCU
+int8_t simulatorTimer = -1;
+#endif
+
+#if SKYFAN_TRACE || SKYFAN_TRACE_REPLAY
+int8_t traceTimer = -1;
+char traceLine[TRACE_DUMP_LINE_BYTES * 2 + sizeof(TRACE_LINE_PREFIX) + 1];
+uint8_t traceLineLen = 0;
+#endif
+
+#if SKYFAN_TRACE_REPLAY
+TraceReplayer traceReplayer;
+int8_t replayTimer = -1;
+#endif
+
+// USB Serial (Serial) is used for debug output
 
-// Handle light switch status updates from MCU
-void handleLightSwitchStatus(uint32_t value) {
-  bool lightOn = (value != 0);
-  if (!zbLight.setLightState(lightOn)) {
-    Serial.printf("Failed to update Zigbee light switch status: %s\n", lightOn ? "ON" : "OFF");
+// Shutdown hint: esp_restart() (factory reset, failed Zigbee start) saves pending changes
+void commitDeviceState() {
+  for (FanBridge& fan : fans) {
+    fan.deviceState.commit();
   }
-  Serial.printf("Light switch status: %s\n", lightOn ? "ON" : "OFF");
 }
 
-// Handle light brightness status updates from MCU
-void handleLightBrightnessStatus(uint32_t value) {
-  uint8_t tuyaBrightness = static_cast<uint8_t>(value);
-  
-  if (isValidTuyaBrightness(tuyaBrightness)) {
-    uint8_t zigbeeBrightness = tuyaBrightnessToZigbee(tuyaBrightness);
-    if (!zbLight.setLightLevel(zigbeeBrightness)) {
-      Serial.printf("Failed to update Zigbee light brightness: %d\n", zigbeeBrightness);
+/********************* scenes **************************/
+// The stack keeps group membership and the Scenes cluster attributes and answers
+// every scene command; the contents of each scene are kept here as Tuya DP values.
+// A recall is applied as one multi-DP frame per fan, so a group-wide scene change
+// costs one multicast and one UART frame per fan.
+
+// The current state of an endpoint's DPs, for Store Scene
+SceneValues captureScene(FanBridge& fan, uint16_t mask) {
+  SceneValues scene = {};
+  uint32_t value;
+  for (const TuyaDataPoint& dp : TUYA_DATA_POINT_TABLE) {
+    if ((mask & sceneDataPointBit(dp.dpid)) && fan.lastKnownState(dp.dpid, &value)) {
+      scene.set(dp.dpid, value);
     }
-    Serial.printf("Light brightness status: %d (Zigbee: %d)\n", tuyaBrightness, zigbeeBrightness);
-  } else {
-    Serial.printf("Invalid light brightness status received: %d\n", tuyaBrightness);
   }
+  return scene;
 }
 
-// Handle light colour temperature status updates from MCU
-void handleLightColourTempStatus(uint32_t value) {
-  uint8_t colourTempValue = static_cast<uint8_t>(value);
+// Scene contents given with Add Scene, as ZCL extension field sets (cluster id,
+// length, then the cluster's scene attributes in a fixed order)
+SceneValues parseSceneExtensions(const uint8_t* data, uint16_t len) {
+  SceneValues scene = {};
+  uint16_t index = 0;
   
-  if (colourTempValue <= static_cast<uint8_t>(ColourTempLevel::COOL)) {
-    ColourTempLevel colourLevel = static_cast<ColourTempLevel>(colourTempValue);
-    uint16_t colourTempMired = tuyaColourTempToMired(colourLevel);
+  while (index + 3 <= len) {
+    uint16_t clusterId = data[index] | (data[index + 1] << 8);
+    uint8_t setLen = data[index + 2];
+    const uint8_t* set = &data[index + 3];
+    index += 3 + setLen;
+    if (index > len) {
+      break;
+    }
+    if (setLen == 0) {
+      continue;
+    }
     
-    if (!zbLight.setLightColorTemperature(colourTempMired)) {
-      Serial.printf("Failed to update Zigbee light colour temperature: %d mired\n", colourTempMired);
+    switch (clusterId) {
+      case ESP_ZB_ZCL_CLUSTER_ID_ON_OFF:
+        scene.set(DP_LIGHT_SWITCH, set[0] ? 1 : 0);
+        break;
+      case ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL:
+        scene.set(DP_LIGHT_DIMMER, zigbeeBrightnessToTuya(set[0]));
+        break;
+      case ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL:
+        // Current X/Y, enhanced hue, saturation and colour loop come first
+        if (setLen >= 13) {
+          scene.set(DP_LIGHT_COLOUR_TEMP, static_cast<uint8_t>(miredToTuyaColourTemp(set[11] | (set[12] << 8))));
+        }
+        break;
+      case ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL:
+        {
+          bool on;
+          uint8_t speed;
+          if (zclFanModeToTuya(set[0], &on, &speed)) {
+            scene.set(DP_FAN_SWITCH, on ? 1 : 0);
+            if (speed != 0) {
+              scene.set(DP_FAN_SPEED, speed);
+            }
+          }
+        }
+        break;
+      default:
+        break;
     }
-    Serial.printf("Light colour temp status: %d (%d mired, %dK)\n", 
-      colourTempValue, colourTempMired, miredToKelvin(colourTempMired));
+  }
+  return scene;
+}
+
+void storeScene(FanBridge& fan, const SceneCommand& command, uint16_t mask, const SceneValues& scene) {
+  if (fan.scenes.store(command.groupId, command.sceneId, mask, scene)) {
+    LOG_EVENT(SCENE_STORED, fan.index, command.light ? "light" : "fan", command.sceneId, command.groupId);
   } else {
-    Serial.printf("Invalid light colour temperature status received: %d\n", colourTempValue);
+    LOG_EVENT(SCENE_TABLE_FULL, fan.index, command.sceneId, command.groupId);
   }
 }
 
-// Handle unknown/unsupported status updates from MCU
-void handleUnknownStatus(uint8_t dpid, uint32_t value) {
-  Serial.printf("Unknown status update - DPID: %d, Value: %d\n", dpid, value);
+// Scenes and Groups commands for one endpoint, checked and parsed in the Zigbee task.
+// Called before the stack handles them, which it still does (responses, membership,
+// scene attributes); false for the commands that leave the scene table alone.
+bool parseSceneCommand(bool light, uint16_t clusterId, uint8_t cmdId, const uint8_t* payload, uint16_t len,
+                       SceneCommand* command) {
+  *command = {};
+  command->clusterId = clusterId;
+  command->cmdId = cmdId;
+  command->light = light;
+  command->groupId = (len >= 2) ? (payload[0] | (payload[1] << 8)) : 0;
+  command->sceneId = (len >= 3) ? payload[2] : 0;
+  
+  if (clusterId == ESP_ZB_ZCL_CLUSTER_ID_GROUPS) {
+    return (cmdId == ESP_ZB_ZCL_CMD_GROUPS_REMOVE_GROUP && len >= 2) ||
+           cmdId == ESP_ZB_ZCL_CMD_GROUPS_REMOVE_ALL_GROUPS;
+  }
+  
+  switch (cmdId) {
+    case ESP_ZB_ZCL_CMD_SCENES_ADD_SCENE:
+      // Group, scene, transition time, then a length-prefixed name (0xFF = none)
+      if (len >= 6) {
+        uint16_t nameLen = (payload[5] == 0xFF) ? 0 : payload[5];
+        uint16_t extensions = 6 + nameLen;
+        if (extensions <= len) {
+          command->contents = parseSceneExtensions(&payload[extensions], len - extensions);
+          return true;
+        }
+      }
+      return false;
+    case ESP_ZB_ZCL_CMD_SCENES_STORE_SCENE:
+    case ESP_ZB_ZCL_CMD_SCENES_RECALL_SCENE:
+    case ESP_ZB_ZCL_CMD_SCENES_REMOVE_SCENE:
+      return len >= 3;
+    case ESP_ZB_ZCL_CMD_SCENES_REMOVE_ALL_SCENES:
+      return len >= 2;
+    default:
+      return false;
+  }
 }
 
-/********************* main device status callback function **************************/
-void onDeviceStatus(uint8_t dpid, uint32_t value) {
-  switch (dpid) {
-    case DP_FAN_SWITCH:
-      handleFanSwitchStatus(value);
-      break;
-      
-    case DP_FAN_SPEED:
-      handleFanSpeedStatus(value);
-      break;
-      
-    case DP_FAN_MODE:
-      handleFanModeStatus(value);
+// Carry out a queued scene command on the main loop; serviceScenes() saves the table
+void runSceneCommand(FanBridge& fan, const SceneCommand& command) {
+  uint16_t mask = command.light ? SCENE_LIGHT_DATA_POINTS : SCENE_FAN_DATA_POINTS;
+  
+  if (command.clusterId == ESP_ZB_ZCL_CLUSTER_ID_GROUPS) {
+    if (command.cmdId == ESP_ZB_ZCL_CMD_GROUPS_REMOVE_GROUP) {
+      fan.scenes.removeGroup(command.groupId, mask);
+    } else {
+      fan.scenes.removeAll(mask);
+    }
+    return;
+  }
+  
+  switch (command.cmdId) {
+    case ESP_ZB_ZCL_CMD_SCENES_ADD_SCENE:
+      storeScene(fan, command, mask, command.contents);
       break;
-      
-    case DP_FAN_DIRECTION:
-      handleFanDirectionStatus(value);
+    case ESP_ZB_ZCL_CMD_SCENES_STORE_SCENE:
+      storeScene(fan, command, mask, captureScene(fan, mask));
       break;
-      
-    case DP_LIGHT_SWITCH:
-      handleLightSwitchStatus(value);
+    case ESP_ZB_ZCL_CMD_SCENES_RECALL_SCENE:
+      // Both endpoints of a fan in the group get their own copy of a multicast recall;
+      // the halves are merged and applied together by serviceScenes()
+      if (!fan.scenes.recall(command.groupId, command.sceneId, mask, &fan.sceneRecall)) {
+        LOG_EVENT(SCENE_NOT_STORED, fan.index, command.light ? "light" : "fan", command.sceneId, command.groupId);
+      }
       break;
-      
-    case DP_LIGHT_DIMMER:
-      handleLightBrightnessStatus(value);
+    case ESP_ZB_ZCL_CMD_SCENES_REMOVE_SCENE:
+      fan.scenes.remove(command.groupId, command.sceneId, mask);
       break;
-      
-    case DP_LIGHT_COLOUR_TEMP:
-      handleLightColourTempStatus(value);
+    case ESP_ZB_ZCL_CMD_SCENES_REMOVE_ALL_SCENES:
+      fan.scenes.removeGroup(command.groupId, mask);
       break;
-      
     default:
-      handleUnknownStatus(dpid, value);
       break;
   }
 }
 
+/********************* light transitions **************************/
+// Raw ZCL commands reach us before the stack acts on them. Move-to-level and
+// move-to-colour-temperature carry a transition time that the attribute callbacks
+// never see, so note the target here and let the stack carry on (return false).
+// Scenes and Groups commands are queued for serviceScenes() the same way.
+bool onZigbeeRawCommand(uint8_t bufid) {
+  zb_zcl_parsed_hdr_t *cmd_info = ZB_BUF_GET_PARAM(bufid, zb_zcl_parsed_hdr_t);
+  const uint8_t *payload = (const uint8_t *)zb_buf_begin(bufid);
+  uint16_t len = zb_buf_len(bufid);
+  
+  if (cmd_info->is_common_command) {
+    return false;
+  }
+  uint8_t endpoint = ZB_ZCL_PARSED_HDR_SHORT_DATA(cmd_info).dst_endpoint;
+  FanBridge* fan = nullptr;
+  for (FanBridge& candidate : fans) {
+    if (endpoint == candidate.zbFanControl.getEndpoint() || endpoint == candidate.zbLight.getEndpoint()) {
+      fan = &candidate;
+    }
+  }
+  if (!fan) {
+    return false;
+  }
+  bool light = (endpoint == fan->zbLight.getEndpoint());
+  
+  if (cmd_info->cluster_id == ESP_ZB_ZCL_CLUSTER_ID_SCENES || cmd_info->cluster_id == ESP_ZB_ZCL_CLUSTER_ID_GROUPS) {
+    SceneCommand command;
+    if (parseSceneCommand(light, cmd_info->cluster_id, cmd_info->cmd_id, payload, len, &command)) {
+      if (fan->sceneCommands.post(command)) {
+        scheduler.trigger(fan->sceneTimer);
+      } else {
+        LOG_EVENT(SCENE_COMMAND_DROPPED, fan->index, cmd_info->cmd_id);
+      }
+    }
+    return false;
+  }
+  if (!light) {
+    return false;
+  }
+  
+  TransitionTarget target = {};
+  uint16_t transitionTime;  // 1/10 s, 0xFFFF = device default
+  
+  if (cmd_info->cluster_id == ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL &&
+      (cmd_info->cmd_id == ESP_ZB_ZCL_CMD_LEVEL_CONTROL_MOVE_TO_LEVEL ||
+       cmd_info->cmd_id == ESP_ZB_ZCL_CMD_LEVEL_CONTROL_MOVE_TO_LEVEL_WITH_ON_OFF) && len >= 3) {
+    target.hasLevel = true;
+    target.level = zigbeeBrightnessToTuya(payload[0]);
+    transitionTime = payload[1] | (payload[2] << 8);
+  } else if (cmd_info->cluster_id == ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL &&
+             cmd_info->cmd_id == ESP_ZB_ZCL_CMD_COLOR_CONTROL_MOVE_TO_COLOR_TEMPERATURE && len >= 4) {
+    target.hasColourTemp = true;
+    target.colourTemp = static_cast<uint8_t>(miredToTuyaColourTemp(payload[0] | (payload[1] << 8)));
+    transitionTime = payload[2] | (payload[3] << 8);
+  } else {
+    return false;
+  }
+  
+  target.durationMs = (transitionTime == 0xFFFF) ? 0 : transitionTime * 100UL;
+  if (target.durationMs >= TRANSITION_MIN_DURATION_MS) {
+    fan->requestTransition(target);
+  }
+  return false;
+}
+
+// Steps of a light transition, timed by SkyfanBridge::stepTransition()
+void serviceTransition(void* context) {
+  FanBridge& fan = *static_cast<FanBridge*>(context);
+  scheduler.schedule(fan.transitionTimer, fan.stepTransition());
+}
+
+/********************* scheduler event sources **************************/
+// Factory reset button edge
+void IRAM_ATTR onButtonEdge(void* arg) {
+  scheduler.triggerFromISR(buttonTimer);
+}
+
+/********************* command completion callback function **************************/
+void onCommandComplete(FanBridge& fan, uint8_t handle, uint8_t dpid, TuyaCommandStatus status) {
+#if SKYFAN_MCU_SIMULATOR
+  if (&fan.tuya == &fans[0].tuya) {
+    mcuSimulator.onCommandComplete(handle, status);
+  }
+#endif
+  if (status == TuyaCommandStatus::TIMED_OUT) {
+    LOG_EVENT(COMMAND_TIMEOUT, fan.index, dpid, handle);
+  }
+}
+
+/********************* per-fan callbacks **************************/
+// The Tuya and Zigbee callbacks carry no context, so each fan gets its own set of
+// captureless trampolines that pass it to the functions above
+template<uint8_t FAN>
+void bindFanCallbacks() {
+  FanBridge& fan = fans[FAN];
+
+  // Runs in the UART event task - just wake the main loop
+  fan.tuya.setReceiveNotifyCallback([]() { scheduler.trigger(fans[FAN].tuyaTimer); });
+  fan.tuya.setDeviceStatusCallback([](uint8_t dpid, uint32_t value) { fans[FAN].onDeviceStatus(dpid, value); });
+  fan.tuya.setCommandCallback([](uint8_t handle, uint8_t dpid, TuyaCommandStatus status) {
+    onCommandComplete(fans[FAN], handle, dpid, status);
+  });
+  fan.tuya.setSyncCallback([](bool mcuRestarted) { fans[FAN].onStateSynced(mcuRestarted); });
+
+  // Run in the Zigbee task - hand the change to the main loop, which owns the MCU link
+  fan.zbFanControl.onFanModeChange([](ZigbeeFanMode mode) {
+    fans[FAN].zigbeeRequests.postFanMode(static_cast<uint8_t>(mode));
+    scheduler.trigger(fans[FAN].tuyaTimer);
+  });
+  fan.zbFanControl.onFanDirectionChange([](uint8_t direction) {
+    fans[FAN].zigbeeRequests.postFanDirection(direction);
+    scheduler.trigger(fans[FAN].tuyaTimer);
+  });
+  fan.zbLight.onLightChangeTemp([](bool on, uint8_t level, uint16_t colourTempMired) {
+    fans[FAN].zigbeeRequests.postLight({ on, level, colourTempMired });
+    scheduler.trigger(fans[FAN].tuyaTimer);
+  });
+}
+
+template<uint8_t... FAN>
+void bindFanCallbacks(std::integer_sequence<uint8_t, FAN...>) {
+  (bindFanCallbacks<FAN>(), ...);
+}
+
 /********************* Arduino functions **************************/
 void setup() {
   Serial.begin(DEBUG_SERIAL_BAUD_RATE);  // USB Serial for debug output
-  tuya.begin(MCU_SERIAL_BAUD_RATE);
-  tuya.setDeviceStatusCallback(onDeviceStatus);
-  Serial.println("Skyfan Zigbee Controller Starting...");
+  skyfanLog.begin();
+  
+#if SKYFAN_BENCHMARK
+  TuyaBenchmark::run(&fans[0].serial);
+#endif
+#if SKYFAN_FUZZ
+  TuyaFuzz::run(&fans[0].serial);
+#endif
+  
+  // Register scheduler timers before any event source can fire
+  scheduler.begin();
+  buttonTimer = scheduler.addTimer(serviceButton);
+  ledTimer = scheduler.addTimer(serviceLed);
+  zigbeeStatusTimer = scheduler.addTimer(pollZigbeeStatus);
+  diagnosticsTimer = scheduler.addTimer(refreshDiagnostics);
+  reportTimer = scheduler.addTimer(serviceReports);
+  for (uint8_t i = 0; i < SKYFAN_FAN_COUNT; i++) {
+    FanBridge& fan = fans[i];
+    fan.index = i;
+    fan.tuyaTimer = scheduler.addTimer(serviceTuya, &fan);
+    fan.transitionTimer = scheduler.addTimer(serviceTransition, &fan);
+    fan.stateTimer = scheduler.addTimer(serviceDeviceState, &fan);
+    fan.sceneTimer = scheduler.addTimer(serviceScenes, &fan);
+  }
+  bindFanCallbacks(std::make_integer_sequence<uint8_t, SKYFAN_FAN_COUNT>());
+  attachInterruptArg(FACTORY_RESET_BUTTON_PIN, onButtonEdge, nullptr, CHANGE);
+  
+  for (FanBridge& fan : fans) {
+    loadFanSettings(fan);
+  }
+  esp_register_shutdown_handler(commitDeviceState);
+#if SKYFAN_MCU_SIMULATOR
+  // Loop the first fan's link back to the simulated MCU; its UART is never opened
+  simulatorTimer = scheduler.addTimer(serviceSimulator);
+  mcuSimulator.attach(&fans[0].tuya);
+#elif SKYFAN_TRACE_REPLAY
+  // The MCU side comes from a trace loaded over USB; the UART is never opened
+  replayTimer = scheduler.addTimer(serviceReplay);
+  traceReplayer.attach(&fans[0].tuya, &linkTrace);
+  traceReplayer.setZigbeeHandler(onReplayZigbee);
+#endif
+  for (uint8_t i = (SKYFAN_MCU_SIMULATOR || SKYFAN_TRACE_REPLAY) ? 1 : 0; i < SKYFAN_FAN_COUNT; i++) {
+    fans[i].tuya.begin(MCU_SERIAL_BAUD_RATE, fans[i].rxPin, fans[i].txPin);
+  }
+#if SKYFAN_TRACE
+  fans[0].tuya.setTraceHook(onLinkTrace);
+  linkTrace.start();
+#endif
+#if SKYFAN_TRACE || SKYFAN_TRACE_REPLAY
+  traceTimer = scheduler.addTimer(serviceTraceCommands);
+#endif
+  LOG_EVENT(STARTING);
 
   // Factory reset button is initialized in constructor
 
+  for (FanBridge& fan : fans) {
+    addFanEndpoints(fan);
+  }
+
+  // When all EPs are registered, start Zigbee in ROUTER mode
+  if (!Zigbee.begin(ZIGBEE_ROUTER)) {
+    LOG_EVENT(ZIGBEE_START_FAILED);
+    skyfanLog.flush(FACTORY_RESET_DELAY_MS);
+    ESP.restart();
+  }
+  esp_zb_raw_command_handler_register(onZigbeeRawCommand);
+  reporter.begin();  // Tracked attributes are reported by us alone
+  LOG_EVENT(ZIGBEE_CONNECTING);
+  
+  // Start every component once; from here on they re-arm their own timers.
+  // The join carries on in the background and is picked up by pollZigbeeStatus.
+  for (FanBridge& fan : fans) {
+    scheduler.schedule(fan.tuyaTimer, 0);
+  }
+  scheduler.schedule(buttonTimer, 0);
+  scheduler.schedule(ledTimer, 0);  // Lights the LED for the INITIALISING status it starts in
+  scheduler.schedule(zigbeeStatusTimer, 0);
+  scheduler.schedule(diagnosticsTimer, 0);
+  scheduler.schedule(reportTimer, 0);
+#if SKYFAN_MCU_SIMULATOR
+  scheduler.schedule(simulatorTimer, 0);
+#endif
+#if SKYFAN_TRACE || SKYFAN_TRACE_REPLAY
+  scheduler.schedule(traceTimer, 0);
+#endif
+}
+
+void loop() {
+  // Run due timers, then sleep until the next deadline or event
+  scheduler.run();
+}
+
+/********************* fan setup **************************/
+
+// Timing profile and saved state, each under a key of its own per fan
+void loadFanSettings(FanBridge& fan) {
+  fanSettingsKey(fan.timingKey, SETTINGS_KEY_TIMING, fan.index);
+  fanSettingsKey(fan.stateKey, SETTINGS_KEY_STATE, fan.index);
+  fanSettingsKey(fan.scenesKey, SETTINGS_KEY_SCENES, fan.index);
+
+  if (TimingProfileStore::load(&fan.timingProfile, fan.timingKey)) {
+    LOG_EVENT(TIMING_PROFILE_LOADED, fan.index);
+  }
+  if (fan.deviceState.load(fan.stateKey)) {
+    LOG_EVENT(DEVICE_STATE_LOADED, fan.index);
+  }
+  if (fan.scenes.load(fan.scenesKey)) {
+    LOG_EVENT(SCENES_LOADED, fan.index, fan.scenes.sceneCount());
+  }
+  fan.tuya.setTimingProfile(fan.timingProfile);
+}
+
+void addFanEndpoints(FanBridge& fan) {
   // Set Zigbee device name and model
-  zbFanControl.setManufacturerAndModel(ZIGBEE_DEVICE_MANUFACTURER, ZIGBEE_FAN_MODEL_NAME);
-  zbLight.setManufacturerAndModel(ZIGBEE_DEVICE_MANUFACTURER, ZIGBEE_LIGHT_MODEL_NAME);
+  fan.zbFanControl.setManufacturerAndModel(ZIGBEE_DEVICE_MANUFACTURER, ZIGBEE_FAN_MODEL_NAME);
+  fan.zbLight.setManufacturerAndModel(ZIGBEE_DEVICE_MANUFACTURER, ZIGBEE_LIGHT_MODEL_NAME);
 
   // Configure light colour capabilities to support colour temperature
-  zbLight.setLightColorCapabilities(ZIGBEE_COLOR_CAPABILITY_COLOR_TEMP);
-  
+  fan.zbLight.setLightColorCapabilities(ZIGBEE_COLOR_CAPABILITY_COLOR_TEMP);
+
   // Set colour temperature range (154-333 mired = 6500K-3000K)
-  zbLight.setLightColorTemperatureRange(ZIGBEE_COLOUR_TEMP_MIN_MIRED, ZIGBEE_COLOUR_TEMP_MAX_MIRED);
+  fan.zbLight.setLightColorTemperatureRange(ZIGBEE_COLOUR_TEMP_MIN_MIRED, ZIGBEE_COLOUR_TEMP_MAX_MIRED);
 
   // Set the fan mode sequence to LOW_MED_HIGH
-  zbFanControl.setFanModeSequence(FAN_MODE_SEQUENCE_LOW_MED_HIGH);
-
-  // Set callback functions for fan and light control
-  zbFanControl.onFanModeChange(setFan);
-  zbFanControl.onFanDirectionChange(setFanDirection);
-  zbLight.onLightChangeTemp(setLight);
+  fan.zbFanControl.setFanModeSequence(FAN_MODE_SEQUENCE_LOW_MED_HIGH);
 
   //Add endpoints to Zigbee Core
-  Serial.println("Adding ZigbeeFanControl endpoint to Zigbee Core");
-  Zigbee.addEndpoint(&zbFanControl);
-  Serial.println("Adding ZigbeeLight endpoint to Zigbee Core");
-  Zigbee.addEndpoint(&zbLight);
+  LOG_EVENT(ENDPOINT_ADDED, fan.index, "ZigbeeFanControl");
+  Zigbee.addEndpoint(&fan.zbFanControl);
+  LOG_EVENT(ENDPOINT_ADDED, fan.index, "ZigbeeLight");
+  Zigbee.addEndpoint(&fan.zbLight);
 
   // Add custom manufacturer attributes
-  zbFanControl.addCustomAttributes();
+  fan.zbFanControl.addCustomAttributes();
+  fan.zbFanControl.addTimingAttributes(fan.timingProfile);
+  fan.zbFanControl.addDiagnosticsCluster();
+  fan.zbFanControl.addSceneClusters();
+  fan.zbLight.addSceneClusters();
+
+  // Attributes carried by our own coalesced reports, and by no reports from the stack
+  uint8_t fanEndpoint = fan.zbFanControl.getEndpoint();
+  uint8_t lightEndpoint = fan.zbLight.getEndpoint();
+  reporter.track(fanEndpoint, ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL, ESP_ZB_ZCL_ATTR_FAN_CONTROL_FAN_MODE_ID);
+  reporter.track(fanEndpoint, ESP_ZB_ZCL_CLUSTER_ID_FAN_CONTROL, CUSTOM_ATTR_FAN_DIRECTION, VENTAIR_MANUFACTURER_CODE);
+  reporter.track(lightEndpoint, ESP_ZB_ZCL_CLUSTER_ID_ON_OFF, ESP_ZB_ZCL_ATTR_ON_OFF_ON_OFF_ID);
+  reporter.track(lightEndpoint, ESP_ZB_ZCL_CLUSTER_ID_LEVEL_CONTROL, ESP_ZB_ZCL_ATTR_LEVEL_CONTROL_CURRENT_LEVEL_ID);
+  reporter.track(lightEndpoint, ESP_ZB_ZCL_CLUSTER_ID_COLOR_CONTROL, ESP_ZB_ZCL_ATTR_COLOR_CONTROL_COLOR_TEMPERATURE_ID);
+}
 
-  // When all EPs are registered, start Zigbee in ROUTER mode
-  if (!Zigbee.begin(ZIGBEE_ROUTER)) {
-    Serial.println("Zigbee failed to start!");
-    Serial.println("Rebooting...");
-    ESP.restart();
+/********************* scheduled tasks **************************/
+
+// Tuya protocol (handles responses, heartbeat, connection status, command deadlines).
+// Each fan's link has its own timer, woken by its own UART, so no link waits on another.
+void serviceTuya(void* context) {
+  FanBridge& fan = *static_cast<FanBridge*>(context);
+  applyZigbeeRequests(fan);
+  fan.tuya.update(zigbeeConnected);
+  scheduler.schedule(fan.tuyaTimer, fan.tuya.msUntilNextEvent());
+}
+
+// Coordinator writes posted by the Zigbee callbacks since the last pass
+void applyZigbeeRequests(FanBridge& fan) {
+  uint8_t mode;
+  uint8_t direction;
+  LightRequest light;
+  if (fan.zigbeeRequests.takeFanMode(&mode)) {
+    fan.setFan(mode);
+  }
+  if (fan.zigbeeRequests.takeFanDirection(&direction)) {
+    fan.setFanDirection(direction);
   }
-  Serial.println("Connecting to network");
-  while (!Zigbee.connected()) {
-    Serial.print(".");
-    delay(ZIGBEE_CONNECTION_POLL_MS);
+  if (fan.zigbeeRequests.takeLight(&light)) {
+    fan.setLight(light.on, light.level, light.colourTempMired);
   }
-  Serial.println();
-  Serial.println("Zigbee connected successfully!");
 }
 
-void loop() {
-  // Update Tuya protocol (handles responses, heartbeat, connection status)
-  tuya.update(Zigbee.connected());
-  
-  // Update button state (non-blocking)
-  factoryResetButton.update();
-  
-  // Update LED status based on Zigbee state
-  updateLedStatus();
-  statusLed.update();
+// Factory reset button debounce and long press
+void serviceButton(void* context) {
+  unsigned long next = factoryResetButton.update();
   
   // Check for factory reset long press
   if (factoryResetButton.wasLongPressed()) {
-    Serial.println("Resetting Zigbee to factory and rebooting in 1s.");
+    LOG_EVENT(FACTORY_RESET);
+    // Group membership goes with the network, and the scenes with it
+    for (FanBridge& fan : fans) {
+      fan.scenes.removeAll(SCENE_FAN_DATA_POINTS | SCENE_LIGHT_DATA_POINTS);
+      fan.scenes.commit();
+    }
     delay(FACTORY_RESET_DELAY_MS);
     Zigbee.factoryReset();
   }
   
-  delay(MAIN_LOOP_DELAY_MS);
+  scheduler.schedule(buttonTimer, next);
+}
+
+#if SKYFAN_MCU_SIMULATOR
+void serviceSimulator(void* context) {
+  scheduler.schedule(simulatorTimer, mcuSimulator.update());
+  scheduler.trigger(fans[0].tuyaTimer);  // Sends the scripted load's writes and takes delivered replies
+}
+#endif
+
+#if SKYFAN_TRACE
+// Link tap from TuyaProtocol (sent frames from the loop, received bytes from the UART event task)
+void onLinkTrace(bool sent, const uint8_t* data, uint16_t len) {
+  linkTrace.record(sent ? TraceEvent::MCU_TX : TraceEvent::MCU_RX, data, len);
+}
+#endif
+
+#if SKYFAN_TRACE || SKYFAN_TRACE_REPLAY
+// Line commands over USB: "dump" and "clear" while recording, dumped TRACE lines to load a replay
+void serviceTraceCommands(void* context) {
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c != '\n' && c != '\r') {
+      if (traceLineLen < sizeof(traceLine) - 1) {
+        traceLine[traceLineLen++] = c;
+      }
+      continue;
+    }
+    if (traceLineLen == 0) {
+      continue;
+    }
+    traceLine[traceLineLen] = '\0';
+    traceLineLen = 0;
+    
+#if SKYFAN_TRACE
+    if (strcmp(traceLine, "dump") == 0) {
+      linkTrace.dump(Serial);
+    } else if (strcmp(traceLine, "clear") == 0) {
+      linkTrace.clear();
+    }
+#else
+    if (linkTrace.load(traceLine) && !traceReplayer.isRunning()) {
+      traceReplayer.start();
+      scheduler.schedule(replayTimer, 0);
+    }
+#endif
+  }
+  scheduler.schedule(traceTimer, TRACE_COMMAND_POLL_MS);
+}
+#endif
+
+#if SKYFAN_TRACE_REPLAY
+void serviceReplay(void* context) {
+  scheduler.schedule(replayTimer, traceReplayer.update());
+}
+
+// Recorded Zigbee callbacks go back through the same writers that recorded them
+void onReplayZigbee(TraceEvent event, const uint8_t* data, uint8_t len) {
+  if (!fans[0].replayZigbee(event, data, len) && event == TraceEvent::ZIGBEE_NETWORK && len >= 1) {
+    updateZigbeeConnected(data[0] != 0);
+  }
+}
+#endif
+
+void serviceLed(void* context) {
+  scheduler.schedule(ledTimer, statusLed.update());
+}
+
+// Zigbee has no connection-change callback, so sample it at a modest rate
+void pollZigbeeStatus(void* context) {
+#if !SKYFAN_TRACE_REPLAY
+  updateZigbeeConnected(Zigbee.connected());  // A replay takes this from the trace instead
+#endif
+  
+  updateLedStatus();
+  for (FanBridge& fan : fans) {
+    checkTimingProfile(fan);
+  }
+  scheduler.schedule(zigbeeStatusTimer, ZIGBEE_STATUS_POLL_INTERVAL_MS);
+}
+
+void updateZigbeeConnected(bool connected) {
+  if (connected == zigbeeConnected) {
+    return;
+  }
+  TRACE_ZIGBEE(ZIGBEE_NETWORK, connected);
+  zigbeeConnected = connected;
+  for (FanBridge& fan : fans) {
+    scheduler.schedule(fan.tuyaTimer, 0);  // Tell the MCU straight away
+  }
+  if (connected) {
+    LOG_EVENT(ZIGBEE_CONNECTED);
+    for (FanBridge& fan : fans) {
+      fan.restoreEndpointState();
+    }
+  } else {
+    LOG_EVENT(ZIGBEE_DISCONNECTED);
+  }
+}
+
+// Pick up timing attributes written by the coordinator, apply them live and persist them
+void checkTimingProfile(FanBridge& fan) {
+  TuyaTimingProfile requested;
+  if (!fan.zbFanControl.readTimingProfile(&requested) ||
+      memcmp(&requested, &fan.timingProfile, sizeof(TuyaTimingProfile)) == 0) {
+    return;
+  }
+  
+  if (!isValidTimingProfile(requested)) {
+    LOG_EVENT(TIMING_PROFILE_REJECTED, fan.index);
+    fan.zbFanControl.setTimingProfile(fan.timingProfile);
+    return;
+  }
+  
+  fan.timingProfile = requested;
+  fan.tuya.setTimingProfile(fan.timingProfile);
+  scheduler.schedule(fan.tuyaTimer, 0);  // Deadlines may have moved
+  
+  if (!TimingProfileStore::save(fan.timingProfile, fan.timingKey)) {
+    LOG_EVENT(TIMING_PROFILE_SAVE_FAILED, fan.index);
+  }
+  LOG_EVENT(TIMING_PROFILE_UPDATED, fan.index);
+}
+
+// Send the attribute reports that are due
+void serviceReports(void* context) {
+  scheduler.schedule(reportTimer, reporter.service());
+}
+
+// Save fan and light state once changes have gone quiet
+void serviceDeviceState(void* context) {
+  FanBridge& fan = *static_cast<FanBridge*>(context);
+  scheduler.schedule(fan.stateTimer, fan.deviceState.service());
+}
+
+// Carry out queued scene commands, apply a recalled scene once its merge window has
+// passed (or the other endpoint's recall has arrived), and save scene table changes
+void serviceScenes(void* context) {
+  FanBridge& fan = *static_cast<FanBridge*>(context);
+  SceneCommand command;
+  while (fan.sceneCommands.take(&command)) {
+    runSceneCommand(fan, command);
+  }
+  
+  if (fan.sceneRecall.known != 0) {
+    if (!fan.sceneRecallHeld) {
+      fan.sceneRecallHeld = true;
+      scheduler.schedule(fan.sceneTimer, SCENE_RECALL_MERGE_MS);
+      return;
+    }
+    SceneValues scene = fan.sceneRecall;
+    fan.sceneRecall.known = 0;
+    fan.sceneRecallHeld = false;
+    fan.applyScene(scene);
+  }
+  
+  if (!fan.scenes.commit()) {
+    LOG_EVENT(SCENES_SAVE_FAILED, fan.index);
+    scheduler.schedule(fan.sceneTimer, STATE_COMMIT_QUIET_MS);  // Try again later
+  }
+}
+
+// Copy each MCU link's statistics into its fan endpoint's Diagnostics cluster
+void refreshDiagnostics(void* context) {
+  for (FanBridge& fan : fans) {
+    const TuyaProtocolStats& stats = fan.tuya.getStats();
+    const LatencyHistogram& latency = fan.tuya.getAckLatency();
+  
+    SkyfanDiagnostics diag;
+    diag.framesSent = stats.framesSent;
+    diag.framesReceived = stats.framesReceived;
+    diag.commandsAcked = stats.commandsAcked;
+    diag.commandTimeouts = stats.commandsTimedOut;
+    diag.commandRetries = stats.commandRetries;
+    diag.frameErrors = stats.badChecksums + stats.oversizeFrames + stats.frameTimeouts;
+    diag.heartbeatMisses = stats.heartbeatMisses;
+    diag.linkDrops = stats.linkDrops;
+    diag.mcuRestarts = stats.mcuRestarts;
+    diag.echoesAbsorbed = stats.echoesAbsorbed;
+    diag.loopsDetected = fan.loopsDetected;
+    diag.reportsSent = reporter.getStats().reportsSent;
+    diag.stateCommits = fan.deviceState.getStats().commits;
+    diag.stateBytes = fan.deviceState.getStats().bytesWritten;
+    diag.suppressedWrites = stats.suppressedWrites;
+    diag.suppressedReports = stats.suppressedReports;
+    diag.suppressedUpdates = fan.zbFanControl.getSuppressedUpdates() + fan.zbLight.getSuppressedUpdates();
+    diag.ackLatencyP50 = latency.percentile(50);
+    diag.ackLatencyP95 = latency.percentile(95);
+    diag.ackLatencyP99 = latency.percentile(99);
+    diag.ackLatencyMax = latency.getMax();
+    fan.zbFanControl.setDiagnostics(diag);
+  }
+  
+  scheduler.schedule(diagnosticsTimer, DIAGNOSTICS_REFRESH_INTERVAL_MS);
 }
 
 // Update LED status based on current Zigbee network state
 void updateLedStatus() {
+  LedStatus status;
   if (esp_zb_bdb_is_factory_new()) {
-    statusLed.setStatus(LedStatus::FACTORY_NEW);
-  } else if (!Zigbee.connected()) {
-    statusLed.setStatus(LedStatus::INITIALISING);
+    status = LedStatus::FACTORY_NEW;
+  } else if (!zigbeeConnected) {
+    status = LedStatus::INITIALISING;
   } else {
-    statusLed.setStatus(LedStatus::CONNECTED);
+    status = LedStatus::CONNECTED;
+  }
+  
+  if (statusLed.setStatus(status)) {
+    scheduler.schedule(ledTimer, 0);
   }
 }